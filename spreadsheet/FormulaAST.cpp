@@ -4,11 +4,22 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <tuple>
+#include <utility>
 
 namespace ASTImpl {
 
@@ -67,17 +78,29 @@ namespace ASTImpl {
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
+    Position Shifted(Position pos, Position offset) {
+        return { pos.row + offset.row, pos.col + offset.col };
+    }
+
+    // offset is added to every cell position while printing
     class Expr {
     public:
         virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const std::function<std::variant<double, FormulaError>(Position)>& function) const = 0;
+        virtual void Print(std::ostream& out, Position offset) const = 0;
+        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const = 0;
+        virtual void Compile(Program& program) const = 0;
+        // appends the node and its children in pre-order, see Decoder
+        virtual void Serialize(std::string& out) const = 0;
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        // a range is only valid as an argument of a function
+        virtual bool IsRange() const {
+            return false;
+        }
+
+        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position offset,
             bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +109,7 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, precedence, offset);
 
             if (parens_needed) {
                 out << ')';
@@ -95,6 +118,28 @@ namespace ASTImpl {
     };
 
     namespace {
+        // the first byte of a serialized node
+        enum class NodeTag : std::uint8_t {
+            Number,
+            Cell,
+            Range,
+            Unary,
+            Binary,
+            Function,
+        };
+
+        // in the byte order of the machine, a serialized formula is read
+        // back where it was written
+        template <typename T>
+        void AppendValue(std::string& out, T value) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void AppendPosition(std::string& out, Position pos) {
+            AppendValue<std::int32_t>(out, pos.row);
+            AppendValue<std::int32_t>(out, pos.col);
+        }
+
         class BinaryOpExpr final : public Expr {
         public:
             enum Type : char {
@@ -111,18 +156,18 @@ namespace ASTImpl {
                 , rhs_(std::move(rhs)) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position offset) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
+                lhs_->Print(out, offset);
                 out << ' ';
-                rhs_->Print(out);
+                rhs_->Print(out, offset);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
+                lhs_->PrintFormula(out, precedence, offset);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, precedence, offset, /* right_child = */ true);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -142,39 +187,35 @@ namespace ASTImpl {
                 }
             }
 
-            double Evaluate(const std::function<std::variant<double, FormulaError>(Position)>& function) const override {
-                using namespace std::literals;
-                const double epsilon = 1e-6;
-                constexpr double max = std::numeric_limits<double>::max();
+            // the divisor is compiled first so that a zero divisor
+            // wins over an error in the dividend
+            void Compile(Program& program) const override {
+                if (type_ == Divide) {
+                    rhs_->Compile(program);
+                    program.code.push_back({OpCode::CheckDivisor});
+                    lhs_->Compile(program);
+                    program.code.push_back({OpCode::Divide});
+                    return;
+                }
+                lhs_->Compile(program);
+                rhs_->Compile(program);
                 switch (type_)
                 {
-                case (Add): 
-                    if (max - lhs_->Evaluate(function) < rhs_->Evaluate(function) || max - rhs_->Evaluate(function) < lhs_->Evaluate(function)) {
-                        throw FormulaError(FormulaError::Category::Div0);
-                    }
-                    return lhs_->Evaluate(function) + rhs_->Evaluate(function);
-                case (Subtract): 
-                    if (max - abs(lhs_->Evaluate(function)) < abs(rhs_->Evaluate(function)) || max - abs(rhs_->Evaluate(function)) < abs(lhs_->Evaluate(function))) {
-                        throw FormulaError(FormulaError::Category::Div0);
-                    }
-                    return lhs_->Evaluate(function) - rhs_->Evaluate(function);
-                case (Multiply):
-                    if (abs(lhs_->Evaluate(function)) * abs(rhs_->Evaluate(function)) == std::numeric_limits<double>::infinity()) {
-                        throw FormulaError(FormulaError::Category::Div0);
-                    }
-                    return lhs_->Evaluate(function) * rhs_->Evaluate(function);
-                case (Divide):
-                        if(rhs_->Evaluate(function) < epsilon && rhs_->Evaluate(function) > -1.0 * epsilon) {
-                        throw FormulaError(FormulaError::Category::Div0);
-                    }
-                    else {
-                        return lhs_->Evaluate(function) / rhs_->Evaluate(function);
-                    }
+                case (Add): program.code.push_back({OpCode::Add}); break;
+                case (Subtract): program.code.push_back({OpCode::Subtract}); break;
+                case (Multiply): program.code.push_back({OpCode::Multiply}); break;
                 default:
-                    throw FormulaException("wrong expr"s);
+                    throw FormulaException("wrong expr");
                 };
             }
 
+            void Serialize(std::string& out) const override {
+                AppendValue(out, NodeTag::Binary);
+                AppendValue(out, type_);
+                lhs_->Serialize(out);
+                rhs_->Serialize(out);
+            }
+
         private:
             Type type_;
             std::unique_ptr<Expr> lhs_;
@@ -194,30 +235,32 @@ namespace ASTImpl {
                 , operand_(std::move(operand)) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position offset) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
+                operand_->Print(out, offset);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, precedence, offset);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(const std::function<std::variant<double, FormulaError>(Position)>& function) const override {
-                using namespace std::literals;
-                switch (type_)
-                {
-                case (UnaryPlus): return operand_->Evaluate(function);
-                case (UnaryMinus): return (-1.0) * operand_->Evaluate(function);
-                default:
-                    throw FormulaException("wrong expr"s);
-                };
+            void Compile(Program& program) const override {
+                operand_->Compile(program);
+                if (type_ == UnaryMinus) {
+                    program.code.push_back({OpCode::Negate});
+                }
+            }
+
+            void Serialize(std::string& out) const override {
+                AppendValue(out, NodeTag::Unary);
+                AppendValue(out, type_);
+                operand_->Serialize(out);
             }
 
         private:
@@ -225,50 +268,200 @@ namespace ASTImpl {
             std::unique_ptr<Expr> operand_;
         };
 
+        void PrintCell(std::ostream& out, Position cell) {
+            if (!cell.IsValid()) {
+                out << FormulaError::Category::Ref;
+            }
+            else {
+                out << cell.ToString();
+            }
+        }
+
         class CellExpr final : public Expr {
         public:
             explicit CellExpr(const Position* cell)
                 : cell_(cell) {
             }
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                }
-                else {
-                    out << cell_->ToString();
-                }
+            void Print(std::ostream& out, Position offset) const override {
+                PrintCell(out, Shifted(*cell_, offset));
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+                Print(out, offset);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            double Evaluate(const std::function<std::variant<double, FormulaError>(Position)>& function) const override {
-                std::variant<double, FormulaError> result = function(*cell_);
-                if (std::holds_alternative< FormulaError>(result)) throw std::get<FormulaError>(result);
-                return std::get<double>(result);
+            void Compile(Program& program) const override {
+                auto it = std::lower_bound(program.cells.begin(), program.cells.end(), *cell_);
+                assert(it != program.cells.end() && *it == *cell_);
+                program.code.push_back({OpCode::PushCell, static_cast<std::uint32_t>(it - program.cells.begin())});
+            }
+
+            void Serialize(std::string& out) const override {
+                AppendValue(out, NodeTag::Cell);
+                AppendPosition(out, *cell_);
             }
 
         private:
             const Position* cell_;
         };
 
+        class RangeExpr final : public Expr {
+        public:
+            RangeExpr(const Position* first, const Position* last)
+                : first_(first)
+                , last_(last) {
+            }
+
+            void Print(std::ostream& out, Position offset) const override {
+                PrintCell(out, Shifted(*first_, offset));
+                out << ':';
+                PrintCell(out, Shifted(*last_, offset));
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+                Print(out, offset);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            bool IsRange() const override {
+                return true;
+            }
+
+            void Compile(Program& program) const override {
+                program.code.push_back({OpCode::AggregateRange, static_cast<std::uint32_t>(program.ranges.size())});
+                program.ranges.push_back({*first_, *last_});
+            }
+
+            void Serialize(std::string& out) const override {
+                AppendValue(out, NodeTag::Range);
+                AppendPosition(out, *first_);
+                AppendPosition(out, *last_);
+            }
+
+        private:
+            const Position* first_;
+            const Position* last_;
+        };
+
+        struct FunctionName {
+            Function function;
+            std::string_view name;
+        };
+
+        constexpr FunctionName FUNCTION_NAMES[] = {
+            {Function::Sum, "SUM"},
+            {Function::Average, "AVERAGE"},
+            {Function::Min, "MIN"},
+            {Function::Max, "MAX"},
+            {Function::Count, "COUNT"},
+        };
+
+        Function FindFunction(std::string_view name) {
+            for (const FunctionName& entry : FUNCTION_NAMES) {
+                if (entry.name == name) return entry.function;
+            }
+            throw ParsingError("Unknown function: " + std::string(name));
+        }
+
+        std::string_view GetFunctionName(Function function) {
+            for (const FunctionName& entry : FUNCTION_NAMES) {
+                if (entry.function == function) return entry.name;
+            }
+            assert(false);
+            return {};
+        }
+
+        class FunctionExpr final : public Expr {
+        public:
+            FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+                : function_(function)
+                , args_(std::move(args)) {
+            }
+
+            void Print(std::ostream& out, Position offset) const override {
+                out << '(' << GetFunctionName(function_);
+                for (const auto& arg : args_) {
+                    out << ' ';
+                    arg->Print(out, offset);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+                out << GetFunctionName(function_) << '(';
+                bool first = true;
+                for (const auto& arg : args_) {
+                    if (!first) out << ',';
+                    first = false;
+                    arg->PrintFormula(out, EP_ATOM, offset);
+                }
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            void Compile(Program& program) const override {
+                program.code.push_back({OpCode::BeginAggregate});
+                for (const auto& arg : args_) {
+                    arg->Compile(program);
+                    if (!arg->IsRange()) {
+                        program.code.push_back({OpCode::AggregateNumber});
+                    }
+                }
+                program.code.push_back({OpCode::EndAggregate, static_cast<std::uint32_t>(function_)});
+            }
+
+            void Serialize(std::string& out) const override {
+                AppendValue(out, NodeTag::Function);
+                AppendValue(out, function_);
+                AppendValue(out, static_cast<std::uint32_t>(args_.size()));
+                for (const auto& arg : args_) {
+                    arg->Serialize(out);
+                }
+            }
+
+        private:
+            Function function_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
+        // throws unless the expression is a value, not a range
+        void CheckOperand(const Expr& expr) {
+            if (expr.IsRange()) {
+                throw ParsingError("A range outside of a function");
+            }
+        }
+
+        // the upper left and the lower right corner of the range
+        // between two cells
+        std::pair<Position, Position> MakeRange(Position a, Position b) {
+            return {
+                {std::min(a.row, b.row), std::min(a.col, b.col)},
+                {std::max(a.row, b.row), std::max(a.col, b.col)},
+            };
+        }
+
         class NumberExpr final : public Expr {
         public:
             explicit NumberExpr(double value)
                 : value_(value) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, Position /* offset */) const override {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* offset */) const override {
                 out << value_;
             }
 
@@ -276,20 +469,160 @@ namespace ASTImpl {
                 return EP_ATOM;
             }
 
-            double Evaluate(const std::function<std::variant<double, FormulaError>(Position)>& function) const override {
-                return value_;
+            void Compile(Program& program) const override {
+                program.code.push_back({OpCode::PushNumber, static_cast<std::uint32_t>(program.constants.size())});
+                program.constants.push_back(value_);
+            }
+
+            void Serialize(std::string& out) const override {
+                AppendValue(out, NodeTag::Number);
+                AppendValue(out, value_);
             }
 
         private:
             double value_;
         };
 
+        // the value of a NUMBER token; too large a number is an error,
+        // too small a one is zero
+        double ParseNumber(std::string_view text) {
+            double value = 0;
+            const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+            if (error == std::errc::result_out_of_range) {
+                value = std::strtod(std::string(text).c_str(), nullptr);
+            }
+            else if (error != std::errc() || end != text.data() + text.size()) {
+                throw ParsingError("Invalid number: " + std::string(text));
+            }
+            if (std::isinf(value)) {
+                throw ParsingError("Invalid number: " + std::string(text));
+            }
+            return value;
+        }
+
+        Position ParseCell(std::string_view text) {
+            const Position value = Position::FromString(text);
+            if (!value.IsValid()) {
+                throw FormulaException("Invalid position: " + std::string(text));
+            }
+            return value;
+        }
+
+        // rebuilds an expression written by Expr::Serialize, checked as the
+        // parsers check the text of a formula
+        class Decoder {
+        public:
+            explicit Decoder(std::string_view data)
+                : data_(data) {
+            }
+
+            std::unique_ptr<Expr> ReadMain() {
+                auto root = ReadExpr();
+                CheckOperand(*root);
+                if (!data_.empty()) {
+                    throw ParsingError("Unexpected data after a formula");
+                }
+                return root;
+            }
+
+            std::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+        private:
+            template <typename T>
+            T Read() {
+                if (data_.size() < sizeof(T)) {
+                    throw ParsingError("Truncated formula");
+                }
+                T value;
+                std::memcpy(&value, data_.data(), sizeof(T));
+                data_.remove_prefix(sizeof(T));
+                return value;
+            }
+
+            const Position* ReadPosition() {
+                const int row = Read<std::int32_t>();
+                const int col = Read<std::int32_t>();
+                cells_.push_front({ row, col });
+                return &cells_.front();
+            }
+
+            std::unique_ptr<Expr> ReadOperand() {
+                auto operand = ReadExpr();
+                CheckOperand(*operand);
+                return operand;
+            }
+
+            std::unique_ptr<Expr> ReadExpr() {
+                switch (Read<NodeTag>()) {
+                case NodeTag::Number: {
+                    const double value = Read<double>();
+                    if (!std::isfinite(value)) {
+                        throw ParsingError("Invalid number");
+                    }
+                    return std::make_unique<NumberExpr>(value);
+                }
+                case NodeTag::Cell:
+                    return std::make_unique<CellExpr>(ReadPosition());
+                case NodeTag::Range: {
+                    const Position* first = ReadPosition();
+                    const Position* last = ReadPosition();
+                    if (first->row > last->row || first->col > last->col) {
+                        throw ParsingError("Invalid range");
+                    }
+                    return std::make_unique<RangeExpr>(first, last);
+                }
+                case NodeTag::Unary: {
+                    const auto type = Read<UnaryOpExpr::Type>();
+                    if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                        throw ParsingError("Invalid unary operator");
+                    }
+                    return std::make_unique<UnaryOpExpr>(type, ReadOperand());
+                }
+                case NodeTag::Binary: {
+                    const auto type = Read<BinaryOpExpr::Type>();
+                    if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract
+                        && type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                        throw ParsingError("Invalid binary operator");
+                    }
+                    auto lhs = ReadOperand();
+                    auto rhs = ReadOperand();
+                    return std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                }
+                case NodeTag::Function: {
+                    const auto function = Read<Function>();
+                    if (std::none_of(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES),
+                                     [function](const FunctionName& entry) { return entry.function == function; })) {
+                        throw ParsingError("Unknown function");
+                    }
+                    // every argument takes at least one byte
+                    const std::uint32_t count = Read<std::uint32_t>();
+                    if (count > data_.size()) {
+                        throw ParsingError("Truncated formula");
+                    }
+                    std::vector<std::unique_ptr<Expr>> args;
+                    args.reserve(count);
+                    for (std::uint32_t i = 0; i < count; ++i) {
+                        args.push_back(ReadExpr());
+                    }
+                    return std::make_unique<FunctionExpr>(function, std::move(args));
+                }
+                }
+                throw ParsingError("Unknown formula node");
+            }
+
+            std::string_view data_;
+            std::forward_list<Position> cells_;
+        };
+
         class ParseASTListener final : public FormulaBaseListener {
         public:
             std::unique_ptr<Expr> MoveRoot() {
                 assert(args_.size() == 1);
                 auto root = std::move(args_.front());
                 args_.clear();
+                CheckOperand(*root);
 
                 return root;
             }
@@ -303,6 +636,7 @@ namespace ASTImpl {
                 assert(args_.size() >= 1);
 
                 auto operand = std::move(args_.back());
+                CheckOperand(*operand);
 
                 UnaryOpExpr::Type type;
                 if (ctx->SUB()) {
@@ -318,26 +652,12 @@ namespace ASTImpl {
             }
 
             void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-                double value = 0;
-                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                std::istringstream in(valueStr);
-                in >> value;
-                if (!in) {
-                    throw ParsingError("Invalid number: " + valueStr);
-                }
-
-                auto node = std::make_unique<NumberExpr>(value);
+                auto node = std::make_unique<NumberExpr>(ParseNumber(ctx->NUMBER()->getSymbol()->getText()));
                 args_.push_back(std::move(node));
             }
 
             void exitCell(FormulaParser::CellContext* ctx) override {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid()) {
-                    throw FormulaException("Invalid position: " + value_str);
-                }
-
-                cells_.push_front(value);
+                cells_.push_front(ParseCell(ctx->CELL()->getSymbol()->getText()));
                 auto node = std::make_unique<CellExpr>(&cells_.front());
                 args_.push_back(std::move(node));
             }
@@ -349,6 +669,8 @@ namespace ASTImpl {
                 args_.pop_back();
 
                 auto lhs = std::move(args_.back());
+                CheckOperand(*lhs);
+                CheckOperand(*rhs);
 
                 BinaryOpExpr::Type type;
                 if (ctx->ADD()) {
@@ -369,6 +691,25 @@ namespace ASTImpl {
                 args_.back() = std::move(node);
             }
 
+            void exitRange(FormulaParser::RangeContext* ctx) override {
+                const auto [first, last] = MakeRange(ParseCell(ctx->CELL(0)->getSymbol()->getText()),
+                                                     ParseCell(ctx->CELL(1)->getSymbol()->getText()));
+                cells_.push_front(first);
+                const Position* first_ptr = &cells_.front();
+                cells_.push_front(last);
+                args_.push_back(std::make_unique<RangeExpr>(first_ptr, &cells_.front()));
+            }
+
+            void exitFunction(FormulaParser::FunctionContext* ctx) override {
+                const size_t arg_count = ctx->expr().size();
+                assert(args_.size() >= arg_count);
+                const Function function = FindFunction(ctx->NAME()->getSymbol()->getText());
+                std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - arg_count),
+                                                        std::make_move_iterator(args_.end()));
+                args_.resize(args_.size() - arg_count);
+                args_.push_back(std::make_unique<FunctionExpr>(function, std::move(args)));
+            }
+
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
                 throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
             }
@@ -388,36 +729,314 @@ namespace ASTImpl {
             }
         };
 
+        // Recursive descent over the language of Formula.g4 without a parse
+        // tree: operands are parsed by precedence climbing, unary operators
+        // bind tighter than binary ones and binary operators are left
+        // associative, the same AST as the listener builds; the tokens are
+        // views into the text, which outlives the parser
+        class DirectParser {
+        public:
+            explicit DirectParser(std::string_view text)
+                : text_(text) {
+                Advance();
+            }
+
+            std::unique_ptr<Expr> ParseMain() {
+                auto root = ParseExpr(EP_ADD_LEVEL);
+                if (token_.type != Token::End) Fail();
+                if (deferred_error_) std::rethrow_exception(deferred_error_);
+                CheckOperand(*root);
+                return root;
+            }
+
+            std::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+        private:
+            struct Token {
+                enum Type { Number, Cell, Name, Add, Sub, Mul, Div, LeftParen, RightParen, Colon, Comma, End };
+                Type type = End;
+                std::string_view text;
+            };
+
+            // binary operator levels, a higher one binds tighter
+            static constexpr int EP_ADD_LEVEL = 0;
+            static constexpr int EP_MUL_LEVEL = 1;
+
+            [[noreturn]] void Fail() const {
+                throw ParsingError("Error when parsing: " + std::string(token_.text));
+            }
+
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsUpper(char c) {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            size_t SkipDigits(size_t pos) const {
+                while (pos < text_.size() && IsDigit(text_[pos])) ++pos;
+                return pos;
+            }
+
+            // longest match, as the generated lexer does
+            void Advance() {
+                while (pos_ < text_.size()
+                       && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+                    ++pos_;
+                }
+                const size_t begin = pos_;
+                if (pos_ == text_.size()) {
+                    token_ = { Token::End, {} };
+                    return;
+                }
+
+                const char c = text_[pos_];
+                auto single = [&](Token::Type type) {
+                    token_ = { type, text_.substr(pos_++, 1) };
+                };
+                switch (c) {
+                case '+': return single(Token::Add);
+                case '-': return single(Token::Sub);
+                case '*': return single(Token::Mul);
+                case '/': return single(Token::Div);
+                case '(': return single(Token::LeftParen);
+                case ')': return single(Token::RightParen);
+                case ':': return single(Token::Colon);
+                case ',': return single(Token::Comma);
+                default: break;
+                }
+
+                if (IsDigit(c) || (c == '.' && pos_ + 1 < text_.size() && IsDigit(text_[pos_ + 1]))) {
+                    pos_ = SkipDigits(pos_);
+                    if (pos_ + 1 < text_.size() && text_[pos_] == '.' && IsDigit(text_[pos_ + 1])) {
+                        pos_ = SkipDigits(pos_ + 1);
+                    }
+                    if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+                        size_t exponent = pos_ + 1;
+                        if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) ++exponent;
+                        if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                            pos_ = SkipDigits(exponent);
+                        }
+                    }
+                    token_ = { Token::Number, text_.substr(begin, pos_ - begin) };
+                    return;
+                }
+                if (IsUpper(c)) {
+                    size_t letters_end = pos_;
+                    while (letters_end < text_.size() && IsUpper(text_[letters_end])) ++letters_end;
+                    const size_t end = SkipDigits(letters_end);
+                    pos_ = end;
+                    token_ = { end > letters_end ? Token::Cell : Token::Name, text_.substr(begin, pos_ - begin) };
+                    return;
+                }
+                throw ParsingError("Error when lexing: " + std::string(text_.substr(begin, 1)));
+            }
+
+            // the listener sees the tokens only after the whole text is
+            // parsed, so a syntax error wins over e.g. an invalid number or
+            // cell, and the first such error in the order of the listener's
+            // exit events is reported once parsing is done
+            template <typename Check>
+            void Defer(Check check) {
+                try {
+                    check();
+                }
+                catch (...) {
+                    if (!deferred_error_) deferred_error_ = std::current_exception();
+                }
+            }
+
+            std::unique_ptr<Expr> ParseExpr(int min_level) {
+                auto lhs = ParseUnary();
+                while (true) {
+                    BinaryOpExpr::Type type;
+                    int level;
+                    switch (token_.type) {
+                    case Token::Add: type = BinaryOpExpr::Add; level = EP_ADD_LEVEL; break;
+                    case Token::Sub: type = BinaryOpExpr::Subtract; level = EP_ADD_LEVEL; break;
+                    case Token::Mul: type = BinaryOpExpr::Multiply; level = EP_MUL_LEVEL; break;
+                    case Token::Div: type = BinaryOpExpr::Divide; level = EP_MUL_LEVEL; break;
+                    default: return lhs;
+                    }
+                    if (level < min_level) return lhs;
+                    Advance();
+                    auto rhs = ParseExpr(level + 1);
+                    Defer([&] {
+                        CheckOperand(*lhs);
+                        CheckOperand(*rhs);
+                    });
+                    lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                }
+            }
+
+            std::unique_ptr<Expr> ParseUnary() {
+                switch (token_.type) {
+                case Token::Add:
+                case Token::Sub: {
+                    const auto type = token_.type == Token::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+                    Advance();
+                    auto operand = ParseUnary();
+                    Defer([&] {
+                        CheckOperand(*operand);
+                    });
+                    return std::make_unique<UnaryOpExpr>(type, std::move(operand));
+                }
+                case Token::LeftParen: {
+                    Advance();
+                    auto expr = ParseExpr(EP_ADD_LEVEL);
+                    if (token_.type != Token::RightParen) Fail();
+                    Advance();
+                    return expr;
+                }
+                case Token::Number: {
+                    double value = 0;
+                    Defer([&] {
+                        value = ParseNumber(token_.text);
+                    });
+                    Advance();
+                    return std::make_unique<NumberExpr>(value);
+                }
+                case Token::Cell: {
+                    const std::string_view text = token_.text;
+                    Advance();
+                    if (token_.type == Token::Colon) {
+                        return ParseRange(text);
+                    }
+                    cells_.emplace_front();
+                    Defer([&] {
+                        cells_.front() = ParseCell(text);
+                    });
+                    return std::make_unique<CellExpr>(&cells_.front());
+                }
+                case Token::Name:
+                    return ParseFunction();
+                default:
+                    Fail();
+                }
+            }
+
+            // the colon after the first cell is the current token
+            std::unique_ptr<Expr> ParseRange(std::string_view first_text) {
+                Advance();
+                if (token_.type != Token::Cell) Fail();
+                const std::string_view last_text = token_.text;
+                Advance();
+
+                cells_.emplace_front();
+                Position* first = &cells_.front();
+                cells_.emplace_front();
+                Position* last = &cells_.front();
+                Defer([&] {
+                    std::tie(*first, *last) = MakeRange(ParseCell(first_text), ParseCell(last_text));
+                });
+                return std::make_unique<RangeExpr>(first, last);
+            }
+
+            std::unique_ptr<Expr> ParseFunction() {
+                const std::string_view name = token_.text;
+                Advance();
+                if (token_.type != Token::LeftParen) Fail();
+                Advance();
+
+                std::vector<std::unique_ptr<Expr>> args;
+                if (token_.type != Token::RightParen) {
+                    args.push_back(ParseExpr(EP_ADD_LEVEL));
+                    while (token_.type == Token::Comma) {
+                        Advance();
+                        args.push_back(ParseExpr(EP_ADD_LEVEL));
+                    }
+                }
+                if (token_.type != Token::RightParen) Fail();
+                Advance();
+
+                Function function = Function::Sum;
+                Defer([&] {
+                    function = FindFunction(name);
+                });
+                return std::make_unique<FunctionExpr>(function, std::move(args));
+            }
+
+            std::string_view text_;
+            size_t pos_ = 0;
+            Token token_;
+            std::forward_list<Position> cells_;
+            std::exception_ptr deferred_error_;
+        };
+
     }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+namespace {
+    std::atomic<FormulaParserKind> default_parser = FormulaParserKind::Antlr;
 
-    ANTLRInputStream input(in);
+    FormulaAST ParseWithAntlr(std::istream& in) {
+        using namespace antlr4;
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+        ANTLRInputStream input(in);
 
-    CommonTokenStream tokens(&lexer);
+        FormulaLexer lexer(&input);
+        ASTImpl::BailErrorListener error_listener;
+        lexer.removeErrorListeners();
+        lexer.addErrorListener(&error_listener);
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+        CommonTokenStream tokens(&lexer);
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+        FormulaParser parser(&tokens);
+        auto error_handler = std::make_shared<BailErrorStrategy>();
+        parser.setErrorHandler(error_handler);
+        parser.removeErrorListeners();
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+        tree::ParseTree* tree = parser.main();
+        ASTImpl::ParseASTListener listener;
+        tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+        return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    }
+}  // namespace
+
+void SetFormulaParser(FormulaParserKind kind) {
+    default_parser.store(kind, std::memory_order_relaxed);
+}
+
+FormulaParserKind GetFormulaParser() {
+    return default_parser.load(std::memory_order_relaxed);
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    if (GetFormulaParser() == FormulaParserKind::Antlr) {
+        return ParseWithAntlr(in);
+    }
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(text, FormulaParserKind::Handwritten);
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaAST(in_str, GetFormulaParser());
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str, FormulaParserKind kind) {
+    if (kind == FormulaParserKind::Antlr) {
+        std::istringstream in(in_str);
+        return ParseWithAntlr(in);
+    }
+    ASTImpl::DirectParser parser(in_str);
+    auto root = parser.ParseMain();
+    return FormulaAST(std::move(root), parser.MoveCells());
+}
+
+std::string FormulaAST::Serialize() const {
+    std::string result;
+    root_expr_->Serialize(result);
+    return result;
+}
+
+FormulaAST FormulaAST::Deserialize(std::string_view data) {
+    ASTImpl::Decoder decoder(data);
+    auto root = decoder.ReadMain();
+    return FormulaAST(std::move(root), decoder.MoveCells());
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -426,22 +1045,203 @@ void FormulaAST::PrintCells(std::ostream& out) const {
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position offset) const {
+    root_expr_->Print(out, offset);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, offset);
 }
 
-double FormulaAST::Execute(const std::function<std::variant<double, FormulaError>(Position)>& function) const {
-    return root_expr_->Evaluate(function);
+void FormulaAST::Shift(Position offset) {
+    for (Position& cell : cells_) {
+        cell = ASTImpl::Shifted(cell, offset);
+    }
+    // a shift keeps the cells sorted
+    for (Position& cell : program_.cells) {
+        cell = ASTImpl::Shifted(cell, offset);
+    }
+    for (Range& range : program_.ranges) {
+        range.first = ASTImpl::Shifted(range.first, offset);
+        range.last = ASTImpl::Shifted(range.last, offset);
+    }
+}
+
+std::variant<double, FormulaError> FormulaAST::Execute(const FormulaOperands& operands, Position offset) const {
+    using ASTImpl::OpCode;
+    const double epsilon = 1e-6;
+    constexpr double max = std::numeric_limits<double>::max();
+    constexpr size_t INLINE_STACK_SIZE = 64;
+
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (program_.stack_size > INLINE_STACK_SIZE) {
+        heap_stack.resize(program_.stack_size);
+        stack = heap_stack.data();
+    }
+    std::vector<RangeSummary> aggregates;
+    aggregates.reserve(program_.aggregate_depth);
+
+    size_t top = 0;
+    for (const ASTImpl::Instruction& instruction : program_.code) {
+        switch (instruction.code) {
+        case OpCode::PushNumber:
+            stack[top++] = program_.constants[instruction.operand];
+            break;
+        case OpCode::PushCell: {
+            const auto value = operands.GetCell(instruction.operand);
+            if (std::holds_alternative<FormulaError>(value)) return std::get<FormulaError>(value);
+            stack[top++] = std::get<double>(value);
+            break;
+        }
+        case OpCode::Negate:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        case OpCode::Add: {
+            const double rhs = stack[--top];
+            double& lhs = stack[top - 1];
+            if (max - lhs < rhs || max - rhs < lhs) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            lhs += rhs;
+            break;
+        }
+        case OpCode::Subtract: {
+            const double rhs = stack[--top];
+            double& lhs = stack[top - 1];
+            if (max - std::abs(lhs) < std::abs(rhs) || max - std::abs(rhs) < std::abs(lhs)) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            lhs -= rhs;
+            break;
+        }
+        case OpCode::Multiply: {
+            const double rhs = stack[--top];
+            double& lhs = stack[top - 1];
+            if (std::abs(lhs) * std::abs(rhs) == std::numeric_limits<double>::infinity()) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            lhs *= rhs;
+            break;
+        }
+        case OpCode::CheckDivisor:
+            if (stack[top - 1] < epsilon && stack[top - 1] > -1.0 * epsilon) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            break;
+        case OpCode::Divide: {
+            const double lhs = stack[--top];
+            stack[top - 1] = lhs / stack[top - 1];
+            break;
+        }
+        case OpCode::BeginAggregate:
+            aggregates.emplace_back();
+            break;
+        case OpCode::AggregateNumber:
+            aggregates.back().Add(stack[--top]);
+            break;
+        case OpCode::AggregateRange: {
+            const Range& range = program_.ranges[instruction.operand];
+            const Position first = ASTImpl::Shifted(range.first, offset);
+            const Position last = ASTImpl::Shifted(range.last, offset);
+            if (!first.IsValid() || !last.IsValid()) {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            const RangeSummary summary = operands.GetRange(first, last);
+            if (summary.error) return *summary.error;
+            aggregates.back().Merge(summary);
+            break;
+        }
+        case OpCode::EndAggregate: {
+            const RangeSummary summary = aggregates.back();
+            aggregates.pop_back();
+            // an overflow is reported the way arithmetic reports it
+            if (!std::isfinite(summary.sum)) return FormulaError(FormulaError::Category::Div0);
+            double result = 0.0;
+            switch (static_cast<ASTImpl::Function>(instruction.operand)) {
+            case ASTImpl::Function::Sum:
+                result = summary.sum;
+                break;
+            case ASTImpl::Function::Average:
+                if (summary.count == 0) return FormulaError(FormulaError::Category::Div0);
+                result = summary.sum / summary.count;
+                break;
+            case ASTImpl::Function::Min:
+                result = summary.count == 0 ? 0.0 : summary.min;
+                break;
+            case ASTImpl::Function::Max:
+                result = summary.count == 0 ? 0.0 : summary.max;
+                break;
+            case ASTImpl::Function::Count:
+                result = static_cast<double>(summary.count);
+                break;
+            }
+            stack[top++] = result;
+            break;
+        }
+        }
+    }
+    assert(top == 1);
+    return stack[0];
 }
 
 FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
     : root_expr_(std::move(root_expr))
     , cells_(std::move(cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+
+    std::unique_copy(cells_.begin(), cells_.end(), std::back_inserter(program_.cells));
+    root_expr_->Compile(program_);
+
+    // the corners of ranges are among cells_, only the cells read one by
+    // one are kept
+    if (!program_.ranges.empty()) {
+        std::vector<bool> used(program_.cells.size());
+        for (const ASTImpl::Instruction& instruction : program_.code) {
+            if (instruction.code == ASTImpl::OpCode::PushCell) used[instruction.operand] = true;
+        }
+        std::vector<std::uint32_t> indexes(program_.cells.size());
+        std::vector<Position> cells;
+        for (size_t i = 0; i < program_.cells.size(); ++i) {
+            if (!used[i]) continue;
+            indexes[i] = static_cast<std::uint32_t>(cells.size());
+            cells.push_back(program_.cells[i]);
+        }
+        for (ASTImpl::Instruction& instruction : program_.code) {
+            if (instruction.code == ASTImpl::OpCode::PushCell) instruction.operand = indexes[instruction.operand];
+        }
+        program_.cells = std::move(cells);
+    }
+
+    size_t depth = 0;
+    size_t aggregate_depth = 0;
+    for (const ASTImpl::Instruction& instruction : program_.code) {
+        switch (instruction.code) {
+        case ASTImpl::OpCode::PushNumber:
+        case ASTImpl::OpCode::PushCell:
+        case ASTImpl::OpCode::EndAggregate:
+            program_.stack_size = std::max(program_.stack_size, ++depth);
+            break;
+        case ASTImpl::OpCode::Add:
+        case ASTImpl::OpCode::Subtract:
+        case ASTImpl::OpCode::Multiply:
+        case ASTImpl::OpCode::Divide:
+        case ASTImpl::OpCode::AggregateNumber:
+            --depth;
+            break;
+        default:
+            break;
+        }
+        if (instruction.code == ASTImpl::OpCode::BeginAggregate) {
+            program_.aggregate_depth = std::max(program_.aggregate_depth, ++aggregate_depth);
+        }
+        else if (instruction.code == ASTImpl::OpCode::EndAggregate) {
+            --aggregate_depth;
+        }
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
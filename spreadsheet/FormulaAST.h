@@ -3,12 +3,57 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
-#include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
+
+    enum class OpCode : std::uint8_t {
+        PushNumber,    // operand indexes Program::constants
+        PushCell,      // operand indexes Program::cells
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        CheckDivisor,  // fails on a zero divisor before the dividend is evaluated
+        Divide,        // the divisor is below the dividend on the stack
+        // an aggregate function call: a new summary is started, each argument
+        // is added to it and the result of the function replaces it
+        BeginAggregate,
+        AggregateNumber,  // adds the number on top of the stack
+        AggregateRange,   // operand indexes Program::ranges
+        EndAggregate,     // operand is the Function
+    };
+
+    enum class Function : std::uint32_t {
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+    };
+
+    struct Instruction {
+        OpCode code;
+        std::uint32_t operand = 0;
+    };
+
+    // the AST lowered to a post-order instruction array,
+    // built once at parse time and run by FormulaAST::Execute
+    struct Program {
+        std::vector<Instruction> code;
+        std::vector<double> constants;
+        // the cells read one by one, unique and sorted
+        std::vector<Position> cells;
+        std::vector<Range> ranges;
+        size_t stack_size = 0;
+        size_t aggregate_depth = 0;
+    };
 }
 
 class ParsingError : public std::runtime_error {
@@ -19,14 +64,28 @@ class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
         std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const std::function<std::variant<double, FormulaError>(Position)>& function) const;
+    // operands.GetCell(i) is the value of GetReferencedCells()[i], ranges
+    // are moved by offset before they are read; errors are returned, never
+    // thrown
+    std::variant<double, FormulaError> Execute(const FormulaOperands& operands, Position offset = {}) const;
     void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // offset is added to every cell position
+    void Print(std::ostream& out, Position offset = {}) const;
+    void PrintFormula(std::ostream& out, Position offset = {}) const;
+
+    // the expression in a compact binary form, no text to parse: read back
+    // by Deserialize on a machine of the same byte order
+    std::string Serialize() const;
+    // throws ParsingError if the data is not a serialized expression
+    static FormulaAST Deserialize(std::string_view data);
+
+    // moves every cell reference by offset, the result may hold positions
+    // outside of the sheet, e.g. references relative to a cell
+    void Shift(Position offset);
 
     std::forward_list<Position>& GetCells() {
         return cells_;
@@ -36,8 +95,17 @@ public:
         return cells_;
     }
 
+    const std::vector<Position>& GetReferencedCells() const {
+        return program_.cells;
+    }
+
+    const std::vector<Range>& GetReferencedRanges() const {
+        return program_.ranges;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    ASTImpl::Program program_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
@@ -45,5 +113,20 @@ private:
     std::forward_list<Position> cells_;
 };
 
+// Both parsers accept the language of Formula.g4 and build the same AST with
+// the same exceptions: the generated ANTLR parser, or a hand-written one
+// that parses straight into the AST without a token stream and parse tree.
+enum class FormulaParserKind {
+    Antlr,
+    Handwritten,
+};
+
+// the parser used when none is given, Antlr unless set otherwise; the
+// hand-written one stays opt-in until the differential tests of
+// TestHandwrittenParser have run against the parser generated from Formula.g4
+void SetFormulaParser(FormulaParserKind kind);
+FormulaParserKind GetFormulaParser();
+
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(const std::string& in_str, FormulaParserKind kind);
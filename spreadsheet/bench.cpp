@@ -0,0 +1,1063 @@
+// Microbenchmarks of the sheet, built as spreadsheet_bench.
+//
+//     spreadsheet_bench [--format=json|csv] [--repetitions=N] [--filter=TEXT]
+//
+// Every benchmark prepares its own data with fixed seeds and sizes and is
+// run once to warm up and then --repetitions times, each time on fresh
+// data; only the measured part of a run is timed. The results are written
+// to the standard output as JSON (the default) or CSV, one record per
+// benchmark with the time per operation of the fastest, median, mean and
+// slowest repetition, so runs of different releases can be compared.
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+#include "evaluation_profiler.h"
+#include "formula.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "table_import.h"
+#include "versioned_sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // handed to a benchmark run, which times its measured part with Measure
+    class Run {
+    public:
+        // times f, which performs operations operations
+        template <typename F>
+        void Measure(size_t operations, F f) {
+            const Clock::time_point start = Clock::now();
+            f();
+            seconds_ += std::chrono::duration<double>(Clock::now() - start).count();
+            operations_ += operations;
+        }
+
+        double GetSeconds() const {
+            return seconds_;
+        }
+
+        size_t GetOperations() const {
+            return operations_;
+        }
+
+    private:
+        double seconds_ = 0;
+        size_t operations_ = 0;
+    };
+
+    struct Benchmark {
+        std::string name;
+        std::function<void(Run&)> run;
+    };
+
+    struct Result {
+        std::string name;
+        size_t operations = 0;
+        // nanoseconds per operation of every repetition, sorted
+        std::vector<double> nanoseconds;
+    };
+
+    volatile double value_sink;
+
+    // keeps the compiler from dropping the computation of a value
+    void KeepValue(double value) {
+        value_sink = value;
+    }
+
+    std::string Text(int i) {
+        return "text " + std::to_string(i);
+    }
+
+    // text, number and formula cells filling rows x cols, a formula reading
+    // the row above
+    void FillSheet(SheetInterface& sheet, int rows, int cols) {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                const Position pos{ row, col };
+                if (col % 3 == 0) {
+                    sheet.SetCell(pos, Text(row * cols + col));
+                }
+                else if (col % 3 == 1 || row == 0) {
+                    sheet.SetCell(pos, std::to_string(row * col % 1000) + ".5");
+                }
+                else {
+                    sheet.SetCell(pos, "=" + Position{ row - 1, col - 1 }.ToString() + "*2+"
+                                       + Position{ row - 1, col }.ToString());
+                }
+            }
+        }
+    }
+
+    void SetCellText(Run& run) {
+        const int count = 100000;
+        std::vector<std::string> texts;
+        for (int i = 0; i < count; ++i) {
+            texts.push_back(Text(i));
+        }
+        auto sheet = CreateSheet();
+        run.Measure(count, [&] {
+            for (int i = 0; i < count; ++i) {
+                sheet->SetCell(Position{ i / 100, i % 100 }, texts[i]);
+            }
+        });
+    }
+
+    void SetCellNumber(Run& run) {
+        const int count = 100000;
+        std::vector<std::string> texts;
+        for (int i = 0; i < count; ++i) {
+            texts.push_back(std::to_string(i * 7 % 10007) + ".25");
+        }
+        auto sheet = CreateSheet();
+        run.Measure(count, [&] {
+            for (int i = 0; i < count; ++i) {
+                sheet->SetCell(Position{ i / 100, i % 100 }, texts[i]);
+            }
+        });
+    }
+
+    // every formula its own shape, so that each one is parsed
+    void SetCellFormula(Run& run) {
+        const int count = 50000;
+        std::mt19937 random(21);
+        std::vector<std::string> texts;
+        for (int i = 0; i < count; ++i) {
+            texts.push_back("=" + Position{ static_cast<int>(random() % 1000), static_cast<int>(random() % 100) }.ToString()
+                            + "*" + std::to_string(i % 97) + "+"
+                            + Position{ static_cast<int>(random() % 1000), static_cast<int>(random() % 100) }.ToString());
+        }
+        auto sheet = CreateSheet();
+        int set = 0;
+        run.Measure(count, [&] {
+            for (int i = 0; i < count; ++i) {
+                // a formula closing a cycle is rejected, which is measured too
+                try {
+                    sheet->SetCell(Position{ 1000 + i / 100, i % 100 }, texts[i]);
+                    ++set;
+                }
+                catch (const CircularDependencyException&) {
+                }
+            }
+        });
+        KeepValue(set);
+    }
+
+    // the same formula filled down a column, parsed once
+    void SetCellFormulaFilled(Run& run) {
+        const int count = 16000;
+        std::vector<std::string> texts;
+        for (int row = 0; row < count; ++row) {
+            texts.push_back("=" + Position{ row, 0 }.ToString() + "*2+" + Position{ row, 1 }.ToString());
+        }
+        auto sheet = CreateSheet();
+        run.Measure(count, [&] {
+            for (int row = 0; row < count; ++row) {
+                sheet->SetCell(Position{ row, 2 }, texts[row]);
+            }
+        });
+    }
+
+    void ParseFormulaExpressions(Run& run) {
+        const int count = 20000;
+        std::mt19937 random(21);
+        std::vector<std::string> expressions;
+        for (int i = 0; i < count; ++i) {
+            const std::string a = Position{ static_cast<int>(random() % 1000), static_cast<int>(random() % 50) }.ToString();
+            const std::string b = Position{ static_cast<int>(random() % 1000), static_cast<int>(random() % 50) }.ToString();
+            expressions.push_back("(" + a + "+" + std::to_string(i) + ")*" + b + "/(1-" + a + ")+SUM(" + b + ":"
+                                  + Position{ 1000, 60 }.ToString() + ")");
+        }
+        size_t references = 0;
+        run.Measure(count, [&] {
+            for (const std::string& expression : expressions) {
+                references += ParseFormula(expression)->GetReferencedCells().size();
+            }
+        });
+        KeepValue(references);
+    }
+
+    // A2 = A1 + 1 and so on: a change of A1 evaluates the whole chain on
+    // the next read of its end
+    void GetValueChain(Run& run) {
+        const int length = 10000;
+        const int changes = 20;
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{ 0, 0 }, "0");
+        for (int row = 1; row < length; ++row) {
+            sheet->SetCell(Position{ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+        const Position end{ length - 1, 0 };
+        double sum = 0;
+        run.Measure(static_cast<size_t>(length) * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet->SetCell(Position{ 0, 0 }, std::to_string(i));
+                sum += std::get<double>(sheet->GetCell(end)->GetValue());
+            }
+        });
+        KeepValue(sum);
+    }
+
+    // reads of values already computed
+    void GetValueCached(Run& run) {
+        const int length = 10000;
+        const int reads = 50;
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{ 0, 0 }, "1");
+        for (int row = 1; row < length; ++row) {
+            sheet->SetCell(Position{ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+        sheet->GetCell(Position{ length - 1, 0 })->GetValue();
+        double sum = 0;
+        run.Measure(static_cast<size_t>(length - 1) * reads, [&] {
+            for (int i = 0; i < reads; ++i) {
+                for (int row = 1; row < length; ++row) {
+                    sum += std::get<double>(sheet->GetCell(Position{ row, 0 })->GetValue());
+                }
+            }
+        });
+        KeepValue(sum);
+    }
+
+    // one formula adding many cells, read after each change of one of them
+    void GetValueFanIn(Run& run) {
+        const int width = 500;
+        const int changes = 2000;
+        auto sheet = CreateSheet();
+        std::string formula = "=A1";
+        sheet->SetCell(Position{ 0, 0 }, "1");
+        for (int row = 1; row < width; ++row) {
+            sheet->SetCell(Position{ row, 0 }, std::to_string(row));
+            formula += "+" + Position{ row, 0 }.ToString();
+        }
+        const Position sum_pos{ 0, 1 };
+        sheet->SetCell(sum_pos, formula);
+        double sum = 0;
+        run.Measure(changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet->SetCell(Position{ i % width, 0 }, std::to_string(i));
+                sum += std::get<double>(sheet->GetCell(sum_pos)->GetValue());
+            }
+        });
+        KeepValue(sum);
+    }
+
+    // many formulas reading one cell, all read after each change of it
+    void GetValueFanOut(Run& run) {
+        const int width = 10000;
+        const int changes = 20;
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{ 0, 0 }, "1");
+        for (int row = 0; row < width; ++row) {
+            sheet->SetCell(Position{ row, 1 }, "=A1*" + std::to_string(row));
+        }
+        double sum = 0;
+        run.Measure(static_cast<size_t>(width) * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet->SetCell(Position{ 0, 0 }, std::to_string(i));
+                for (int row = 0; row < width; ++row) {
+                    sum += std::get<double>(sheet->GetCell(Position{ row, 1 })->GetValue());
+                }
+            }
+        });
+        KeepValue(sum);
+    }
+
+    // cells cleared in row order, the formulas reading them are invalidated
+    void ClearCells(Run& run) {
+        const int rows = 1000;
+        const int cols = 60;
+        auto sheet = CreateSheet();
+        FillSheet(*sheet, rows, cols);
+        for (int col = 2; col < cols; col += 3) {
+            sheet->GetCell(Position{ rows - 1, col })->GetValue();
+        }
+        run.Measure(static_cast<size_t>(rows) * cols, [&] {
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    sheet->ClearCell(Position{ row, col });
+                }
+            }
+        });
+    }
+
+    void Print(Run& run, bool values) {
+        const int rows = 2000;
+        const int cols = 60;
+        auto sheet = CreateSheet();
+        FillSheet(*sheet, rows, cols);
+        for (int col = 2; col < cols; col += 3) {
+            sheet->GetCell(Position{ rows - 1, col })->GetValue();
+        }
+        std::ostringstream output;
+        run.Measure(static_cast<size_t>(rows) * cols, [&] {
+            if (values) {
+                sheet->PrintValues(output);
+            }
+            else {
+                sheet->PrintTexts(output);
+            }
+        });
+        KeepValue(static_cast<double>(output.tellp()));
+    }
+
+    // every level used to re-evaluate its operands several times, so the
+    // cost grew exponentially with the nesting depth
+    void EvaluateNested(Run& run) {
+        const int depth = 200;
+        const int evaluations = 1000;
+        const char ops[] = "+*/-";
+        auto sheet = CreateSheet();
+        std::string expression = "A1";
+        for (int i = 2; i <= depth + 1; ++i) {
+            expression = "(" + expression + ")" + ops[i % 4] + "A" + std::to_string(i);
+            sheet->SetCell(Position{ i - 1, 0 }, std::to_string(i));
+        }
+        sheet->SetCell(Position{ 0, 0 }, "1");
+        const auto formula = ParseFormula(expression);
+        size_t errors = 0;
+        run.Measure(evaluations, [&] {
+            for (int i = 0; i < evaluations; ++i) {
+                errors += std::holds_alternative<FormulaError>(formula->Evaluate(*sheet));
+            }
+        });
+        KeepValue(errors);
+    }
+
+    // every formula of the sheet evaluates to an error
+    void GetValueErrors(Run& run) {
+        const int rows = 10000;
+        const int changes = 20;
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{ 0, 0 }, "broken");
+        for (int i = 0; i < rows; ++i) {
+            sheet->SetCell(Position{ i, 1 }, "=A1*" + std::to_string(i));
+            sheet->SetCell(Position{ i, 2 }, "=B" + std::to_string(i + 1) + "+1");
+        }
+        run.Measure(static_cast<size_t>(rows) * 2 * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet->SetCell(Position{ 0, 0 }, i % 2 ? "broken" : "still broken");
+                for (int row = 0; row < rows; ++row) {
+                    sheet->GetCell(Position{ row, 2 })->GetValue();
+                }
+            }
+        });
+    }
+
+    // wide independent levels: every row depends on the same input columns
+    void RecalculateParallel(Run& run, size_t thread_count) {
+        const int rows = 16000;
+        const int changes = 10;
+        Sheet sheet;
+        sheet.SetThreadCount(thread_count);
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        sheet.SetCell(Position{ 0, 1 }, "2");
+        for (int i = 1; i < rows; ++i) {
+            const std::string row = std::to_string(i + 1);
+            sheet.SetCell(Position{ i, 2 }, "=(A1+B1*" + row + ")/(B1-A1)-A1*A1");
+            sheet.SetCell(Position{ i, 3 }, "=C" + row + "*C" + row + "+(B1+" + row + ")/(A1+1)");
+            sheet.SetCell(Position{ i, 4 }, "=D" + row + "/(C" + row + "+1)-(D" + row + "+A1)*B1");
+        }
+        sheet.Recalculate();
+        run.Measure(static_cast<size_t>(rows - 1) * 3 * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet.SetCell(Position{ 0, 0 }, std::to_string(i + 2));
+                sheet.Recalculate();
+            }
+        });
+    }
+
+    // every formula depends on the whole column above it through its
+    // neighbour, set bottom-up so that every formula comes before the cells
+    // it reads
+    void LoadBottomUp(Run& run, bool batch) {
+        const int rows = 10000;
+        const int cols = 10;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = rows - 1; row >= 0; --row) {
+            for (int col = cols - 1; col >= 0; --col) {
+                const Position pos{ row, col };
+                if (row == 0) {
+                    cells.emplace_back(pos, std::to_string(col));
+                }
+                else {
+                    cells.emplace_back(pos, "=" + Position{ row - 1, col }.ToString() + "+"
+                                                + Position{ row - 1, (col + 1) % cols }.ToString());
+                }
+            }
+        }
+        Sheet sheet;
+        run.Measure(cells.size(), [&] {
+            if (batch) {
+                sheet.SetCells(std::move(cells));
+            }
+            else {
+                for (const auto& [pos, text] : cells) {
+                    sheet.SetCell(pos, text);
+                }
+            }
+        });
+    }
+
+    // many formulas referencing one cell, e.g. an exchange rate
+    void FanIn(Run& run, bool clear) {
+        const int count = 100000;
+        const int rows = 16000;
+        auto formula_pos = [&](int i) {
+            return Position{ i % rows, 1 + i / rows };
+        };
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1.5");
+        for (int i = 0; i < count; ++i) {
+            sheet.SetCell(formula_pos(i), "=A1*2");
+        }
+        run.Measure(count, [&] {
+            for (int i = 0; i < count; ++i) {
+                if (clear) {
+                    sheet.ClearCell(formula_pos(i));
+                }
+                else {
+                    sheet.SetCell(formula_pos(i), "=A1*3");
+                }
+            }
+        });
+    }
+
+    // formulas reading numbers entered as text, e.g. imported data
+    void RecalculateNumericText(Run& run) {
+        const int rows = 16000;
+        const int changes = 10;
+        Sheet sheet;
+        for (int i = 0; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i) + ".25");
+            sheet.SetCell(Position{ i, 1 }, "-" + std::to_string(i));
+        }
+        for (int i = 0; i < rows; ++i) {
+            const std::string row = std::to_string(i + 1);
+            sheet.SetCell(Position{ i, 2 }, "=A" + row + "*B" + row + "+A" + row + "/Z1");
+        }
+        run.Measure(static_cast<size_t>(rows) * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet.SetCell(Position{ 0, 25 }, std::to_string(i + 1));
+                sheet.Recalculate();
+            }
+        });
+    }
+
+    // one formula of five references filled down a column
+    std::vector<std::string> FilledDownTexts(int rows) {
+        std::vector<std::string> texts;
+        for (int i = 0; i < rows; ++i) {
+            const std::string row = std::to_string(i + 1);
+            texts.push_back("=(A" + row + "+B" + row + ")*C" + row + "/(D" + row + "-E" + row + ")");
+        }
+        return texts;
+    }
+
+    void ParseFormulaFilledDown(Run& run) {
+        const std::vector<std::string> texts = FilledDownTexts(16000);
+        size_t references = 0;
+        run.Measure(texts.size(), [&] {
+            for (const std::string& text : texts) {
+                references += ParseFormula(text.substr(1))->GetReferencedCells().size();
+            }
+        });
+        KeepValue(references);
+    }
+
+    void SetCellFilledDown(Run& run) {
+        const std::vector<std::string> texts = FilledDownTexts(16000);
+        Sheet sheet;
+        run.Measure(texts.size(), [&] {
+            for (size_t i = 0; i < texts.size(); ++i) {
+                sheet.SetCell(Position{ static_cast<int>(i), 5 }, texts[i]);
+            }
+        });
+    }
+
+    void ParseWithParser(Run& run, FormulaParserKind kind) {
+        const int count = 16000;
+        std::vector<std::string> texts;
+        for (int i = 0; i < count; ++i) {
+            const std::string row = std::to_string(i + 1);
+            texts.push_back("(A" + row + "+B" + row + ")*2.5e-1/(C" + row + "-D" + row + "+-E" + row + ")-1");
+        }
+        size_t references = 0;
+        run.Measure(count, [&] {
+            for (const std::string& text : texts) {
+                references += ParseFormulaAST(text, kind).GetReferencedCells().size();
+            }
+        });
+        KeepValue(references);
+    }
+
+    // the same sums written as ranges or as chains of additions, all of them
+    // recomputed on every change of Z1; the operations are the cells added
+    void RecalculateSums(Run& run, bool ranges) {
+        const int formulas = 400;
+        const int length = 250;
+        const int columns = 8;
+        const int changes = 20;
+        Sheet sheet;
+        for (int row = 0; row < formulas / columns * length; ++row) {
+            for (int col = 0; col < columns; ++col) {
+                sheet.SetCell(Position{ row, col }, std::to_string((row + col) % 100) + ".5");
+            }
+        }
+        for (int i = 0; i < formulas; ++i) {
+            const int col = i % columns;
+            const int first = i / columns * length;
+            std::string text;
+            if (ranges) {
+                text = "=SUM(" + Position{ first, col }.ToString() + ":" + Position{ first + length - 1, col }.ToString()
+                       + ")+Z1";
+            }
+            else {
+                text = "=Z1";
+                for (int row = first; row < first + length; ++row) {
+                    text += "+" + Position{ row, col }.ToString();
+                }
+            }
+            sheet.SetCell(Position{ i, columns + 1 }, text);
+        }
+        run.Measure(static_cast<size_t>(formulas) * length * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet.SetCell(Position{ 0, 25 }, std::to_string(i));
+                sheet.Recalculate();
+            }
+        });
+    }
+
+    // overlapping windows over one column: each cell is read by width
+    // formulas, an edit invalidates and recomputes all of them
+    void RollingWindows(Run& run, bool edit) {
+        const int rows = 16000;
+        const int width = 200;
+        const int edits = 20;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row % 100));
+        }
+        auto set_windows = [&] {
+            for (int row = 0; row + width <= rows; ++row) {
+                sheet.SetCell(Position{ row, 1 }, "=SUM(" + Position{ row, 0 }.ToString() + ":"
+                                                  + Position{ row + width - 1, 0 }.ToString() + ")");
+            }
+            sheet.Recalculate();
+        };
+        if (!edit) {
+            run.Measure(rows - width + 1, set_windows);
+            return;
+        }
+        set_windows();
+        run.Measure(edits, [&] {
+            for (int i = 0; i < edits; ++i) {
+                sheet.SetCell(Position{ i * rows / edits, 0 }, std::to_string(i));
+                sheet.Recalculate();
+            }
+        });
+    }
+
+    // a mostly empty area: one number in eight cells, every tenth a formula
+    void PrintSparse(Run& run, bool values, bool cell_by_cell) {
+        const int rows = 4000;
+        const int cols = 400;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = row % 8; col < cols; col += 8) {
+                if (col % 10 == 0 && row > 0) {
+                    sheet.SetCell(Position{ row, col }, "=" + Position{ row - 1, col / 2 }.ToString() + "/3");
+                }
+                else {
+                    sheet.SetCell(Position{ row, col }, std::to_string(row * col % 1000) + ".25");
+                }
+            }
+        }
+        sheet.Recalculate();
+        std::ostringstream output;
+        run.Measure(static_cast<size_t>(rows) * cols, [&] {
+            if (!cell_by_cell) {
+                if (values) {
+                    sheet.PrintValues(output);
+                }
+                else {
+                    sheet.PrintTexts(output);
+                }
+                return;
+            }
+            // what a caller of the public interface would do instead
+            const Size size = sheet.GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    if (col > 0) output << '\t';
+                    const CellInterface* cell = sheet.GetCell(Position{ row, col });
+                    if (cell == nullptr || cell->GetText().empty()) continue;
+                    if (values) {
+                        std::visit([&](const auto& value) { output << value; }, cell->GetValue());
+                    }
+                    else {
+                        output << cell->GetText();
+                    }
+                }
+                output << '\n';
+            }
+        });
+        KeepValue(static_cast<double>(output.tellp()));
+    }
+
+    enum class SnapshotStep {
+        BUILD,
+        SAVE,
+        LOAD,
+    };
+
+    // numbers and formulas, saved with their values; building the sheet
+    // again cell by cell is what loading saves
+    void Snapshot(Run& run, SnapshotStep step) {
+        const int rows = 16000;
+        const int cols = 12;
+        std::vector<std::pair<Position, std::string>> texts;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                texts.push_back({ Position{ row, col }, col % 2 == 0 ? std::to_string(row * col % 977)
+                                  : "=" + Position{ row, col - 1 }.ToString() + "*2+"
+                                    + Position{ std::max(row - 1, 0), col - 1 }.ToString() });
+            }
+        }
+        Sheet sheet;
+        auto build = [&] {
+            for (const auto& [pos, text] : texts) {
+                sheet.SetCell(pos, text);
+            }
+            sheet.Recalculate();
+        };
+        if (step == SnapshotStep::BUILD) {
+            run.Measure(texts.size(), build);
+            return;
+        }
+        build();
+        std::ostringstream output;
+        if (step == SnapshotStep::SAVE) {
+            run.Measure(texts.size(), [&] {
+                SheetSnapshot::Save(sheet, output);
+            });
+            return;
+        }
+        SheetSnapshot::Save(sheet, output);
+        const std::string snapshot = output.str();
+        std::unique_ptr<Sheet> loaded;
+        run.Measure(texts.size(), [&] {
+            loaded = SheetSnapshot::Load(snapshot);
+        });
+        KeepValue(static_cast<double>(loaded->GetPrintableSize().rows));
+    }
+
+    // a table of numbers and formulas, read and set cell by cell when
+    // thread_count is 0 and through the importer otherwise
+    void ImportTable(Run& run, size_t thread_count) {
+        const int rows = 16000;
+        const int cols = 24;
+        std::string table;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                if (col > 0) table += '\t';
+                if (col % 2 == 0) {
+                    table += std::to_string(row * col % 977);
+                }
+                else if (col == cols - 1) {
+                    table += "=SUM(" + Position{ row, 0 }.ToString() + ":" + Position{ row, col - 1 }.ToString() + ")";
+                }
+                else {
+                    table += "=" + Position{ row, col - 1 }.ToString() + "*2+" + Position{ std::max(row - 1, 0), col - 1 }.ToString();
+                }
+            }
+            table += '\n';
+        }
+        Sheet sheet;
+        run.Measure(static_cast<size_t>(rows) * cols, [&] {
+            std::istringstream input(table);
+            if (thread_count > 0) {
+                sheet.SetThreadCount(thread_count);
+                TableImporter::Import(sheet, input);
+                return;
+            }
+            std::string line;
+            for (int row = 0; std::getline(input, line); ++row) {
+                std::istringstream fields(line);
+                std::string field;
+                for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+                    if (!field.empty()) sheet.SetCell(Position{ row, col }, std::move(field));
+                }
+            }
+        });
+    }
+
+    // readers on thread_count threads sharing one computed sheet; the time
+    // per operation is the wall time per read of all of them together
+    void GetValueConcurrent(Run& run, size_t thread_count) {
+        const int rows = 16000;
+        const int cols = 4;
+        const int passes = 10;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row % 97));
+            for (int col = 1; col < cols; ++col) {
+                sheet.SetCell(Position{ row, col }, "=" + Position{ row, col - 1 }.ToString() + "*2+1");
+            }
+        }
+        sheet.Recalculate();
+        std::vector<double> sums(thread_count);
+        run.Measure(thread_count * passes * rows * (cols - 1), [&] {
+            std::vector<std::thread> readers;
+            for (size_t reader = 0; reader < thread_count; ++reader) {
+                readers.emplace_back([&, reader] {
+                    for (int pass = 0; pass < passes; ++pass) {
+                        for (int row = 0; row < rows; ++row) {
+                            for (int col = 1; col < cols; ++col) {
+                                sums[reader] += std::get<double>(sheet.GetCell(Position{ row, col })->GetValue());
+                            }
+                        }
+                    }
+                });
+            }
+            for (std::thread& reader : readers) {
+                reader.join();
+            }
+        });
+        KeepValue(std::accumulate(sums.begin(), sums.end(), 0.0));
+    }
+
+    // many small formulas, every change of A1 recomputes all of them
+    void FillProfiledSheet(Sheet& sheet, int rows) {
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 1; row < rows; ++row) {
+            const std::string above = std::to_string(row);
+            sheet.SetCell(Position{ row, 0 }, "=A" + above + "+1");
+            sheet.SetCell(Position{ row, 1 }, "=A" + above + "*2-A1");
+            sheet.SetCell(Position{ row, 2 }, "=B" + std::to_string(row + 1) + "/(A1+1)");
+        }
+    }
+
+    // what profiling adds to a recalculation
+    void RecalculateProfiled(Run& run, bool profiled) {
+        const int rows = 16000;
+        const int changes = 5;
+        Sheet sheet;
+        FillProfiledSheet(sheet, rows);
+        sheet.Recalculate();
+        EvaluationProfiler profiler;
+        sheet.SetProfiler(profiled ? &profiler : nullptr);
+        run.Measure(static_cast<size_t>(rows - 1) * 3 * changes, [&] {
+            for (int i = 0; i < changes; ++i) {
+                sheet.SetCell(Position{ 0, 0 }, std::to_string(i + 2));
+                sheet.Recalculate();
+            }
+        });
+        sheet.SetProfiler(nullptr);
+    }
+
+    // one span per evaluated formula
+    void WriteChromeTrace(Run& run) {
+        const int rows = 16000;
+        const int changes = 5;
+        Sheet sheet;
+        FillProfiledSheet(sheet, rows);
+        // a span for every formula and recalculation
+        EvaluationProfiler profiler(static_cast<size_t>(rows) * 3 * changes + changes);
+        sheet.SetProfiler(&profiler);
+        for (int i = 0; i < changes; ++i) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(i + 2));
+            sheet.Recalculate();
+        }
+        sheet.SetProfiler(nullptr);
+        std::ostringstream trace;
+        run.Measure(static_cast<size_t>(rows - 1) * 3 * changes, [&] {
+            profiler.WriteChromeTrace(trace);
+        });
+        KeepValue(static_cast<double>(trace.tellp()));
+    }
+
+    enum class VersionStep {
+        SET_CELLS,
+        EDIT,
+        UNDO,
+        REDO,
+    };
+
+    // a deep history of single-cell edits on a large sheet, the step is
+    // timed and the ones before it prepare the history
+    void Versions(Run& run, VersionStep step) {
+        const int rows = 10000;
+        const int cols = 20;
+        const int edits = 5000;
+        SheetVersion::Cells cells;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                cells.emplace_back(Position{ row, col }, col % 4 == 3 && row > 0
+                                                             ? "=" + Position{ row - 1, col }.ToString() + "+1"
+                                                             : std::to_string(row * col));
+            }
+        }
+        VersionedSheet sheet;
+        auto measure = [&](VersionStep timed, size_t operations, auto f) {
+            if (step == timed) {
+                run.Measure(operations, f);
+            }
+            else {
+                f();
+            }
+        };
+        measure(VersionStep::SET_CELLS, cells.size(), [&] {
+            sheet.SetCells(std::move(cells));
+        });
+        if (step == VersionStep::SET_CELLS) return;
+        std::mt19937 random(25);
+        measure(VersionStep::EDIT, edits, [&] {
+            for (int i = 0; i < edits; ++i) {
+                sheet.SetCell(Position{ static_cast<int>(random() % rows), static_cast<int>(random() % cols) },
+                              std::to_string(i));
+            }
+        });
+        if (step == VersionStep::EDIT) return;
+        measure(VersionStep::UNDO, edits, [&] {
+            for (int i = 0; i < edits; ++i) {
+                sheet.Undo();
+            }
+        });
+        if (step == VersionStep::UNDO) return;
+        measure(VersionStep::REDO, edits, [&] {
+            for (int i = 0; i < edits; ++i) {
+                sheet.Redo();
+            }
+        });
+    }
+
+    std::vector<Benchmark> MakeBenchmarks() {
+        std::vector<Benchmark> benchmarks = {
+            { "SetCell/text", SetCellText },
+            { "SetCell/number", SetCellNumber },
+            { "SetCell/formula", SetCellFormula },
+            { "SetCell/formula_filled_down", SetCellFormulaFilled },
+            { "ParseFormula", ParseFormulaExpressions },
+            { "GetValue/chain", GetValueChain },
+            { "GetValue/cached", GetValueCached },
+            { "GetValue/fan_in", GetValueFanIn },
+            { "GetValue/fan_out", GetValueFanOut },
+            { "ClearCell", ClearCells },
+            { "PrintValues", [](Run& run) { Print(run, true); } },
+            { "PrintTexts", [](Run& run) { Print(run, false); } },
+            { "Evaluate/nested", EvaluateNested },
+            { "GetValue/errors", GetValueErrors },
+            { "Load/set_cell_bottom_up", [](Run& run) { LoadBottomUp(run, false); } },
+            { "Load/set_cells_bottom_up", [](Run& run) { LoadBottomUp(run, true); } },
+            { "SetCell/fan_in_rewrite", [](Run& run) { FanIn(run, false); } },
+            { "ClearCell/fan_in", [](Run& run) { FanIn(run, true); } },
+            { "Recalculate/numeric_text", RecalculateNumericText },
+            { "ParseFormula/filled_down", ParseFormulaFilledDown },
+            { "SetCell/formula_filled_down_5_references", SetCellFilledDown },
+            { "ParseFormulaAST/antlr", [](Run& run) { ParseWithParser(run, FormulaParserKind::Antlr); } },
+            { "ParseFormulaAST/handwritten", [](Run& run) { ParseWithParser(run, FormulaParserKind::Handwritten); } },
+            { "Recalculate/range_sums", [](Run& run) { RecalculateSums(run, true); } },
+            { "Recalculate/addition_chains", [](Run& run) { RecalculateSums(run, false); } },
+            { "SetCell/rolling_windows", [](Run& run) { RollingWindows(run, false); } },
+            { "Recalculate/rolling_windows_edit", [](Run& run) { RollingWindows(run, true); } },
+            { "PrintValues/sparse", [](Run& run) { PrintSparse(run, true, false); } },
+            { "PrintTexts/sparse", [](Run& run) { PrintSparse(run, false, false); } },
+            { "PrintValues/sparse_cell_by_cell", [](Run& run) { PrintSparse(run, true, true); } },
+            { "PrintTexts/sparse_cell_by_cell", [](Run& run) { PrintSparse(run, false, true); } },
+            { "Snapshot/build", [](Run& run) { Snapshot(run, SnapshotStep::BUILD); } },
+            { "Snapshot/save", [](Run& run) { Snapshot(run, SnapshotStep::SAVE); } },
+            { "Snapshot/load", [](Run& run) { Snapshot(run, SnapshotStep::LOAD); } },
+            { "TableImport/set_cell", [](Run& run) { ImportTable(run, 0); } },
+            { "TableImport/import/threads:1", [](Run& run) { ImportTable(run, 1); } },
+            { "TableImport/import/threads:4", [](Run& run) { ImportTable(run, 4); } },
+            { "Recalculate/not_profiled", [](Run& run) { RecalculateProfiled(run, false); } },
+            { "Recalculate/profiled", [](Run& run) { RecalculateProfiled(run, true); } },
+            { "EvaluationProfiler/chrome_trace", WriteChromeTrace },
+            { "VersionedSheet/set_cells", [](Run& run) { Versions(run, VersionStep::SET_CELLS); } },
+            { "VersionedSheet/edit", [](Run& run) { Versions(run, VersionStep::EDIT); } },
+            { "VersionedSheet/undo", [](Run& run) { Versions(run, VersionStep::UNDO); } },
+            { "VersionedSheet/redo", [](Run& run) { Versions(run, VersionStep::REDO); } },
+        };
+        // from one thread to at least the number of hardware threads
+        const size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+        for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            benchmarks.push_back({ "GetValue/concurrent/threads:" + std::to_string(thread_count),
+                                   [thread_count](Run& run) { GetValueConcurrent(run, thread_count); } });
+        }
+        for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            benchmarks.push_back({ "Recalculate/parallel/threads:" + std::to_string(thread_count),
+                                   [thread_count](Run& run) { RecalculateParallel(run, thread_count); } });
+        }
+        return benchmarks;
+    }
+
+    Result RunBenchmark(const Benchmark& benchmark, int repetitions) {
+        Result result{ benchmark.name, 0, {} };
+        for (int i = 0; i <= repetitions; ++i) {
+            Run run;
+            benchmark.run(run);
+            // the first run only warms up
+            if (i == 0) continue;
+            result.operations = run.GetOperations();
+            result.nanoseconds.push_back(run.GetSeconds() * 1e9 / std::max<size_t>(run.GetOperations(), 1));
+        }
+        std::sort(result.nanoseconds.begin(), result.nanoseconds.end());
+        return result;
+    }
+
+    struct Summary {
+        double min;
+        double median;
+        double mean;
+        double max;
+        double operations_per_second;
+    };
+
+    Summary Summarize(const Result& result) {
+        const std::vector<double>& times = result.nanoseconds;
+        const size_t middle = times.size() / 2;
+        const double median = times.size() % 2 == 1 ? times[middle] : (times[middle - 1] + times[middle]) / 2;
+        return {
+            times.front(),
+            median,
+            std::accumulate(times.begin(), times.end(), 0.0) / times.size(),
+            times.back(),
+            1e9 / median,
+        };
+    }
+
+    std::string JsonString(std::string_view text) {
+        std::string out = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else {
+                out += c;
+            }
+        }
+        return out + '"';
+    }
+
+    std::string CompilerName() {
+#if defined(__clang__)
+        return "clang " __clang_version__;
+#elif defined(__GNUC__)
+        return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+        return "msvc " + std::to_string(_MSC_VER);
+#else
+        return "unknown";
+#endif
+    }
+
+    void PrintJson(std::ostream& output, const std::vector<Result>& results, int repetitions) {
+        output << "{\n";
+        output << "  \"context\": {\n";
+        output << "    \"compiler\": " << JsonString(CompilerName()) << ",\n";
+#ifdef NDEBUG
+        output << "    \"assertions\": false,\n";
+#else
+        output << "    \"assertions\": true,\n";
+#endif
+        output << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+        output << "    \"cell_bytes\": " << sizeof(Cell) << ",\n";
+        output << "    \"repetitions\": " << repetitions << "\n";
+        output << "  },\n";
+        output << "  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& result = results[i];
+            const Summary summary = Summarize(result);
+            output << (i == 0 ? "\n" : ",\n");
+            output << "    {\"name\": " << JsonString(result.name)
+                   << ", \"operations\": " << result.operations
+                   << ", \"min_ns_per_op\": " << summary.min
+                   << ", \"median_ns_per_op\": " << summary.median
+                   << ", \"mean_ns_per_op\": " << summary.mean
+                   << ", \"max_ns_per_op\": " << summary.max
+                   << ", \"ops_per_second\": " << summary.operations_per_second << "}";
+        }
+        output << "\n  ]\n}\n";
+    }
+
+    void PrintCsv(std::ostream& output, const std::vector<Result>& results) {
+        output << "name,operations,min_ns_per_op,median_ns_per_op,mean_ns_per_op,max_ns_per_op,ops_per_second\n";
+        for (const Result& result : results) {
+            const Summary summary = Summarize(result);
+            output << result.name << ',' << result.operations << ',' << summary.min << ',' << summary.median << ','
+                   << summary.mean << ',' << summary.max << ',' << summary.operations_per_second << '\n';
+        }
+    }
+
+    int Usage() {
+        std::cerr << "usage: spreadsheet_bench [--format=json|csv] [--repetitions=N] [--filter=TEXT]\n";
+        return 2;
+    }
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string format = "json";
+    int repetitions = 5;
+    std::string filter;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        auto value_of = [arg](std::string_view option) -> std::optional<std::string_view> {
+            if (arg.substr(0, option.size()) != option) return std::nullopt;
+            return arg.substr(option.size());
+        };
+        if (auto value = value_of("--format=")) {
+            format = *value;
+        }
+        else if (auto value = value_of("--repetitions=")) {
+            repetitions = std::atoi(std::string(*value).c_str());
+        }
+        else if (auto value = value_of("--filter=")) {
+            filter = *value;
+        }
+        else {
+            return Usage();
+        }
+    }
+    if ((format != "json" && format != "csv") || repetitions < 1) {
+        return Usage();
+    }
+
+    std::vector<Result> results;
+    for (const Benchmark& benchmark : MakeBenchmarks()) {
+        if (benchmark.name.find(filter) == std::string::npos) continue;
+        std::cerr << benchmark.name << "..." << std::endl;
+        results.push_back(RunBenchmark(benchmark, repetitions));
+    }
+
+    std::cout.precision(6);
+    if (format == "json") {
+        PrintJson(std::cout, results, repetitions);
+    }
+    else {
+        PrintCsv(std::cout, results);
+    }
+    return 0;
+}
@@ -1,166 +1,855 @@
 #include "cell.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <optional>
 
-std::string EmptyImpl::GetText() const {
-        return "";
+Cell::~Cell() {
+    FreeContent();
 }
 
-CellInterface::Value EmptyImpl::GetValue(const SheetInterface& sheet) const {
-    return "";
+std::string_view Cell::GetTextView() const {
+    switch (kind_) {
+    case Kind::ShortText: return std::string_view(payload_.short_text, short_text_size_);
+    case Kind::ShortNumber: return std::string_view(payload_.short_number.text, short_text_size_);
+    case Kind::LongText:
+    case Kind::LongNumber: return std::string_view(payload_.long_text.data, payload_.long_text.size);
+    default: return {};
+    }
 }
 
-std::vector<Position> EmptyImpl::GetReferencedCells() const {
-    return {};
+void Cell::SetText(const std::string& text) {
+    PutContent(MakeTextContent(text));
 }
 
-std::string TextImpl::GetText() const {
-    return text_;
+Cell::Content Cell::MakeTextContent(const std::string& text) {
+    if (text.empty()) return {};
+    std::string_view value = text;
+    if (value[0] == ESCAPE_SIGN) {
+        value.remove_prefix(1);
+    }
+    return MakeTextContent(text, value.empty() ? std::nullopt : TextToNumber(value));
 }
 
-CellInterface::Value TextImpl::GetValue(const SheetInterface& sheet) const {
-    if (text_[0] == ESCAPE_SIGN) {
-        return text_.substr(1);
+Cell::Content Cell::MakeTextContent(std::string_view text, std::optional<double> number) {
+    Content content;
+    if (text.empty()) return content;
+    if (number && text.size() <= SHORT_NUMBER_CAPACITY) {
+        content.payload.short_number.number = *number;
+        std::memcpy(content.payload.short_number.text, text.data(), text.size());
+        content.short_text_size = static_cast<std::uint8_t>(text.size());
+        content.kind = Kind::ShortNumber;
+    }
+    else if (!number && text.size() <= SHORT_TEXT_CAPACITY) {
+        std::memcpy(content.payload.short_text, text.data(), text.size());
+        content.short_text_size = static_cast<std::uint8_t>(text.size());
+        content.kind = Kind::ShortText;
     }
-    return text_;
+    else {
+        content.payload.long_text.data = new char[text.size()];
+        std::memcpy(content.payload.long_text.data, text.data(), text.size());
+        content.payload.long_text.size = text.size();
+        content.payload.long_text.number = number.value_or(0.0);
+        content.kind = number ? Kind::LongNumber : Kind::LongText;
+    }
+    return content;
 }
 
-std::vector<Position> TextImpl::GetReferencedCells() const {
-    return {};
+template <typename CellPtr>
+std::optional<std::uint32_t> Cell::FindInGraph(const std::vector<CellPtr>& graph, const Cell* cell) {
+    if (cell->kind_ != Kind::Formula) return std::nullopt;
+    const std::uint32_t index = cell->payload_.formula->graph_index;
+    if (index < graph.size() && graph[index] == cell) return index;
+    return std::nullopt;
 }
 
-std::string FormulaImpl::GetText() const {
-    return FORMULA_SIGN + formula_->GetExpression();
+template <typename CellPtr>
+void Cell::AddToGraph(std::vector<CellPtr>& graph, CellPtr cell) {
+    assert(cell->kind_ == Kind::Formula);
+    if (FindInGraph(graph, cell)) return;
+    cell->payload_.formula->graph_index = static_cast<std::uint32_t>(graph.size());
+    graph.push_back(cell);
 }
 
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+void Cell::ResetContent() {
+    UnlinkReferences();
+    FreeContent();
 }
 
-CellInterface::Value FormulaImpl::GetValue(const SheetInterface& sheet) const {
-    FormulaInterface::Value result = formula_->Evaluate(sheet);
-    if (std::holds_alternative<double>(result)) {
-        return std::get<double>(result);
+void Cell::LinkReferences() {
+    if (kind_ != Kind::Formula) return;
+    FormulaData& data = *payload_.formula;
+    data.parent_slots.resize(data.ref_cells.size());
+    for (size_t i = 0; i < data.ref_cells.size(); ++i) {
+        std::vector<Parent>& parents = data.ref_cells[i]->parent_cells;
+        data.parent_slots[i] = static_cast<std::uint32_t>(parents.size());
+        parents.push_back({ this, static_cast<std::uint32_t>(i) });
     }
-    else {
-        return std::get<FormulaError>(result);
+    data.range_handles.resize(data.ranges.size());
+    for (size_t i = 0; i < data.ranges.size(); ++i) {
+        data.range_handles[i] = data.sheet->AddRangeDependent(data.ranges[i], this);
+    }
+}
+
+void Cell::UnlinkReferences() {
+    if (kind_ != Kind::Formula) return;
+    const FormulaData& data = *payload_.formula;
+    for (size_t i = 0; i < data.ref_cells.size(); ++i) {
+        data.ref_cells[i]->RemoveParent(data.parent_slots[i]);
+    }
+    for (size_t i = 0; i < data.ranges.size(); ++i) {
+        data.sheet->RemoveRangeDependent(data.ranges[i], data.range_handles[i]);
     }
 }
 
-void Cell::Set(std::string text) {
+void Cell::AppendDependents(const Sheet& sheet, Position pos, std::vector<Cell*>& out) const {
+    for (const Parent& parent : parent_cells) {
+        out.push_back(parent.cell);
+    }
+    sheet.FindRangeDependents(pos, out);
+}
+
+void Cell::AppendReferences(std::vector<Cell*>& out) const {
+    if (kind_ != Kind::Formula) return;
+    out.insert(out.end(), payload_.formula->ref_cells.begin(), payload_.formula->ref_cells.end());
+    AppendRangeFormulas(*payload_.formula, out);
+}
+
+void Cell::AppendRangeFormulas(const FormulaData& data, std::vector<Cell*>& out) {
+    for (const Range& range : data.ranges) {
+        const size_t begin = out.size();
+        data.sheet->FindCells(range, out);
+        out.erase(std::remove_if(out.begin() + begin, out.end(), [](const Cell* cell) {
+            return cell->kind_ != Kind::Formula;
+        }), out.end());
+    }
+}
+
+void Cell::AppendPendingReferences(std::vector<const Cell*>& out) const {
+    const FormulaData& data = *payload_.formula;
+    for (const Cell* cell : data.ref_cells) {
+        if (cell->NeedsEvaluation()) out.push_back(cell);
+    }
+    for (const Range& range : data.ranges) {
+        data.sheet->FindPendingCells(range, out);
+    }
+}
+
+void Cell::OrderBelowRangeDependents(Sheet& sheet, Position pos) {
+    std::vector<Cell*> dependents;
+    sheet.FindRangeDependents(pos, dependents);
+    for (const Cell* dependent : dependents) {
+        if (dependent->order_ < order_) {
+            order_ = sheet.TakeLowestOrder();
+            return;
+        }
+    }
+}
+
+void Cell::FreeContent() {
+    Content content = TakeContent();
+    FreeContent(content);
+}
+
+void Cell::FreeContent(Content& content) {
+    switch (content.kind) {
+    case Kind::LongText:
+    case Kind::LongNumber:
+        delete[] content.payload.long_text.data;
+        break;
+    case Kind::Formula:
+        delete content.payload.formula;
+        break;
+    default:
+        break;
+    }
+    content.kind = Kind::Empty;
+}
+
+Cell::Content Cell::TakeContent() {
+    Content content{ payload_, kind_, short_text_size_ };
+    kind_ = Kind::Empty;
+    short_text_size_ = 0;
+    return content;
+}
+
+void Cell::PutContent(const Content& content) {
+    assert(kind_ == Kind::Empty);
+    payload_ = content.payload;
+    kind_ = content.kind;
+    short_text_size_ = content.short_text_size;
+}
+
+namespace {
+    // a lone formula sign is a text
+    bool IsFormulaText(std::string_view text) {
+        return text.size() > 1 && text[0] == FORMULA_SIGN;
+    }
+}  // namespace
+
+void Cell::Set(Sheet& sheet, Position pos, std::string text) {
     if (text == GetText()) return;
-    if (text.empty()) {
-        impl_ = std::unique_ptr<EmptyImpl>(nullptr);
-        for (Cell* cell : ref_cells) {
-        cell->PopParent(this);
-        }   
-        ref_cells.clear();
-    }
-    else if (text[0] == FORMULA_SIGN && text.size() > 1) {
-        FormulaImpl new_formula(text.substr(1));
-        const auto& references = new_formula.GetReferencedCells();
-        std::vector<Cell*> nf_ref_cells = MakeRefCellsPtr(references);
-        CircularDependency(nf_ref_cells);
-        impl_ = std::make_unique<FormulaImpl>(std::move(new_formula));
-        for (Cell* cell : ref_cells) {
-            cell->PopParent(this);
-        }
-        ref_cells = nf_ref_cells;
-        for (Cell* cell : ref_cells) {
-            if (cell == nullptr) continue;
-            cell->AddParent(this);
+    if (IsFormulaText(text)) {
+        auto new_formula = std::make_unique<FormulaData>();
+        new_formula->formula = sheet.GetFormulaTemplates().Parse(text.substr(1), pos);
+        new_formula->ref_cells = MakeRefCellsPtr(sheet, new_formula->formula->GetReferencedCells());
+        new_formula->ranges = new_formula->formula->GetReferencedRanges();
+        new_formula->sheet = &sheet;
+        new_formula->pos = pos;
+        for (const Range& range : new_formula->ranges) {
+            if (range.Contains(pos)) throw CircularDependencyException("IsCircle");
+        }
+        if (kind_ != Kind::Formula) {
+            OrderBelowRangeDependents(sheet, pos);
         }
+        std::vector<Cell*> references = new_formula->ref_cells;
+        AppendRangeFormulas(*new_formula, references);
+        UpdateOrder(sheet, references, CircularDependency(sheet, pos, references));
+        ResetContent();
+        payload_.formula = new_formula.release();
+        kind_ = Kind::Formula;
+        LinkReferences();
+        sheet.MarkDirty(this, pos);
     }
     else {
-        impl_ = std::make_unique<TextImpl>(text);
-        for (Cell* cell : ref_cells) {
-            cell->PopParent(this);
+        ResetContent();
+        SetText(text);
+    }
+    InvalidateCash(sheet, pos, true);
+}
+
+void Cell::SetAll(Sheet& sheet, std::vector<Update>& updates) {
+    std::vector<Cell*> cells;
+    std::vector<Position> positions;
+    std::vector<Content> contents;
+    cells.reserve(updates.size());
+    positions.reserve(updates.size());
+    contents.reserve(updates.size());
+    auto free_contents = [&contents] {
+        for (Content& content : contents) {
+            FreeContent(content);
+        }
+    };
+
+    // parsing is done before anything changes, all the formulas at once
+    try {
+        std::vector<Update*> changed;
+        std::vector<std::pair<std::string_view, Position>> expressions;
+        for (Update& update : updates) {
+            if (update.text == update.cell->GetText()) continue;
+            changed.push_back(&update);
+            if (IsFormulaText(update.text) && update.formula == nullptr) {
+                expressions.emplace_back(std::string_view(update.text).substr(1), update.pos);
+            }
+        }
+        std::vector<std::unique_ptr<FormulaInterface>> formulas = sheet.ParseFormulas(expressions);
+        auto next_formula = formulas.begin();
+        for (auto* update : changed) {
+            auto& [cell, pos, text, formula] = *update;
+            Content content;
+            if (IsFormulaText(text)) {
+                auto new_formula = std::make_unique<FormulaData>();
+                new_formula->formula = formula != nullptr ? std::move(formula) : std::move(*next_formula++);
+                new_formula->ranges = new_formula->formula->GetReferencedRanges();
+                new_formula->sheet = &sheet;
+                new_formula->pos = pos;
+                content.payload.formula = new_formula.release();
+                content.kind = Kind::Formula;
+            }
+            else {
+                content = MakeTextContent(text);
+            }
+            cells.push_back(cell);
+            positions.push_back(pos);
+            contents.push_back(content);
+        }
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (contents[i].kind == Kind::Formula) {
+                FormulaData& data = *contents[i].payload.formula;
+                data.ref_cells = cells[i]->MakeRefCellsPtr(sheet, data.formula->GetReferencedCells());
+            }
+        }
+    }
+    catch (...) {
+        free_contents();
+        throw;
+    }
+
+    auto swap_contents = [&] {
+        for (Cell* cell : cells) {
+            cell->UnlinkReferences();
+        }
+        for (size_t i = 0; i < cells.size(); ++i) {
+            Content content = cells[i]->TakeContent();
+            cells[i]->PutContent(contents[i]);
+            contents[i] = content;
+        }
+        for (Cell* cell : cells) {
+            cell->LinkReferences();
+        }
+    };
+    // the formulas of the batch hold no value yet, so if no formula read a
+    // range before, no formula reading one is left to invalidate
+    const bool had_range_dependents = sheet.HasRangeDependents();
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (had_range_dependents && contents[i].kind == Kind::Formula && cells[i]->kind_ != Kind::Formula) {
+            cells[i]->OrderBelowRangeDependents(sheet, positions[i]);
+        }
+    }
+    swap_contents();
+
+    // only a reference against the order can close a cycle, so only the
+    // cells depending on such references are sorted; nothing is renumbered
+    // before the whole graph is known to be acyclic
+    std::vector<Cell*> misordered;
+    std::vector<Cell*> lowered;
+    std::vector<Cell*> references;
+    for (Cell* cell : cells) {
+        bool is_misordered = false;
+        references.clear();
+        cell->AppendReferences(references);
+        for (Cell* ref : references) {
+            if (ref->order_ < cell->order_) continue;
+            if (ref->kind_ == Kind::Formula || ref == cell) {
+                is_misordered = true;
+            }
+            else {
+                lowered.push_back(ref);
+            }
+        }
+        if (is_misordered) {
+            misordered.push_back(cell);
+        }
+    }
+    std::vector<Cell*> sorted;
+    try {
+        sorted = SortDependents(misordered);
+    }
+    catch (...) {
+        // back to the old contents, which still hold their cached values;
+        // nothing was invalidated yet
+        swap_contents();
+        free_contents();
+        throw;
+    }
+    free_contents();
+
+    for (Cell* cell : lowered) {
+        cell->order_ = sheet.TakeLowestOrder();
+    }
+    for (Cell* cell : sorted) {
+        cell->order_ = sheet.TakeHighestOrder();
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (cells[i]->kind_ == Kind::Formula) {
+            sheet.MarkDirty(cells[i], positions[i]);
+        }
+        cells[i]->InvalidateCash(sheet, positions[i], true, had_range_dependents);
+    }
+}
+
+void Cell::Clear(Sheet& sheet, Position pos) {
+    if (kind_ == Kind::Empty) return;
+    ResetContent();
+    InvalidateCash(sheet, pos, true);
+}
+
+FormulaInterface::Value Cell::GetNumber() const {
+    switch (kind_) {
+    case Kind::Empty:
+        return 0.0;
+    case Kind::Formula:
+        if (NeedsEvaluation()) {
+            CountRead(SheetStats::Counter::CacheMisses);
+            Evaluate();
+        }
+        else {
+            CountRead(SheetStats::Counter::CacheHits);
+        }
+        return payload_.formula->cashe.Get();
+    case Kind::ShortNumber:
+        return payload_.short_number.number;
+    case Kind::LongNumber:
+        return payload_.long_text.number;
+    default:
+        // a lone escape sign reads as an empty cell
+        if (GetTextView() == std::string_view(&ESCAPE_SIGN, 1)) {
+            return 0.0;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+}
+
+std::optional<FormulaInterface::Value> Cell::GetCachedNumber() const {
+    switch (kind_) {
+    case Kind::ShortNumber:
+        return payload_.short_number.number;
+    case Kind::LongNumber:
+        return payload_.long_text.number;
+    case Kind::Formula:
+        return payload_.formula->cashe.Load();
+    default:
+        return std::nullopt;
+    }
+}
+
+bool Cell::NeedsEvaluation() const {
+    return kind_ == Kind::Formula && !payload_.formula->cashe.HasValue();
+}
+
+void Cell::CountRead(SheetStats::Counter counter) const {
+    if constexpr (SheetStats::ENABLED) {
+        payload_.formula->sheet->GetStats().Add(counter);
+    }
+}
+
+// a cell is evaluated when it is back on top of the stack, after its
+// references pushed above it; a cell reached twice is evaluated once.
+// With a profiler, the inclusive time of a cell runs from its expansion
+void Cell::Evaluate() const {
+    using Clock = EvaluationProfiler::Clock;
+    // another reader may have computed the value while this one waited,
+    // then the first frame is popped at once
+    std::lock_guard lock(payload_.formula->sheet->GetEvaluationMutex());
+    struct Frame {
+        const Cell* cell;
+        bool expanded;
+        Clock::time_point expanded_at;
+    };
+    EvaluationProfiler* profiler = payload_.formula->sheet->GetProfiler();
+    std::vector<Frame> stack{ { this, false, {} } };
+    std::vector<const Cell*> references;
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        const Cell* cell = frame.cell;
+        if (!cell->NeedsEvaluation()) {
+            stack.pop_back();
+        }
+        else if (frame.expanded) {
+            if (profiler != nullptr) {
+                const Clock::time_point started = Clock::now();
+                cell->EvaluateFormula();
+                profiler->RecordCell(cell->payload_.formula->pos, frame.expanded_at, started, Clock::now());
+            }
+            else {
+                cell->EvaluateFormula();
+            }
+            stack.pop_back();
+        }
+        else {
+            frame.expanded = true;
+            if (profiler != nullptr) {
+                frame.expanded_at = Clock::now();
+            }
+            references.clear();
+            cell->AppendPendingReferences(references);
+            for (const Cell* reference : references) {
+                stack.push_back({ reference, false, {} });
+            }
         }
-        ref_cells.clear();
     }
-    InvalidateCash();
 }
 
-void Cell::Clear() {
-    Set(std::string());
+void Cell::EvaluateParallel(const std::vector<Cell*>& cells, WorkStealingPool<std::uint32_t>& pool) {
+    // the cells to evaluate are numbered, so that the threads only touch
+    // plain arrays and the cells themselves
+    std::vector<const Cell*> graph;
+    for (const Cell* cell : cells) {
+        if (cell->NeedsEvaluation()) AddToGraph(graph, cell);
+    }
+    // the references of cell i to evaluate are
+    // references[reference_offsets[i]..reference_offsets[i + 1])
+    std::vector<const Cell*> references;
+    std::vector<std::uint32_t> reference_offsets{ 0 };
+    for (size_t i = 0; i < graph.size(); ++i) {
+        const size_t begin = references.size();
+        graph[i]->AppendPendingReferences(references);
+        for (size_t j = begin; j < references.size(); ++j) {
+            AddToGraph(graph, references[j]);
+        }
+        reference_offsets.push_back(static_cast<std::uint32_t>(references.size()));
+    }
+    auto for_each_reference = [&](size_t i, auto f) {
+        for (std::uint32_t j = reference_offsets[i]; j < reference_offsets[i + 1]; ++j) {
+            f(*FindInGraph(graph, references[j]));
+        }
+    };
+
+    // dependents of cell i are dependents[offsets[i]..offsets[i + 1]),
+    // pending[i] counts its references still to be evaluated
+    std::vector<std::uint32_t> offsets(graph.size() + 1, 0);
+    std::vector<std::atomic<std::uint32_t>> pending(graph.size());
+    for (size_t i = 0; i < graph.size(); ++i) {
+        for_each_reference(i, [&](std::uint32_t index) {
+            ++offsets[index + 1];
+        });
+        pending[i].store(reference_offsets[i + 1] - reference_offsets[i], std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < graph.size(); ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    std::vector<std::uint32_t> dependents(offsets.back());
+    std::vector<std::uint32_t> filled(offsets.begin(), offsets.end() - 1);
+    std::vector<std::uint32_t> ready;
+    for (size_t i = 0; i < graph.size(); ++i) {
+        for_each_reference(i, [&](std::uint32_t index) {
+            dependents[filled[index]++] = static_cast<std::uint32_t>(i);
+        });
+        if (pending[i].load(std::memory_order_relaxed) == 0) {
+            ready.push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+
+    // the decrement publishes the cached value to the thread evaluating
+    // the last of the dependent's references; that thread goes on with one
+    // of the dependents it made ready and leaves the others to be stolen
+    const std::uint32_t none = static_cast<std::uint32_t>(graph.size());
+    EvaluationProfiler* profiler = graph.empty() ? nullptr : graph[0]->payload_.formula->sheet->GetProfiler();
+    pool.Run(ready, [&](std::uint32_t i, WorkStealingPool<std::uint32_t>::Worker& worker) {
+        while (i != none) {
+            if (profiler != nullptr) {
+                const auto started = EvaluationProfiler::Clock::now();
+                graph[i]->EvaluateFormula();
+                profiler->RecordCell(graph[i]->payload_.formula->pos, started, started, EvaluationProfiler::Clock::now());
+            }
+            else {
+                graph[i]->EvaluateFormula();
+            }
+            std::uint32_t next = none;
+            for (std::uint32_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+                const std::uint32_t dependent = dependents[j];
+                if (pending[dependent].fetch_sub(1, std::memory_order_acq_rel) != 1) continue;
+                if (next == none) {
+                    next = dependent;
+                }
+                else {
+                    worker.Push(dependent);
+                }
+            }
+            i = next;
+        }
+    });
+}
+
+namespace {
+    // the referenced cells are read one by one and ranges through the
+    // numeric columns of the sheet
+    class CellOperands : public FormulaOperands {
+    public:
+        CellOperands(const std::vector<Cell*>& ref_cells, const Sheet& sheet)
+            : ref_cells_(ref_cells), sheet_(sheet) {
+        }
+
+        std::variant<double, FormulaError> GetCell(size_t index) const override {
+            return ref_cells_[index]->GetNumber();
+        }
+
+        // the referenced cells, those of the ranges among them, are
+        // evaluated before the formula
+        RangeSummary GetRange(Position first, Position last) const override {
+            return sheet_.SummarizeRange(first, last);
+        }
+
+    private:
+        const std::vector<Cell*>& ref_cells_;
+        const Sheet& sheet_;
+    };
+}  // namespace
+
+void Cell::EvaluateFormula() const {
+    const FormulaData& data = *payload_.formula;
+    data.sheet->CountEvaluation();
+    const FormulaInterface::Value value = data.formula->Evaluate(CellOperands(data.ref_cells, *data.sheet));
+    data.sheet->StoreFormulaValue(data.pos, value);
+    data.cashe.Store(value);
 }
 
 Cell::Value Cell::GetValue() const  {
-    if (impl_ == nullptr) return 0.0;
-    Value result = impl_->GetValue(*sheet_);
-    if (std::holds_alternative<double>(result)) cashe = std::get<double>(result);
-    return impl_->GetValue(*sheet_);
+    switch (kind_) {
+    case Kind::Empty:
+        return 0.0;
+    case Kind::Formula: {
+        SheetStats::Timer timer(payload_.formula->sheet->GetStats(), SheetStats::Operation::GetValue);
+        FormulaInterface::Value result = GetNumber();
+        if (std::holds_alternative<double>(result)) {
+            return std::get<double>(result);
+        }
+        return std::get<FormulaError>(result);
+    }
+    default: {
+        std::string_view text = GetTextView();
+        if (text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return std::string(text);
+    }
+    }
 }
 
 std::string Cell::GetText() const {
-    if (impl_ == nullptr) {
-        return "";
+    if (kind_ == Kind::Formula) {
+        return FORMULA_SIGN + payload_.formula->formula->GetExpression();
     }
-    return impl_->GetText();
+    return std::string(GetTextView());
 }
 
-void Cell::InvalidateCash() {
-    if (cashe.has_value()) {
-        cashe.reset();
-        for (Cell* cell : parent_cells) {
-            cell->InvalidateCash();
+void Cell::PrintValue(OutputBuffer& output) const {
+    switch (kind_) {
+    case Kind::Empty:
+        output.WriteNumber(0.0);
+        return;
+    case Kind::Formula: {
+        const FormulaInterface::Value result = GetNumber();
+        if (const double* number = std::get_if<double>(&result)) {
+            output.WriteNumber(*number);
+        }
+        else {
+            // what operator<< for FormulaError prints
+            output.Write(std::string_view("#DIV/0!"));
         }
+        return;
+    }
+    default: {
+        std::string_view text = GetTextView();
+        if (text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        output.Write(text);
+    }
     }
 }
 
-std::vector<Cell*> Cell::MakeRefCellsPtr(const std::vector<Position>& ref_cells_pos) {
+void Cell::PrintText(OutputBuffer& output) const {
+    if (kind_ == Kind::Formula) {
+        output.Write(FORMULA_SIGN);
+        payload_.formula->formula->PrintExpression(output.Stream());
+        return;
+    }
+    output.Write(GetTextView());
+}
+
+// a cell without a cached value has no cached dependents, so the walk stops
+// there; force is used by Set: the cell itself may be uncached (e.g. it was
+// empty) while its parents already hold values computed from it
+void Cell::InvalidateCash(Sheet& sheet, Position pos, bool force, bool through_ranges) {
+    std::vector<Cell*> stack{ this };
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        const bool cached = cell->kind_ == Kind::Formula && cell->payload_.formula->cashe.HasValue();
+        if (cached) {
+            cell->payload_.formula->cashe.Reset();
+            sheet.MarkDirty(cell, cell->payload_.formula->pos);
+            if constexpr (SheetStats::ENABLED) {
+                sheet.GetStats().Add(SheetStats::Counter::Invalidations);
+            }
+        }
+        if (!cached && !(force && cell == this)) continue;
+        // every dependent is a formula
+        if (through_ranges) {
+            cell->AppendDependents(sheet, cell == this ? pos : cell->payload_.formula->pos, stack);
+        }
+        else {
+            for (const Parent& parent : cell->parent_cells) {
+                stack.push_back(parent.cell);
+            }
+        }
+    }
+}
+
+std::vector<Cell*> Cell::MakeRefCellsPtr(Sheet& sheet, const std::vector<Position>& ref_cells_pos) {
     std::vector<Cell*> result;
     result.reserve(ref_cells_pos.size());
     for (Position pos : ref_cells_pos) {
-        sheet_->SetEmptyCell(pos);
-        result.push_back(dynamic_cast<Cell*>(sheet_->GetCell(pos)));
+        sheet.SetEmptyCell(pos);
+        result.push_back(dynamic_cast<Cell*>(sheet.GetCell(pos)));
     }
     return result;
 }
 
-void Cell::CircularDependency(const  std::vector<Cell*>& references) {
-    std::unordered_set<Cell*> counter;
-    counter.insert(this);
+// Dynamic topological order (Pearce-Kelly): a formula is always ordered after
+// the cells it references, so a path between two cells only ever goes up in
+// the order. A new reference that already follows the order cannot close a
+// cycle; one that goes against it is checked by searching only the cells
+// ordered between its two ends, and then only those cells are renumbered.
+std::vector<Cell*> Cell::CircularDependency(const Sheet& sheet, Position pos, const std::vector<Cell*>& references) {
+    // only a formula can lead back to this cell
+    std::uint32_t upper = order_;
+    std::unordered_set<const Cell*> targets;
     for (Cell* cell : references) {
-        if (cell == nullptr) continue;
-        if (!counter.count(cell)) {
-            counter.insert(cell);
-            cell->CircularDependency(counter, this);
-        }
         if (cell == this) throw CircularDependencyException("IsCircle");
+        if (cell->kind_ == Kind::Formula && cell->order_ > order_) {
+            upper = std::max(upper, cell->order_);
+            targets.insert(cell);
+        }
+    }
+    std::vector<Cell*> forward{ this };
+    if (targets.empty()) return forward;
+
+    std::unordered_set<const Cell*> visited{ this };
+    std::vector<Cell*> stack{ this };
+    std::vector<Cell*> dependents;
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if constexpr (SheetStats::ENABLED) {
+            sheet.GetStats().Add(SheetStats::Counter::CycleCheckVisits);
+        }
+        dependents.clear();
+        cell->AppendDependents(sheet, cell == this ? pos : cell->payload_.formula->pos, dependents);
+        for (Cell* parent : dependents) {
+            if (parent->order_ > upper || visited.count(parent)) continue;
+            if (targets.count(parent)) throw CircularDependencyException("IsCircle");
+            visited.insert(parent);
+            forward.push_back(parent);
+            stack.push_back(parent);
+        }
     }
+    return forward;
 }
 
-void Cell::CircularDependency(std::unordered_set<Cell*>& counter, Cell* start){
-    for (Cell* cell : ref_cells) {
-        if (!counter.count(cell)) {
-            counter.insert(cell);
-            cell->CircularDependency(counter, start);
+// the order of this cell is read again after each TakeLowestOrder, which
+// may renumber all the cells
+void Cell::UpdateOrder(Sheet& sheet, const std::vector<Cell*>& references, std::vector<Cell*> forward) {
+    std::vector<Cell*> backward;
+    std::vector<Cell*> refs;
+    std::unordered_set<const Cell*> visited;
+    for (Cell* cell : references) {
+        if (cell->order_ < order_ || visited.count(cell)) continue;
+        // a cell without references may go below everything in O(1),
+        // which is the common case of a formula referencing new cells
+        if (cell->kind_ != Kind::Formula) {
+            cell->order_ = sheet.TakeLowestOrder();
+            continue;
+        }
+        visited.insert(cell);
+        backward.push_back(cell);
+        for (size_t i = backward.size() - 1; i < backward.size(); ++i) {
+            refs.clear();
+            backward[i]->AppendReferences(refs);
+            for (Cell* ref : refs) {
+                if (ref->order_ < order_ || visited.count(ref)) continue;
+                visited.insert(ref);
+                backward.push_back(ref);
+            }
         }
-        if (cell == start) throw CircularDependencyException("IsCircle");
+    }
+    if (backward.empty()) return;
+
+    // the cells reaching the references take the lowest of the freed
+    // orders, the cells reachable from this one the highest; relative
+    // order inside each group is kept
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::vector<std::uint32_t> orders;
+    orders.reserve(backward.size() + forward.size());
+    for (const Cell* cell : backward) orders.push_back(cell->order_);
+    for (const Cell* cell : forward) orders.push_back(cell->order_);
+    std::sort(orders.begin(), orders.end());
+
+    auto order = orders.begin();
+    for (Cell* cell : backward) cell->order_ = *order++;
+    for (Cell* cell : forward) cell->order_ = *order++;
+}
+
+void Cell::RenumberOrders(std::vector<Cell*>& cells, std::uint32_t first) {
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    });
+    for (Cell* cell : cells) {
+        cell->order_ = first++;
     }
 }
-    
-void Cell::AddParent(Cell* parent) {
-    parent_cells.push_back(parent);
+
+// Kahn's algorithm over the cells reachable from the given ones, which are
+// formulas
+std::vector<Cell*> Cell::SortDependents(const std::vector<Cell*>& cells) {
+    std::vector<Cell*> links;
+    auto find_dependents = [&links](const Cell* cell) -> const std::vector<Cell*>& {
+        links.clear();
+        cell->AppendDependents(*cell->payload_.formula->sheet, cell->payload_.formula->pos, links);
+        return links;
+    };
+
+    std::vector<Cell*> reached;
+    for (Cell* cell : cells) {
+        AddToGraph(reached, cell);
+    }
+    for (size_t i = 0; i < reached.size(); ++i) {
+        for (Cell* dependent : find_dependents(reached[i])) {
+            AddToGraph(reached, dependent);
+        }
+    }
+    if constexpr (SheetStats::ENABLED) {
+        if (!reached.empty()) {
+            reached[0]->payload_.formula->sheet->GetStats().Add(SheetStats::Counter::CycleCheckVisits, reached.size());
+        }
+    }
+    std::vector<std::uint32_t> pending(reached.size(), 0);
+    for (size_t i = 0; i < reached.size(); ++i) {
+        links.clear();
+        reached[i]->AppendReferences(links);
+        for (const Cell* ref : links) {
+            if (FindInGraph(reached, ref)) ++pending[i];
+        }
+    }
+
+    std::vector<Cell*> result;
+    result.reserve(reached.size());
+    for (size_t i = 0; i < reached.size(); ++i) {
+        if (pending[i] == 0) result.push_back(reached[i]);
+    }
+    for (size_t i = 0; i < result.size(); ++i) {
+        for (Cell* dependent : find_dependents(result[i])) {
+            if (--pending[*FindInGraph(reached, dependent)] == 0) result.push_back(dependent);
+        }
+    }
+    if (result.size() < reached.size()) throw CircularDependencyException("IsCircle");
+    return result;
 }
 
-void Cell::PopParent(Cell* parent) {
-    parent_cells.erase(find(parent_cells.begin(), parent_cells.end(), parent));
+// the last parent takes the freed slot
+void Cell::RemoveParent(std::uint32_t slot) {
+    const Parent last = parent_cells.back();
+    parent_cells[slot] = last;
+    last.cell->payload_.formula->parent_slots[last.ref_index] = slot;
+    parent_cells.pop_back();
 }
 
 void Cell::CircularDependency() {
-    CircularDependency(ref_cells);
+    if (kind_ != Kind::Formula) return;
+    std::vector<Cell*> references;
+    AppendReferences(references);
+    CircularDependency(*payload_.formula->sheet, payload_.formula->pos, references);
 }
 
 bool Cell::IsReferenced() const {
     return !parent_cells.empty();
 }
-    
+
+bool Cell::IsEmpty() const {
+    return kind_ == Kind::Empty;
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
-    if (impl_ == nullptr) return {};
-    return impl_->GetReferencedCells();
-}
\ No newline at end of file
+    if (kind_ != Kind::Formula) return {};
+    return payload_.formula->formula->GetReferencedCells();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    if (kind_ != Kind::Formula) return nullptr;
+    return payload_.formula->formula.get();
+}
+
+std::vector<Range> Cell::GetReferencedRanges() const {
+    if (kind_ != Kind::Formula) return {};
+    return payload_.formula->ranges;
+}
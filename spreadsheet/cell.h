@@ -2,90 +2,267 @@
 
 #include "common.h"
 #include "formula.h"
+#include "output_buffer.h"
 #include "sheet.h"
 
+#include <atomic>
+#include <cstdint>
 #include <optional>
 #include <unordered_set>
+#include <utility>
 
-class Impl {
+// A cell stores its content inline as a tagged union: short texts live in
+// the cell itself, longer ones in a single heap block, and everything a
+// formula needs (the formula, its references and the cached value) in one
+// heap block owned by the cell. The sheet is passed in by the caller
+// instead of being stored in every cell.
+class Cell : public CellInterface {
 public:
-    virtual ~Impl() = default;
-    virtual std::string GetText() const = 0;
-    virtual CellInterface::Value GetValue(const SheetInterface& sheet) const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
+    // texts up to this length are stored without heap allocation
+    static constexpr size_t SHORT_TEXT_CAPACITY = 22;
+    // the same for texts holding a number, which is stored next to the text
+    static constexpr size_t SHORT_NUMBER_CAPACITY = 14;
 
-class EmptyImpl : public Impl {
-public:
-    std::string GetText() const override;
-
-    CellInterface::Value GetValue(const SheetInterface& sheet) const override;
+    // cells are created with increasing orders, so a new cell is ordered
+    // after every existing one
+    explicit Cell(std::uint32_t order) : order_(order) {
+    }
+    Cell(const Cell&) = delete;
+    Cell& operator=(const Cell&) = delete;
 
-    std::vector<Position> GetReferencedCells() const override;
-};
+    ~Cell();
 
-class TextImpl : public Impl {
-public:
-    TextImpl(std::string text) : text_(text) {
-    }
+    // pos is where the cell is, formulas are parsed relative to it
+    void Set(Sheet& sheet, Position pos, std::string text);
 
-    std::string GetText() const override;
+    struct Update {
+        Cell* cell;
+        Position pos;
+        std::string text;
+        // the parsed formula of a formula text if it is known, nullptr to
+        // parse the text
+        std::unique_ptr<FormulaInterface> formula;
+    };
 
-    CellInterface::Value GetValue(const SheetInterface& sheet) const override;
+    // sets the text of every cell as one change: all formulas are parsed
+    // first, cycles are checked against the resulting dependency graph and
+    // each dependent is invalidated once; throws without changing any of
+    // the cells if a formula is invalid or would close a cycle;
+    // the cells must be distinct, the formulas given are taken
+    static void SetAll(Sheet& sheet, std::vector<Update>& updates);
 
-    std::vector<Position> GetReferencedCells() const override;
-    
-private:
-    std::string text_;
-};
+    // pos is where the cell is
+    void Clear(Sheet& sheet, Position pos);
 
-class FormulaImpl : public Impl {
-public:
-    FormulaImpl(std::string text) : formula_(ParseFormula(text)) {
-    }
-    
+    Value GetValue() const override;
     std::string GetText() const override;
 
-    CellInterface::Value GetValue(const SheetInterface& sheet) const override;
+    // write what GetValue and GetText return, without copying the text
+    void PrintValue(OutputBuffer& output) const;
+    void PrintText(OutputBuffer& output) const;
 
     std::vector<Position> GetReferencedCells() const override;
+    // nullptr unless the cell holds a formula
+    const FormulaInterface* GetFormula() const;
+    // the ranges of a formula in the order they appear in it
+    std::vector<Range> GetReferencedRanges() const;
 
- private:
-    std::unique_ptr<FormulaInterface> formula_;
-};
-
-class Cell : public CellInterface {
-public:
-    explicit Cell(Sheet* sheet) : sheet_(sheet) {
-    }
+    // the value as seen by a formula referencing this cell
+    FormulaInterface::Value GetNumber() const;
 
-    ~Cell() = default;
+    // the value a range sees, without evaluating anything: nothing for
+    // cells ranges skip and for formulas without a cached value
+    std::optional<FormulaInterface::Value> GetCachedNumber() const;
 
-    void Set(std::string text);
+    // true for a formula cell without a cached value
+    bool NeedsEvaluation() const;
 
-    void Clear();
+    // evaluates these formula cells and every uncached formula they depend
+    // on; a cell is handed to the pool as soon as all of its references are
+    // evaluated, so independent cells are evaluated concurrently
+    static void EvaluateParallel(const std::vector<Cell*>& cells, WorkStealingPool<std::uint32_t>& pool);
 
-    Value GetValue() const override;
-    std::string GetText() const override;
-   
-    std::vector<Position> GetReferencedCells() const override;
+    // gives the cells consecutive orders from first, keeping their order
+    // relative to each other; see Sheet::RenumberOrders
+    static void RenumberOrders(std::vector<Cell*>& cells, std::uint32_t first);
 
     void CircularDependency();
 
     bool IsReferenced() const;
 
+    bool IsEmpty() const;
+
 private:
-    Sheet* sheet_ = nullptr;
-    std::unique_ptr<Impl> impl_;
-    std::vector<Cell*> ref_cells; 
-    std::vector<Cell*> parent_cells; 
-    mutable std::optional<double> cashe;
-   
-    std::vector<Cell*> MakeRefCellsPtr(const std::vector<Position>& ref_cells_pos);
-
-    void CircularDependency(const  std::vector<Cell*>& references);
-    void CircularDependency(std::unordered_set<Cell*>& counter, Cell* start);
-    void AddParent(Cell* parent);
-    void PopParent(Cell* parent);
-    void InvalidateCash();
- };
\ No newline at end of file
+    enum class Kind : std::uint8_t {
+        Empty,
+        ShortText,
+        LongText,
+        // texts a formula reads as a number, converted once when set
+        ShortNumber,
+        LongNumber,
+        Formula,
+    };
+
+    // the value of a formula once computed; a reader seeing HasValue on any
+    // thread also sees the value, so computed values are read without locks
+    class CachedValue {
+    public:
+        bool HasValue() const {
+            return has_value_.load(std::memory_order_acquire);
+        }
+
+        // only if HasValue
+        const FormulaInterface::Value& Get() const {
+            return value_;
+        }
+
+        std::optional<FormulaInterface::Value> Load() const {
+            if (!HasValue()) return std::nullopt;
+            return value_;
+        }
+
+        // publishes the value, it must not be cached already
+        void Store(const FormulaInterface::Value& value) {
+            value_ = value;
+            has_value_.store(true, std::memory_order_release);
+        }
+
+        // only while nothing reads the sheet
+        void Reset() {
+            has_value_.store(false, std::memory_order_relaxed);
+        }
+
+    private:
+        FormulaInterface::Value value_;
+        std::atomic<bool> has_value_ = false;
+    };
+
+    struct FormulaData {
+        std::unique_ptr<FormulaInterface> formula;
+        // in the order of formula->GetReferencedCells()
+        std::vector<Cell*> ref_cells;
+        // read through the sheet, which finds the formula by the cells of
+        // its ranges (see Sheet::AddRangeDependent)
+        std::vector<Range> ranges;
+        Sheet* sheet = nullptr;
+        // where the cell is, the value is stored there once computed
+        Position pos;
+        mutable CachedValue cashe;
+        // see FindInGraph
+        mutable std::uint32_t graph_index = 0;
+        // ref_cells[i]->parent_cells[parent_slots[i]] is this formula
+        std::vector<std::uint32_t> parent_slots;
+        // ranges[i] is read under range_handles[i] in the sheet
+        std::vector<std::uint32_t> range_handles;
+    };
+
+    // a formula referencing this cell, the cell is its ref_index-th reference
+    struct Parent {
+        Cell* cell;
+        std::uint32_t ref_index;
+    };
+
+    struct LongText {
+        char* data;
+        size_t size;
+        // for Kind::LongNumber
+        double number;
+    };
+
+    struct ShortNumber {
+        double number;
+        char text[SHORT_NUMBER_CAPACITY];
+    };
+
+    union Payload {
+        char short_text[SHORT_TEXT_CAPACITY];
+        ShortNumber short_number;
+        LongText long_text;
+        FormulaData* formula;
+    };
+
+    // the content of a cell detached from it by SetAll
+    struct Content {
+        Payload payload;
+        Kind kind = Kind::Empty;
+        std::uint8_t short_text_size = 0;
+    };
+
+    Payload payload_;
+    Kind kind_ = Kind::Empty;
+    std::uint8_t short_text_size_ = 0;
+    // position in a topological order of the dependency graph:
+    // a formula is ordered after every cell it references
+    std::uint32_t order_ = 0;
+    // in no particular order, a parent knows its slot here, so it is
+    // removed in constant time however many formulas reference the cell
+    std::vector<Parent> parent_cells;
+
+    std::string_view GetTextView() const;
+    void SetText(const std::string& text);
+    // unlinks the cell from the cells it references and frees the content
+    void ResetContent();
+    // frees the content memory only
+    void FreeContent();
+    static void FreeContent(Content& content);
+    static Content MakeTextContent(const std::string& text);
+    // number is the value of the text as a formula reads it, if any
+    static Content MakeTextContent(std::string_view text, std::optional<double> number);
+    // leaves the cell empty and hands its content to the caller,
+    // the references stay linked
+    Content TakeContent();
+    // puts the content back without linking it, the cell must be empty
+    void PutContent(const Content& content);
+    // adds the formula to the parents of the cells it references and to
+    // the dependents of its ranges
+    void LinkReferences();
+    void UnlinkReferences();
+
+    // appends the formulas depending on this cell, which is at pos: its
+    // parents and the formulas reading a range that holds it
+    void AppendDependents(const Sheet& sheet, Position pos, std::vector<Cell*>& out) const;
+    // appends the cells this formula references one by one and the formulas
+    // inside its ranges, once per reference
+    void AppendReferences(std::vector<Cell*>& out) const;
+    static void AppendRangeFormulas(const FormulaData& data, std::vector<Cell*>& out);
+    // appends the referenced formulas whose value is not computed yet, those
+    // inside ranges included
+    void AppendPendingReferences(std::vector<const Cell*>& out) const;
+    // a cell without references, e.g. one becoming a formula, is moved
+    // below everything if a formula reading it through a range is ordered
+    // before it
+    void OrderBelowRangeDependents(Sheet& sheet, Position pos);
+
+    std::vector<Cell*> MakeRefCellsPtr(Sheet& sheet, const std::vector<Position>& ref_cells_pos);
+
+    // throws CircularDependencyException if referencing these cells would
+    // close a cycle, otherwise returns this cell and its dependents ordered
+    // before the last of the references
+    std::vector<Cell*> CircularDependency(const Sheet& sheet, Position pos, const std::vector<Cell*>& references);
+    // restores the topological order before references are wired in
+    void UpdateOrder(Sheet& sheet, const std::vector<Cell*>& references, std::vector<Cell*> forward);
+    // graph_index of a formula is its position in a temporary vector of
+    // cells, valid only while that vector holds the cell at that position
+    template <typename CellPtr>
+    static std::optional<std::uint32_t> FindInGraph(const std::vector<CellPtr>& graph, const Cell* cell);
+    // appends a formula cell unless it is already there
+    template <typename CellPtr>
+    static void AddToGraph(std::vector<CellPtr>& graph, CellPtr cell);
+    // these cells and everything depending on them, references first;
+    // throws CircularDependencyException if they are part of a cycle
+    static std::vector<Cell*> SortDependents(const std::vector<Cell*>& cells);
+    void RemoveParent(std::uint32_t slot);
+    // pos is where this cell is; without through_ranges the formulas
+    // reading a range are known to hold no value and are not looked up
+    void InvalidateCash(Sheet& sheet, Position pos, bool force = false, bool through_ranges = true);
+    // counts a read of the value of this formula cell in the stats of its sheet
+    void CountRead(SheetStats::Counter counter) const;
+    // evaluates the formula and every uncached formula it depends on,
+    // dependencies first, without recursion; one reader of the sheet at a
+    // time, under Sheet::GetEvaluationMutex
+    void Evaluate() const;
+    // evaluates the formula alone, its references must be cached
+    void EvaluateFormula() const;
+
+    friend class SheetSnapshot;
+ };
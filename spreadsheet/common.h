@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <iosfwd>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -32,6 +36,15 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// the cells from first to last, first is the upper left corner
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(const Range& rhs) const;
+    bool Contains(Position pos) const;
+};
+
 class FormulaError {
 public:
     enum class Category {
@@ -65,6 +78,45 @@ private:
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
+// the numbers of a range of cells as aggregate functions see them: empty
+// cells and text that is not a number are skipped
+struct RangeSummary {
+    double sum = 0.0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    size_t count = 0;
+    // the first error of the range, row by row
+    std::optional<FormulaError> error;
+
+    void Add(double value) {
+        sum += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+        ++count;
+    }
+
+    // the other range follows this one
+    void Merge(const RangeSummary& other) {
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        count += other.count;
+        if (!error) error = other.error;
+    }
+};
+
+// what a formula reads while it is evaluated
+class FormulaOperands {
+public:
+    virtual ~FormulaOperands() = default;
+
+    // the value of the index-th referenced cell as a formula sees it
+    virtual std::variant<double, FormulaError> GetCell(size_t index) const = 0;
+
+    // the cells from first to last, both valid and first not after last
+    virtual RangeSummary GetRange(Position first, Position last) const = 0;
+};
+
 class InvalidPositionException : public std::out_of_range {
 public:
     using std::out_of_range::out_of_range;
@@ -90,6 +142,9 @@ public:
     
     virtual std::string GetText() const = 0;
 
+    // the cells a formula references one by one, sorted and without
+    // repetitions; the cells of its ranges are not listed, a range of the
+    // whole sheet would list every cell of it
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
@@ -0,0 +1,182 @@
+#include "evaluation_profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <unordered_map>
+
+namespace {
+    const Position RECALCULATION{ -1, -1 };
+
+    std::atomic<std::uint64_t> next_profiler_id = 1;
+
+    std::uint64_t ToKey(Position pos) {
+        return static_cast<std::uint64_t>(pos.row) << 32 | static_cast<std::uint32_t>(pos.col);
+    }
+
+    double ToMilliseconds(EvaluationProfiler::Duration duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    double ToMicroseconds(EvaluationProfiler::Duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+
+    // restores the formatting of a stream on the way out
+    class FormatGuard {
+    public:
+        explicit FormatGuard(std::ostream& output)
+            : output_(output), flags_(output.flags()), precision_(output.precision()) {
+        }
+
+        ~FormatGuard() {
+            output_.flags(flags_);
+            output_.precision(precision_);
+        }
+
+    private:
+        std::ostream& output_;
+        std::ios_base::fmtflags flags_;
+        std::streamsize precision_;
+    };
+}  // namespace
+
+EvaluationProfiler::EvaluationProfiler(size_t trace_capacity)
+    : id_(next_profiler_id.fetch_add(1, std::memory_order_relaxed))
+    , origin_(Clock::now())
+    , trace_capacity_(trace_capacity) {
+}
+
+void EvaluationProfiler::RecordCell(Position pos, Clock::time_point requested, Clock::time_point started,
+                                    Clock::time_point finished) {
+    Record({ pos, 0, requested, finished - requested, finished - started });
+}
+
+void EvaluationProfiler::RecordRecalculation(Clock::time_point started, Clock::time_point finished) {
+    Record({ RECALCULATION, 0, started, finished - started, finished - started });
+}
+
+void EvaluationProfiler::Record(const Span& span) {
+    ThreadLog& log = GetThreadLog();
+    if (span.pos.IsValid()) {
+        CellProfile& profile = log.profiles[ToKey(span.pos)];
+        profile.pos = span.pos;
+        ++profile.evaluations;
+        profile.self += span.self;
+        profile.inclusive += span.inclusive;
+    }
+    if (trace_capacity_ > 0 && span_count_.fetch_add(1, std::memory_order_relaxed) < trace_capacity_) {
+        log.spans.push_back(span);
+        log.spans.back().thread = log.index;
+    }
+}
+
+EvaluationProfiler::ThreadLog& EvaluationProfiler::GetThreadLog() {
+    // the log the calling thread used last, valid while the profiler it
+    // belongs to is the same
+    thread_local std::uint64_t cached_id = 0;
+    thread_local ThreadLog* cached_log = nullptr;
+    if (cached_id == id_) {
+        return *cached_log;
+    }
+
+    const std::thread::id id = std::this_thread::get_id();
+    std::lock_guard lock(mutex_);
+    const auto it = std::find_if(logs_.begin(), logs_.end(), [id](const auto& log) {
+        return log->id == id;
+    });
+    if (it != logs_.end()) {
+        cached_log = it->get();
+    }
+    else {
+        logs_.push_back(std::make_unique<ThreadLog>());
+        logs_.back()->id = id;
+        logs_.back()->index = static_cast<std::uint32_t>(logs_.size() - 1);
+        cached_log = logs_.back().get();
+    }
+    cached_id = id_;
+    return *cached_log;
+}
+
+std::vector<EvaluationProfiler::CellProfile> EvaluationProfiler::GetRanking() const {
+    std::unordered_map<std::uint64_t, CellProfile> profiles;
+    for (const auto& log : logs_) {
+        for (const auto& [key, thread_profile] : log->profiles) {
+            CellProfile& profile = profiles[key];
+            profile.pos = thread_profile.pos;
+            profile.evaluations += thread_profile.evaluations;
+            profile.self += thread_profile.self;
+            profile.inclusive += thread_profile.inclusive;
+        }
+    }
+    std::vector<CellProfile> ranking;
+    ranking.reserve(profiles.size());
+    for (const auto& [key, profile] : profiles) {
+        ranking.push_back(profile);
+    }
+    std::sort(ranking.begin(), ranking.end(), [](const CellProfile& lhs, const CellProfile& rhs) {
+        if (lhs.self != rhs.self) return lhs.self > rhs.self;
+        return lhs.pos < rhs.pos;
+    });
+    return ranking;
+}
+
+void EvaluationProfiler::PrintReport(std::ostream& output, const SheetInterface& sheet, size_t limit) const {
+    const std::vector<CellProfile> ranking = GetRanking();
+    Duration total{};
+    size_t evaluations = 0;
+    for (const CellProfile& profile : ranking) {
+        total += profile.self;
+        evaluations += profile.evaluations;
+    }
+
+    FormatGuard guard(output);
+    output << std::fixed << std::setprecision(3);
+    output << evaluations << " evaluations of " << ranking.size() << " cells, " << ToMilliseconds(total)
+           << " ms of self time\n";
+    output << "cell\tevaluations\tself ms\tshare %\tinclusive ms\ttext\n";
+    for (size_t i = 0; i < std::min(limit, ranking.size()); ++i) {
+        const CellProfile& profile = ranking[i];
+        const CellInterface* cell = sheet.GetCell(profile.pos);
+        output << profile.pos.ToString() << '\t' << profile.evaluations << '\t' << ToMilliseconds(profile.self) << '\t'
+               << (total.count() > 0 ? 100.0 * profile.self.count() / total.count() : 0.0) << '\t'
+               << ToMilliseconds(profile.inclusive) << '\t' << (cell != nullptr ? cell->GetText() : "") << '\n';
+    }
+}
+
+void EvaluationProfiler::WriteChromeTrace(std::ostream& output) const {
+    FormatGuard guard(output);
+    output << std::fixed << std::setprecision(3);
+    output << "{\"traceEvents\": [";
+    bool first = true;
+    for (const auto& log : logs_) {
+        for (const Span& span : log->spans) {
+            const bool is_recalculation = span.pos == RECALCULATION;
+            output << (first ? "\n" : ",\n");
+            first = false;
+            output << "{\"name\": \"" << (is_recalculation ? "Recalculate" : span.pos.ToString())
+                   << "\", \"cat\": \"" << (is_recalculation ? "recalculation" : "formula")
+                   << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << span.thread
+                   << ", \"ts\": " << ToMicroseconds(span.start - origin_)
+                   << ", \"dur\": " << ToMicroseconds(span.inclusive);
+            if (!is_recalculation) {
+                output << ", \"args\": {\"self_us\": " << ToMicroseconds(span.self) << "}";
+            }
+            output << "}";
+        }
+    }
+    output << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
+
+size_t EvaluationProfiler::GetDroppedSpanCount() const {
+    const size_t count = span_count_.load(std::memory_order_relaxed);
+    return count > trace_capacity_ ? count - trace_capacity_ : 0;
+}
+
+// the logs stay, the threads may hold them
+void EvaluationProfiler::Clear() {
+    for (const auto& log : logs_) {
+        log->profiles.clear();
+        log->spans.clear();
+    }
+    span_count_.store(0, std::memory_order_relaxed);
+}
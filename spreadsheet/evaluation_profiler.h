@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Attributes evaluation time to formula cells while it is set on a sheet
+// with Sheet::SetProfiler, to find the few formulas that dominate a
+// recalculation.
+//
+// The self time of a cell is spent evaluating its formula once the values it
+// references are known. Its inclusive time also counts the references that
+// were computed because this cell needed them, so the inclusive spans of a
+// chain nest like calls. Recalculate on several threads computes every
+// reference before a cell, so there the inclusive time is the self time.
+//
+// Each thread records into a log of its own, taking no lock after its first
+// record: the time of every cell is summed there, and the spans themselves
+// are kept only up to the trace capacity given to the constructor, for
+// WriteChromeTrace. The logs are merged when read. Clear drops what was
+// recorded. Recording may happen on several threads at once, reading the
+// results must not overlap it.
+class EvaluationProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Duration = std::chrono::nanoseconds;
+
+    struct CellProfile {
+        Position pos;
+        size_t evaluations = 0;
+        Duration self{};
+        Duration inclusive{};
+    };
+
+    // keeps the first trace_capacity spans, of cells and recalculations
+    // together, for WriteChromeTrace; none by default
+    explicit EvaluationProfiler(size_t trace_capacity = 0);
+
+    EvaluationProfiler(const EvaluationProfiler&) = delete;
+    EvaluationProfiler& operator=(const EvaluationProfiler&) = delete;
+
+    // an evaluation of the formula at pos: its references were looked at
+    // from requested, the formula itself ran from started to finished
+    void RecordCell(Position pos, Clock::time_point requested, Clock::time_point started, Clock::time_point finished);
+    void RecordRecalculation(Clock::time_point started, Clock::time_point finished);
+
+    // every cell evaluated so far, the most self time first
+    std::vector<CellProfile> GetRanking() const;
+
+    // the first limit cells of the ranking with their share of all the
+    // self time and their texts in sheet
+    void PrintReport(std::ostream& output, const SheetInterface& sheet, size_t limit = 20) const;
+
+    // the spans kept in the Chrome trace event format (chrome://tracing,
+    // Perfetto): a complete event per recalculation and per evaluated cell,
+    // a cell nested within the cell or recalculation it was computed for
+    void WriteChromeTrace(std::ostream& output) const;
+
+    // the spans recorded since the trace capacity was reached
+    size_t GetDroppedSpanCount() const;
+
+    void Clear();
+
+private:
+    struct Span {
+        // an invalid position stands for a recalculation
+        Position pos;
+        std::uint32_t thread;
+        Clock::time_point start;
+        Duration inclusive;
+        Duration self;
+    };
+
+    // what one thread recorded, touched by that thread alone until read
+    struct ThreadLog {
+        std::thread::id id;
+        std::uint32_t index;
+        // by row and column of the cell
+        std::unordered_map<std::uint64_t, CellProfile> profiles;
+        std::vector<Span> spans;
+    };
+
+    void Record(const Span& span);
+    // the log of the calling thread, made on its first record
+    ThreadLog& GetThreadLog();
+
+    // tells the logs of a profiler from those of one destroyed before it
+    // at the same address
+    const std::uint64_t id_;
+    const Clock::time_point origin_;
+    const size_t trace_capacity_;
+    // the spans counted against trace_capacity_, kept or dropped
+    std::atomic<size_t> span_count_ = 0;
+    // guards logs_ being added to
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<ThreadLog>> logs_;
+};
@@ -1,10 +1,17 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "sheet_stats.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <numeric>
 #include <sstream>
 #include <string>
 
@@ -14,91 +21,229 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << "#DIV/0!";
 }
 
-std::optional<double> IsDigit(std::string_view text) {
-    bool IsNegative = false;
-    bool IsFloat = false;
-    if (text[0] == '-') {
-        IsNegative = true;
-        text.remove_prefix(1);
-    }
-    for (char c : text) {
-        if (!isdigit(c)) {
-            if (c == '.' && !IsFloat) {
-                IsFloat = true;
+std::optional<double> TextToNumber(std::string_view text) {
+    double value = 0;
+    const char* end = text.data() + text.size();
+    const auto [parsed_end, error] = std::from_chars(text.data(), end, value);
+    if (error != std::errc() || parsed_end != end || !std::isfinite(value)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+namespace {
+    std::variant<double, FormulaError> GetCellNumber(const SheetInterface& sheet, Position pos) {
+        if (!pos.IsValid()) {
+            return FormulaError(FormulaError::Category::Ref);
+        }
+        const CellInterface* cell = sheet.GetCell(pos);
+        if (cell == nullptr) return 0.0;
+        CellInterface::Value result = cell->GetValue();
+        if (std::holds_alternative<double>(result)) {
+            return std::get<double>(result);
+        }
+        else if (std::holds_alternative<std::string>(result)) {
+            if (std::get<std::string>(result) == "") {
+                return 0.0;
+            }
+            std::optional<double> d_text = TextToNumber(std::get<std::string>(result));
+            if (d_text.has_value()) {
+                return d_text.value();
             }
             else {
-                return std::nullopt;
+                return  FormulaError(FormulaError::Category::Value);
             }
         }
+        else {
+            return std::get<FormulaError>(result);
+        }
     }
-    if (IsNegative) {
-       return std::stod(std::string(text.substr(1))) * (-1.0);
-    }
-    else {
-       return std::stod(std::string(text.substr()));
+
+    Position Shifted(Position pos, Position offset) {
+        return { pos.row + offset.row, pos.col + offset.col };
     }
-}
 
-namespace {
-    class Formula : public FormulaInterface {
+    // reads the operands of a formula through the cells of any sheet
+    class SheetOperands : public FormulaOperands {
     public:
-    explicit Formula(std::string expression) : ast_ (ParseFormulaAST(expression)){
+        SheetOperands(const SheetInterface& sheet, const std::vector<Position>& cells, Position offset)
+            : sheet_(sheet), cells_(cells), offset_(offset) {
         }
-           
-    Value Evaluate(const SheetInterface& sheet) const override {
-        std::function<std::variant<double, FormulaError>(Position)> GetValue = [&sheet](const Position pos) -> std::variant<double, FormulaError> {
-            if (!pos.IsValid()) {
-                return FormulaError(FormulaError::Category::Ref);
-            }
-            CellInterface::Value result;
-            if (sheet.GetCell(pos) == nullptr) return 0.0;
-            result = sheet.GetCell(pos)->GetValue();
-            if (std::holds_alternative<double>(result)) {
-                return std::get<double>(result);
-            }
-            else if (std::holds_alternative<std::string>(result)) {
-                if (std::get<std::string>(result) == "") {
-                    return 0.0;
-                }
-                std::optional<double> d_text = IsDigit(std::get<std::string>(result));
-                if (d_text.has_value()) {
-                    return d_text.value();
-                }
-                else {
-                    return  FormulaError(FormulaError::Category::Value);
+
+        std::variant<double, FormulaError> GetCell(size_t index) const override {
+            return GetCellNumber(sheet_, Shifted(cells_[index], offset_));
+        }
+
+        RangeSummary GetRange(Position first, Position last) const override {
+            RangeSummary result;
+            for (int row = first.row; row <= last.row; ++row) {
+                for (int col = first.col; col <= last.col; ++col) {
+                    const CellInterface* cell = sheet_.GetCell({ row, col });
+                    // an empty cell reads as 0 on its own but is not counted
+                    if (cell == nullptr || cell->GetText().empty()) continue;
+                    const CellInterface::Value value = cell->GetValue();
+                    if (const double* number = std::get_if<double>(&value)) {
+                        result.Add(*number);
+                    }
+                    else if (const std::string* text = std::get_if<std::string>(&value)) {
+                        if (std::optional<double> number = TextToNumber(*text)) result.Add(*number);
+                    }
+                    else if (!result.error) {
+                        result.error = std::get<FormulaError>(value);
+                    }
                 }
             }
-            else {
-                return std::get<FormulaError>(result);
-            }            
-        };
-        Value result = 0.0;
-        try{
-            result = ast_.Execute(GetValue);
+            return result;
         }
-        catch (FormulaError& fe) {
-            result = fe;
+
+    private:
+        const SheetInterface& sheet_;
+        const std::vector<Position>& cells_;
+        Position offset_;
+    };
+
+    // the cell references of ast_ are relative to offset_
+    class Formula : public FormulaInterface {
+    public:
+    explicit Formula(std::string expression)
+        : ast_(std::make_shared<const FormulaAST>(ParseFormulaAST(expression))) {
         }
-        return result;
+
+    Formula(std::shared_ptr<const FormulaAST> ast, Position offset)
+        : ast_(std::move(ast)), offset_(offset) {
+        }
+           
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return ast_->Execute(SheetOperands(sheet, ast_->GetReferencedCells(), offset_), offset_);
+    }
+
+    Value Evaluate(const FormulaOperands& operands) const override {
+        return ast_->Execute(operands, offset_);
     }
 
     std::string GetExpression() const override {
         std::ostringstream formula;
-        ast_.PrintFormula(formula);
+        ast_->PrintFormula(formula, offset_);
         return formula.str();
     }
 
+    void PrintExpression(std::ostream& output) const override {
+        ast_->PrintFormula(output, offset_);
+    }
+
     std::vector<Position> GetReferencedCells() const override{
+        const std::vector<Position>& cells = ast_->GetReferencedCells();
         std::vector<Position> result;
-        for (Position pos : ast_.GetCells()) {
-            if(find(result.begin(), result.end(), pos) == result.end()) result.push_back(pos);
+        result.reserve(cells.size());
+        for (Position pos : cells) {
+            result.push_back(Shifted(pos, offset_));
         }
         return result;
     }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        const std::vector<Range>& ranges = ast_->GetReferencedRanges();
+        std::vector<Range> result;
+        result.reserve(ranges.size());
+        for (const Range& range : ranges) {
+            result.push_back({ Shifted(range.first, offset_), Shifted(range.last, offset_) });
+        }
+        return result;
+    }
+
+    const std::shared_ptr<const FormulaAST>& GetAST() const override {
+        return ast_;
+    }
+
+    Position GetOffset() const override {
+        return offset_;
+    }
    
 private:
-    FormulaAST ast_;
+    std::shared_ptr<const FormulaAST> ast_;
+    Position offset_;
 };
+
+    void AppendNumber(std::string& out, int number) {
+        char digits[16];
+        out.append(digits, std::to_chars(digits, digits + sizeof(digits), number).ptr);
+    }
+
+    // the expression with every reference written relative to pos, or
+    // nothing if it holds a reference outside of the sheet
+    std::optional<std::string> MakeTemplateKey(std::string_view expression, Position pos) {
+        std::string key;
+        key.reserve(expression.size() + 8);
+        size_t i = 0;
+        while (i < expression.size()) {
+            const char c = expression[i];
+            if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+                // a number, letters inside it belong to the exponent
+                size_t end = i;
+                while (end < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[end]))
+                                                   || expression[end] == '.')) {
+                    ++end;
+                }
+                key.append(expression.substr(i, end - i));
+                i = end;
+                continue;
+            }
+            if (!std::isupper(static_cast<unsigned char>(c))) {
+                key.push_back(c);
+                ++i;
+                continue;
+            }
+            size_t end = i;
+            while (end < expression.size() && std::isupper(static_cast<unsigned char>(expression[end]))) ++end;
+            if (end == expression.size() || !std::isdigit(static_cast<unsigned char>(expression[end]))) {
+                // a function name
+                key.append(expression.substr(i, end - i));
+                i = end;
+                continue;
+            }
+            while (end < expression.size() && std::isdigit(static_cast<unsigned char>(expression[end]))) ++end;
+            const Position ref = Position::FromString(expression.substr(i, end - i));
+            if (!ref.IsValid()) return std::nullopt;
+            key += "R[";
+            AppendNumber(key, ref.row - pos.row);
+            key += "]C[";
+            AppendNumber(key, ref.col - pos.col);
+            key += ']';
+            i = end;
+        }
+        return key;
+    }
+
+    // calls process(i) for every i below count, in blocks spread over the
+    // threads of pool, or on the calling thread if there is no pool;
+    // rethrows the first exception thrown once all the blocks are done
+    template <typename Process>
+    void ParallelFor(size_t count, WorkStealingPool<std::uint32_t>* pool, Process process) {
+        if (pool == nullptr || count < 2) {
+            for (size_t i = 0; i < count; ++i) {
+                process(i);
+            }
+            return;
+        }
+        // a few blocks per thread, so that the threads finish together
+        const size_t block_count = std::min(count, pool->GetThreadCount() * 8);
+        std::vector<std::uint32_t> blocks(block_count);
+        std::iota(blocks.begin(), blocks.end(), 0);
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        pool->Run(blocks, [&](std::uint32_t block, WorkStealingPool<std::uint32_t>::Worker&) {
+            try {
+                for (size_t i = count * block / block_count; i < count * (block + 1) / block_count; ++i) {
+                    process(i);
+                }
+            }
+            catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        });
+        if (error) std::rethrow_exception(error);
+    }
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
@@ -108,4 +253,125 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     catch (...) {
         throw FormulaException("wrong form");
     }
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position offset) {
+    return std::make_unique<Formula>(std::move(ast), offset);
+}
+
+FormulaTemplateCache::FormulaTemplateCache(SheetStats* stats)
+    : next_sweep_size_(64), stats_(stats) {
+}
+
+FormulaTemplateCache::~FormulaTemplateCache() = default;
+
+std::unique_ptr<FormulaInterface> FormulaTemplateCache::Parse(const std::string& expression, Position pos) {
+    std::optional<std::string> key = MakeTemplateKey(expression, pos);
+    if (!key) {
+        CountParses(1);
+        return ParseFormula(expression);
+    }
+    std::weak_ptr<const FormulaAST>& cached = templates_[*key];
+    if (std::shared_ptr<const FormulaAST> ast = cached.lock()) {
+        return std::make_unique<Formula>(std::move(ast), pos);
+    }
+    CountParses(1);
+
+    std::shared_ptr<FormulaAST> ast;
+    try {
+        ast = std::make_shared<FormulaAST>(ParseFormulaAST(expression));
+    }
+    catch (...) {
+        templates_.erase(*key);
+        throw FormulaException("wrong form");
+    }
+    ast->Shift({ -pos.row, -pos.col });
+    cached = ast;
+    SweepExpired();
+    return std::make_unique<Formula>(std::move(ast), pos);
+}
+
+std::vector<std::unique_ptr<FormulaInterface>> FormulaTemplateCache::ParseAll(
+    const std::vector<std::pair<std::string_view, Position>>& expressions,
+    WorkStealingPool<std::uint32_t>* pool) {
+    const size_t count = expressions.size();
+    std::vector<std::optional<std::string>> keys(count);
+    ParallelFor(count, pool, [&](size_t i) {
+        keys[i] = MakeTemplateKey(expressions[i].first, expressions[i].second);
+    });
+
+    // the template of formula i is asts[i], or that of formula sources[i]
+    // for a shape first seen in an earlier formula; the first formula of
+    // every new shape is parsed, and every formula without a shape
+    std::vector<std::shared_ptr<const FormulaAST>> asts(count);
+    std::vector<size_t> sources(count);
+    std::vector<size_t> parsed;
+    std::unordered_map<std::string_view, size_t> first_of_shape;
+    for (size_t i = 0; i < count; ++i) {
+        sources[i] = i;
+        if (!keys[i]) {
+            parsed.push_back(i);
+            continue;
+        }
+        const auto [first, is_new] = first_of_shape.emplace(*keys[i], i);
+        if (!is_new) {
+            sources[i] = first->second;
+            continue;
+        }
+        const auto cached = templates_.find(*keys[i]);
+        if (cached != templates_.end()) {
+            asts[i] = cached->second.lock();
+        }
+        if (asts[i] == nullptr) {
+            parsed.push_back(i);
+        }
+    }
+
+    CountParses(parsed.size());
+    try {
+        ParallelFor(parsed.size(), pool, [&](size_t j) {
+            const size_t i = parsed[j];
+            auto ast = std::make_shared<FormulaAST>(ParseFormulaAST(std::string(expressions[i].first)));
+            if (keys[i]) {
+                ast->Shift({ -expressions[i].second.row, -expressions[i].second.col });
+            }
+            asts[i] = std::move(ast);
+        });
+    }
+    catch (...) {
+        throw FormulaException("wrong form");
+    }
+
+    for (size_t i : parsed) {
+        if (keys[i]) templates_[*keys[i]] = asts[i];
+    }
+    SweepExpired();
+
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        // a formula without a shape is parsed as it is, with absolute references
+        formulas.push_back(std::make_unique<Formula>(asts[sources[i]], keys[i] ? expressions[i].second : Position{}));
+    }
+    return formulas;
+}
+
+void FormulaTemplateCache::CountParses(size_t count) {
+    if constexpr (SheetStats::ENABLED) {
+        if (stats_ != nullptr) stats_->Add(SheetStats::Counter::FormulasParsed, count);
+    }
+}
+
+void FormulaTemplateCache::SweepExpired() {
+    if (templates_.size() < next_sweep_size_) return;
+    for (auto it = templates_.begin(); it != templates_.end();) {
+        it = it->second.expired() ? templates_.erase(it) : std::next(it);
+    }
+    next_sweep_size_ = std::max<size_t>(64, templates_.size() * 2);
+}
+
+size_t FormulaTemplateCache::GetSize() const {
+    return std::count_if(templates_.begin(), templates_.end(), [](const auto& item) {
+        return !item.second.expired();
+    });
 }
\ No newline at end of file
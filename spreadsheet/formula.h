@@ -1,10 +1,18 @@
 #pragma once
 
 #include "common.h"
+#include "work_stealing_pool.h"
 
+#include <cstdint>
 #include <memory>
-#include <vector>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class FormulaAST;
+class SheetStats;
 
 class FormulaInterface {
 public:
@@ -14,9 +22,67 @@ public:
 
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // operands.GetCell(i) is the value of GetReferencedCells()[i]
+    virtual Value Evaluate(const FormulaOperands& operands) const = 0;
+
     virtual std::string GetExpression() const = 0;
 
+    // writes what GetExpression returns
+    virtual void PrintExpression(std::ostream& output) const = 0;
+
+    // the cells referenced one by one, sorted and without repetitions; the
+    // cells of ranges are not listed
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // the ranges in the order they appear in the expression
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // the parsed expression, possibly shared with formulas of the same
+    // shape, and the offset added to its references
+    virtual const std::shared_ptr<const FormulaAST>& GetAST() const = 0;
+    virtual Position GetOffset() const = 0;
 };
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// a formula made of a parsed expression whose references are relative to
+// offset, see FormulaInterface::GetAST
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position offset);
+
+// Parses the formulas of cells. Formulas of the same shape, i.e. the same
+// text once references are written relative to the cell (R1C1 notation),
+// share one parsed and compiled template, and each formula keeps only its
+// cell position: a formula filled down a column is parsed once.
+class FormulaTemplateCache {
+public:
+    // parses are counted in stats if it is given
+    explicit FormulaTemplateCache(SheetStats* stats = nullptr);
+    ~FormulaTemplateCache();
+
+    // the formula with this expression written in the cell at pos
+    std::unique_ptr<FormulaInterface> Parse(const std::string& expression, Position pos);
+
+    // Parse for many formulas at once, {expression, pos} each: the shapes
+    // are worked out and every shape not cached yet is parsed once, both on
+    // the threads of pool if it is given; throws FormulaException without
+    // caching anything if any of the expressions is invalid
+    std::vector<std::unique_ptr<FormulaInterface>> ParseAll(
+        const std::vector<std::pair<std::string_view, Position>>& expressions,
+        WorkStealingPool<std::uint32_t>* pool);
+
+    // number of templates in use
+    size_t GetSize() const;
+
+private:
+    void CountParses(size_t count);
+    void SweepExpired();
+
+    // expression with relative references -> template
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> templates_;
+    // expired templates are dropped once the map doubles
+    size_t next_sweep_size_;
+    SheetStats* stats_;
+};
+
+// the number a text cell holds, if all of it is one finite number
+std::optional<double> TextToNumber(std::string_view text);
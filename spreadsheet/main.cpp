@@ -1,7 +1,26 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <limits>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include "FormulaAST.h"
+#include "cell.h"
 #include "common.h"
+#include "evaluation_profiler.h"
 #include "formula.h"
+#include "snapshot.h"
+#include "table_import.h"
 #include "test_runner_p.h"
+#include "versioned_sheet.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -24,6 +43,15 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+inline std::ostream& operator<<(std::ostream& output, const FormulaInterface::Value& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
 namespace {
 
     void TestPositionAndStringConversion() {
@@ -248,6 +276,41 @@ namespace {
         }
     }
 
+    void TestNumericText() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("B1"_pos, "=A1");
+        auto value_of = [&](const std::string& text) {
+            sheet->SetCell("A1"_pos, text);
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+        ASSERT_EQUAL(value_of("12"), CellInterface::Value(12.0));
+        ASSERT_EQUAL(value_of("-12"), CellInterface::Value(-12.0));
+        ASSERT_EQUAL(value_of("-0.5"), CellInterface::Value(-0.5));
+        // "-0" is a number, negative zero as std::from_chars reads it
+        ASSERT_EQUAL(value_of("-0"), CellInterface::Value(-0.0));
+        ASSERT(std::signbit(std::get<double>(value_of("-0"))));
+        ASSERT_EQUAL(value_of(".5"), CellInterface::Value(0.5));
+        ASSERT_EQUAL(value_of("1."), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value_of("1.5e3"), CellInterface::Value(1500.0));
+        ASSERT_EQUAL(value_of("'42"), CellInterface::Value(42.0));
+        ASSERT_EQUAL(value_of("'"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value_of("3.14159265358979323846"), CellInterface::Value(3.14159265358979323846));
+        for (const std::string text : { "-", ".", "1-", "+1", " 1", "1 ", "0x10", "inf", "nan", "1e400", "1.2.3",
+                                        "12345678901234567890x" }) {
+            ASSERT_EQUAL(value_of(text), CellInterface::Value(FormulaError::Category::Value));
+        }
+
+        // the text itself is kept as entered
+        sheet->SetCell("A1"_pos, "007");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "007");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("007"));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+        sheet->SetCell("A1"_pos, "'1234567890.123456789");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "'1234567890.123456789");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value("1234567890.123456789"));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1234567890.123456789));
+    }
+
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
@@ -351,7 +414,1926 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
-    
+
+    void TestCellValueCache() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+A1");
+        sheet.SetCell("A3"_pos, "=A2*A2+A2");
+        sheet.SetCell("A4"_pos, "=A3+A3+A3");
+
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(18.0));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(18.0));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 3u);
+
+        // errors and texts are cached too
+        sheet.SetCell("A1"_pos, "meow");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 6u);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value("meow"));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 6u);
+
+        // only the edited cell and its dependents are recomputed
+        sheet.SetCell("B1"_pos, "=A2");
+        sheet.SetCell("A3"_pos, "=A2");
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 9u);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 10u);
+
+        // an empty cell going non-empty invalidates its readers
+        sheet.SetCell("C1"_pos, "=C2");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet.SetCell("C2"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    void TestFormulaEvaluationOrder() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "text");
+        sheet->SetCell("B1"_pos, "=1/0");
+        auto evaluate = [&](std::string expr) {
+            return ParseFormula(std::move(expr))->Evaluate(*sheet);
+        };
+
+        // a bad divisor is reported before an error in the dividend
+        ASSERT_EQUAL(evaluate("A1/B1"), FormulaInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("A1/0"), FormulaInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("B1/A1"), FormulaInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("A1*B1"), FormulaInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("B1-A1"), FormulaInterface::Value(FormulaError::Category::Div0));
+
+        std::string deep = "1";
+        for (int i = 0; i < 100; ++i) {
+            deep = "1+(" + deep + ")";
+        }
+        ASSERT_EQUAL(evaluate(deep), FormulaInterface::Value(101.0));
+        ASSERT_EQUAL(evaluate("-(2-5)*-+4"), FormulaInterface::Value(-12.0));
+    }
+
+    void TestSparseStorage() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=XFD16384");
+        ASSERT_EQUAL(sheet.GetStorageStats().tiles, 2u);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+        ASSERT(sheet.GetCell("XFD16384"_pos) != nullptr);
+        ASSERT(sheet.GetCell("XFD16383"_pos) == nullptr);
+
+        sheet.SetCell("B3"_pos, "x");
+        sheet.SetCell("C2"_pos, "=B3");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 3 }));
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "=XFD16384\t\t\n\t\t=B3\n\tx\t\n");
+
+        // a referenced cell stays allocated but leaves the printable area
+        sheet.ClearCell("B3"_pos);
+        ASSERT(sheet.GetCell("B3"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 3 }));
+
+        sheet.ClearCell("A1"_pos);
+        sheet.ClearCell("C2"_pos);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+        sheet.ClearCell("B3"_pos);
+        sheet.ClearCell("XFD16384"_pos);
+        ASSERT_EQUAL(sheet.GetStorageStats().tiles, 0u);
+        ASSERT_EQUAL(sheet.GetStorageStats().cells, 0u);
+
+        // numbers are copied column by column only where a range reads them
+        const int cells = 4096;
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(Position{ i, i }, i % 2 == 0 ? std::to_string(i) : "=1+" + std::to_string(i));
+        }
+        Sheet::StorageStats stats = sheet.GetStorageStats();
+        ASSERT_EQUAL(stats.tiles, size_t(cells / Sheet::TILE_SIZE));
+        ASSERT_EQUAL(stats.number_bytes, 0u);
+
+        sheet.SetCell("B1"_pos, "=SUM(A1:A4096)");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 0.0);
+        ASSERT(sheet.GetStorageStats().number_bytes < 1024);
+        // a block for each of the 23 cells on the diagonal from D4 to Z26
+        sheet.SetCell("C1"_pos, "=SUM(D2:Z2)");
+        ASSERT(sheet.GetStorageStats().number_bytes < 24 * 1024);
+        sheet.SetCell("Z2"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 5.0);
+        sheet.SetCell("B1"_pos, "=SUM(D1:D4096)");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 4.0);
+        sheet.ClearCell("B1"_pos);
+        sheet.ClearCell("C1"_pos);
+        ASSERT_EQUAL(sheet.GetStorageStats().number_bytes, 0u);
+    }
+
+    void TestCellPool() {
+        Sheet sheet;
+        const int rows = 300;
+        const int cols = 100;
+        for (int i = 0; i < rows; ++i) {
+            for (int m = 0; m < cols; ++m) {
+                sheet.SetCell(Position{ i, m }, m == 0 ? "1" : "=A" + std::to_string(i + 1));
+            }
+        }
+        Sheet::StorageStats stats = sheet.GetStorageStats();
+        ASSERT_EQUAL(stats.cells, size_t(rows * cols));
+        ASSERT(stats.cell_chunks <= 10);
+
+        // freed slots are reused
+        for (int m = 1; m < cols; ++m) {
+            sheet.ClearCell(Position{ 0, m });
+        }
+        ASSERT_EQUAL(sheet.GetStorageStats().cells, size_t(rows * cols - cols + 1));
+        for (int m = 1; m < cols; ++m) {
+            sheet.SetCell(Position{ 0, m }, "=A1");
+        }
+        ASSERT_EQUAL(sheet.GetStorageStats().cell_capacity, stats.cell_capacity);
+        ASSERT_EQUAL(sheet.GetCell("CV1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        // clearing everything gives the chunks back
+        for (int i = rows - 1; i >= 0; --i) {
+            for (int m = cols - 1; m >= 0; --m) {
+                sheet.ClearCell(Position{ i, m });
+            }
+        }
+        ASSERT_EQUAL(sheet.GetStorageStats().cells, 0u);
+        ASSERT(sheet.GetStorageStats().cell_chunks <= 1);
+    }
+
+    void TestCellFootprint() {
+        Sheet sheet;
+        const std::string long_text(Cell::SHORT_TEXT_CAPACITY + 1, 'x');
+        const int rows = 1000;
+        for (int i = 0; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+            sheet.SetCell(Position{ i, 1 }, "short text");
+            sheet.SetCell(Position{ i, 2 }, long_text);
+            sheet.SetCell(Position{ i, 3 }, "=A" + std::to_string(i + 1) + "+1");
+        }
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("C1000"_pos)->GetValue()), long_text);
+        ASSERT_EQUAL(sheet.GetCell("D1000"_pos)->GetValue(), CellInterface::Value(1000.0));
+
+        ASSERT(sizeof(Cell) <= 64);
+    }
+
+    void TestLongDependencyChain() {
+        Sheet sheet;
+        const int length = 100000;
+        auto chain_pos = [](int i) {
+            return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+        };
+        // filled from the end, so every formula refers to a cell that is still empty
+        for (int i = length - 1; i > 0; --i) {
+            sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(), CellInterface::Value(double(length)));
+
+        sheet.SetCell("A1"_pos, "2");
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(2 * (length - 1)));
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(), CellInterface::Value(double(length + 1)));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(2 * (length - 1)));
+    }
+
+    void TestLongChainCycleCheck() {
+        Sheet sheet;
+        const int length = 100000;
+        auto chain_pos = [](int i) {
+            return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+        };
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < length; ++i) {
+            sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=" + chain_pos(length - 1).ToString());
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+
+        // once the chain is cut, the first half may follow the second one:
+        // a reference going against the order the chain was built in
+        sheet.SetCell(chain_pos(length / 2), "1");
+        sheet.SetCell("A1"_pos, "=" + chain_pos(length - 1).ToString() + "+1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(double(length / 2 + 1)));
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(length / 2 - 1))->GetValue(), CellInterface::Value(double(length)));
+    }
+
+    // random edits on a small grid, every outcome is compared with a full search
+    void TestCycleDetectionRandomized() {
+        const int size = 5;
+        std::mt19937 generator(42);
+        auto random_pos = [&] {
+            return Position{ int(generator() % size), int(generator() % size) };
+        };
+
+        Sheet sheet;
+        for (int step = 0; step < 3000; ++step) {
+            const Position pos = random_pos();
+            std::string text = "=";
+            std::vector<Position> refs(generator() % 3 + 1);
+            for (Position& ref : refs) {
+                ref = random_pos();
+                text += ref.ToString() + "+";
+            }
+            text += "1";
+
+            // a cycle exists if pos is reachable from one of the new references
+            std::set<Position> visited;
+            std::vector<Position> stack = refs;
+            bool expected = false;
+            while (!stack.empty() && !expected) {
+                const Position current = stack.back();
+                stack.pop_back();
+                if (current == pos) expected = true;
+                if (!visited.insert(current).second) continue;
+                if (const CellInterface* cell = sheet.GetCell(current)) {
+                    for (Position ref : cell->GetReferencedCells()) {
+                        stack.push_back(ref);
+                    }
+                }
+            }
+
+            bool caught = false;
+            try {
+                sheet.SetCell(pos, text);
+            }
+            catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT_EQUAL(caught, expected);
+            if (generator() % 4 == 0) {
+                sheet.SetCell(random_pos(), std::to_string(step));
+            }
+        }
+    }
+
+    void TestHighFanIn() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        const int count = 1000;
+        std::vector<Position> formulas;
+        for (int i = 0; i < count; ++i) {
+            formulas.push_back(Position{ i, 1 });
+            sheet.SetCell(formulas.back(), "=A1*" + std::to_string(i));
+        }
+
+        // dependents leave in an order unrelated to the one they came in
+        std::mt19937 rng(15);
+        std::shuffle(formulas.begin(), formulas.end(), rng);
+        for (int i = 0; i < count / 2; ++i) {
+            if (i % 2 == 0) {
+                sheet.ClearCell(formulas[i]);
+            }
+            else {
+                sheet.SetCell(formulas[i], "=" + std::to_string(formulas[i].row));
+            }
+        }
+        sheet.SetCell("A1"_pos, "3");
+        for (int i = count / 2; i < count; ++i) {
+            ASSERT_EQUAL(sheet.GetCell(formulas[i])->GetValue(), CellInterface::Value(3.0 * formulas[i].row));
+        }
+        for (int i = 0; i < count / 2; i += 2) {
+            ASSERT(sheet.GetCell(formulas[i]) == nullptr);
+        }
+
+        for (int i = count / 2; i < count; ++i) {
+            sheet.ClearCell(formulas[i]);
+        }
+        ASSERT(!dynamic_cast<const Cell*>(sheet.GetCell("A1"_pos))->IsReferenced());
+    }
+
+    void TestRecalculateEvaluatesOnce() {
+        Sheet sheet;
+        // a lattice where every cell is reachable through many paths
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "1");
+        for (int i = 1; i < 20; ++i) {
+            const std::string prev = std::to_string(i);
+            sheet.SetCell(Position{ i, 0 }, "=A" + prev + "+B" + prev);
+            sheet.SetCell(Position{ i, 1 }, "=A" + prev + "*B" + prev);
+        }
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 38u);
+
+        sheet.SetCell("A1"_pos, "2");
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 76u);
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetEvaluationCount(), 76u);
+    }
+
+    // the same edits evaluated serially and on several threads
+    void TestParallelRecalculation() {
+        const int rows = 2000;
+        auto fill = [&](Sheet& sheet) {
+            for (int i = 0; i < rows; ++i) {
+                const std::string row = std::to_string(i + 1);
+                sheet.SetCell(Position{ i, 0 }, std::to_string(i % 7));
+                sheet.SetCell(Position{ i, 1 }, "=A" + row + "*2+A1");
+                sheet.SetCell(Position{ i, 2 }, "=B" + row + "/A" + row);
+                sheet.SetCell(Position{ i, 3 }, i > 0 ? "=D" + std::to_string(i) + "+C" + row : "=C1");
+            }
+        };
+        auto edit = [&](Sheet& sheet) {
+            for (int step = 0; step < 5; ++step) {
+                sheet.SetCell("A1"_pos, std::to_string(step + 3));
+                sheet.SetCell(Position{ step * 17 % rows, 0 }, step % 2 ? "text" : "0");
+                sheet.Recalculate();
+            }
+        };
+
+        Sheet serial;
+        fill(serial);
+        edit(serial);
+        for (size_t threads : { 2u, 4u, 8u }) {
+            Sheet parallel;
+            parallel.SetThreadCount(threads);
+            ASSERT_EQUAL(parallel.GetThreadCount(), threads);
+            fill(parallel);
+            edit(parallel);
+            ASSERT_EQUAL(parallel.GetEvaluationCount(), serial.GetEvaluationCount());
+            for (int i = 0; i < rows; ++i) {
+                for (int col = 1; col < 4; ++col) {
+                    ASSERT_EQUAL(parallel.GetCell(Position{ i, col })->GetValue(),
+                                 serial.GetCell(Position{ i, col })->GetValue());
+                }
+            }
+            ASSERT_EQUAL(parallel.GetEvaluationCount(), serial.GetEvaluationCount());
+            parallel.SetThreadCount(1);
+            ASSERT_EQUAL(parallel.GetThreadCount(), 1u);
+        }
+    }
+
+    // readers on several threads compute the formulas lazily, each once,
+    // and see the same values as a single reader
+    void TestConcurrentReads() {
+        const int rows = 1000;
+        const size_t reader_count = 8;
+        auto fill = [&](Sheet& sheet) {
+            for (int i = 0; i < rows; ++i) {
+                const std::string row = std::to_string(i + 1);
+                sheet.SetCell(Position{ i, 0 }, std::to_string(i % 11));
+                sheet.SetCell(Position{ i, 1 }, i > 0 ? "=B" + std::to_string(i) + "+A" + row : "=A1");
+                sheet.SetCell(Position{ i, 2 }, "=SUM(B1:B" + row + ")/(A" + row + "-3)");
+            }
+        };
+        Sheet expected;
+        fill(expected);
+        std::ostringstream expected_values;
+        expected.PrintValues(expected_values);
+
+        // computed by the readers, then by Recalculate before them
+        for (bool recalculated : { false, true }) {
+            Sheet sheet;
+            fill(sheet);
+            if (recalculated) sheet.Recalculate();
+            ASSERT_EQUAL(sheet.GetEvaluationCount(), recalculated ? size_t(2 * rows) : 0u);
+            std::vector<std::string> printed(reader_count);
+            std::vector<std::thread> readers;
+            for (size_t reader = 0; reader < reader_count; ++reader) {
+                readers.emplace_back([&, reader] {
+                    // from the end of the chains, from their start or all at once
+                    if (reader % 3 == 0) {
+                        for (int i = rows - 1; i >= 0; --i) sheet.GetCell(Position{ i, 2 })->GetValue();
+                    }
+                    else if (reader % 3 == 1) {
+                        for (int i = 0; i < rows; ++i) sheet.GetCell(Position{ i, 1 })->GetValue();
+                    }
+                    std::ostringstream output;
+                    sheet.PrintValues(output);
+                    printed[reader] = output.str();
+                });
+            }
+            for (std::thread& reader : readers) {
+                reader.join();
+            }
+            for (const std::string& values : printed) {
+                ASSERT_EQUAL(values, expected_values.str());
+            }
+            ASSERT_EQUAL(sheet.GetEvaluationCount(), size_t(2 * rows));
+        }
+    }
+
+    void TestSetCells() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1");
+        sheet.SetCell("C1"_pos, "=B1*2");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // one at a time, A1 = B1 would close a cycle with the old B1
+        sheet.SetCells({ { "A1"_pos, "=B1+1" }, { "B1"_pos, "2" }, { "D1"_pos, "=C1+E1" },
+                         { "E1"_pos, "x" }, { "E1"_pos, "'10" }, { "E1"_pos, "10" } });
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(14.0));
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "10");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 5 }));
+
+        sheet.SetCells({ { "D1"_pos, "" }, { "E1"_pos, "" } });
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 3 }));
+        sheet.SetCells({});
+    }
+
+    void TestSetCellsRollback() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*A2");
+        sheet.SetCell("B1"_pos, "some text that is too long to be stored inline");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+        const size_t evaluations = sheet.GetEvaluationCount();
+        const Sheet::StorageStats stats = sheet.GetStorageStats();
+
+        auto check_unchanged = [&] {
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+            ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+1");
+            ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A2*A2");
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "some text that is too long to be stored inline");
+            ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+            ASSERT(sheet.GetCell("Z9"_pos) == nullptr);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 2 }));
+            ASSERT_EQUAL(sheet.GetStorageStats().cells, stats.cells);
+            // the old values are still cached
+            ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+            ASSERT_EQUAL(sheet.GetEvaluationCount(), evaluations);
+        };
+
+        bool caught = false;
+        try {
+            sheet.SetCells({ { "A1"_pos, "=A3+Z9" }, { "B1"_pos, "2" }, { "C1"_pos, "3" } });
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        check_unchanged();
+
+        caught = false;
+        try {
+            sheet.SetCells({ { "C1"_pos, "=Z9" }, { "A2"_pos, "=B1" }, { "B1"_pos, "=A2" } });
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        check_unchanged();
+
+        caught = false;
+        try {
+            sheet.SetCells({ { "C1"_pos, "=Z9" }, { "A1"_pos, "=1+" } });
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        check_unchanged();
+
+        caught = false;
+        try {
+            sheet.SetCells({ { "C1"_pos, "=Z9" }, { Position{ -1, 0 }, "1" } });
+        }
+        catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        check_unchanged();
+
+        sheet.SetCells({ { "A1"_pos, "=A1" }, { "A1"_pos, "2" } });
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(9.0));
+    }
+
+    // random batches on a small grid, compared with a full search of the
+    // resulting graph and with evaluating every formula directly
+    void TestSetCellsRandomized() {
+        const int size = 4;
+        std::mt19937 generator(7);
+        auto random_pos = [&] {
+            return Position{ int(generator() % size), int(generator() % size) };
+        };
+        auto texts = [&](const Sheet& sheet) {
+            std::map<Position, std::string> result;
+            for (int row = 0; row < size; ++row) {
+                for (int col = 0; col < size; ++col) {
+                    const CellInterface* cell = sheet.GetCell(Position{ row, col });
+                    if (cell != nullptr && !cell->GetText().empty()) {
+                        result[Position{ row, col }] = cell->GetText();
+                    }
+                }
+            }
+            return result;
+        };
+
+        Sheet sheet;
+        for (int step = 0; step < 2000; ++step) {
+            std::vector<std::pair<Position, std::string>> batch(generator() % 4 + 1);
+            for (auto& [pos, text] : batch) {
+                pos = random_pos();
+                text = generator() % 3 ? "=" + random_pos().ToString() + "+" + random_pos().ToString()
+                                       : std::to_string(step);
+            }
+
+            std::map<Position, std::string> before = texts(sheet);
+            std::map<Position, std::string> after = before;
+            for (const auto& [pos, text] : batch) {
+                after[pos] = text;
+            }
+            // a cycle exists if some cell can reach itself
+            bool expected = false;
+            for (const auto& [start, start_text] : after) {
+                std::set<Position> visited;
+                std::vector<Position> stack{ start };
+                while (!stack.empty() && !expected) {
+                    const Position pos = stack.back();
+                    stack.pop_back();
+                    auto it = after.find(pos);
+                    if (it == after.end() || it->second.size() < 2 || it->second[0] != FORMULA_SIGN) continue;
+                    for (Position ref : ParseFormula(it->second.substr(1))->GetReferencedCells()) {
+                        if (ref == start) expected = true;
+                        if (visited.insert(ref).second) stack.push_back(ref);
+                    }
+                }
+            }
+
+            bool caught = false;
+            try {
+                sheet.SetCells(batch);
+            }
+            catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT_EQUAL(caught, expected);
+            if (caught) {
+                ASSERT(texts(sheet) == before);
+                continue;
+            }
+            ASSERT(texts(sheet) == after);
+            for (const auto& [pos, text] : after) {
+                if (text.empty() || text[0] != FORMULA_SIGN) continue;
+                const FormulaInterface::Value expected_value = ParseFormula(text.substr(1))->Evaluate(sheet);
+                const CellInterface::Value value = sheet.GetCell(pos)->GetValue();
+                if (std::holds_alternative<double>(expected_value)) {
+                    ASSERT_EQUAL(std::get<double>(value), std::get<double>(expected_value));
+                }
+                else {
+                    ASSERT_EQUAL(std::get<FormulaError>(value), std::get<FormulaError>(expected_value));
+                }
+            }
+        }
+    }
+
+    void TestAggregateFunctions() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2.5");
+        sheet.SetCell("A3"_pos, "text");
+        sheet.SetCell("A4"_pos, "'4");
+        sheet.SetCell("A6"_pos, "=A1*-10");
+        auto value_of = [&](const std::string& text) {
+            sheet.SetCell("C1"_pos, text);
+            return sheet.GetCell("C1"_pos)->GetValue();
+        };
+
+        // empty cells and text that is not a number are skipped
+        ASSERT_EQUAL(value_of("=SUM(A1:A6)"), CellInterface::Value(-2.5));
+        ASSERT_EQUAL(value_of("=COUNT(A1:A6)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(value_of("=AVERAGE(A1:A6)"), CellInterface::Value(-2.5 / 4));
+        ASSERT_EQUAL(value_of("=MIN(A1:A6)"), CellInterface::Value(-10.0));
+        ASSERT_EQUAL(value_of("=MAX(A1:A6)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(value_of("=MAX(A6:A1)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(value_of("=SUM(A1:B2, 10, A1 * 2, SUM(A4:A4))"), CellInterface::Value(19.5));
+        ASSERT_EQUAL(value_of("=SUM()"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value_of("=MIN(B1:B9)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value_of("=COUNT(B1:B9)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value_of("=AVERAGE(B1:B9)"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(value_of("=-MAX(A1:A2)/2"), CellInterface::Value(-1.25));
+
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=-MAX(A1:A2)/2");
+        sheet.SetCell("C1"_pos, "=SUM( B3:A1 ,(1+2)*3,MIN(A1) )");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A1:B3,(1+2)*3,MIN(A1))");
+        // the cells of ranges are listed as ranges, not cell by cell
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
+        const std::vector<Range> ranges = dynamic_cast<const Cell*>(sheet.GetCell("C1"_pos))->GetReferencedRanges();
+        ASSERT_EQUAL(ranges.size(), 1u);
+        ASSERT(ranges[0] == (Range{ "A1"_pos, "B3"_pos }));
+
+        // errors are propagated, the first one row by row
+        sheet.SetCell("B5"_pos, "=1/0");
+        sheet.SetCell("A5"_pos, "=Z1");
+        sheet.SetCell("Z1"_pos, "x");
+        ASSERT_EQUAL(value_of("=COUNT(A1:B6)"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value_of("=SUM(B1:B6)"), CellInterface::Value(FormulaError::Category::Div0));
+        sheet.SetCell("Z1"_pos, "5");
+        ASSERT_EQUAL(value_of("=COUNT(A1:B6)"), CellInterface::Value(FormulaError::Category::Div0));
+        sheet.ClearCell("B5"_pos);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // edits inside the range reach the aggregate
+        sheet.SetCell("C2"_pos, "=SUM(A1:A6)");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(2.5));
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(-6.5));
+        sheet.ClearCell("A2"_pos);
+        sheet.SetCell("A3"_pos, "=A4*2");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(-1.0));
+
+        bool caught = false;
+        try {
+            sheet.SetCell("A6"_pos, "=MAX(A1:A9)");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), "=A1*-10");
+
+        for (const std::string text : { "=A1:A2", "=A1:A2+1", "=-A1:A2", "=SUM(A1:A2)+A1:A2", "=FOO(1)", "=SUM",
+                                        "=SUM(1", "=SUM(1,)", "=SUM(,1)", "=A1:", "=A1:B", "=sum(A1)", "=SUM(A1:A0)" }) {
+            try {
+                sheet.SetCell("D1"_pos, text);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+                // we expect this one
+            }
+        }
+    }
+
+    // aggregates read the numeric columns of the sheet, which have to agree
+    // with the cells whatever the order of edits and evaluations
+    void TestAggregatesRandomized() {
+        const int size = 6;
+        std::mt19937 generator(16);
+        auto random_pos = [&] {
+            return Position{ int(generator() % size), int(generator() % size) };
+        };
+        auto random_range = [&] {
+            return random_pos().ToString() + ":" + random_pos().ToString();
+        };
+        const std::vector<std::string> functions = { "SUM", "AVERAGE", "MIN", "MAX", "COUNT" };
+
+        Sheet sheet;
+        for (int step = 0; step < 3000; ++step) {
+            const Position pos = random_pos();
+            std::string text;
+            switch (generator() % 6) {
+            case 0: text = std::to_string(int(generator() % 20) - 10); break;
+            case 1: text = generator() % 2 ? "text" : "'7"; break;
+            case 2: text = "=1/" + random_pos().ToString(); break;
+            case 3: text = "=" + random_pos().ToString() + "*2"; break;
+            default:
+                text = "=" + functions[generator() % functions.size()] + "(" + random_range() + ","
+                       + random_pos().ToString() + ")";
+            }
+            try {
+                if (generator() % 5 == 0) {
+                    sheet.ClearCell(pos);
+                }
+                else {
+                    sheet.SetCell(pos, text);
+                }
+            }
+            catch (const CircularDependencyException&) {
+            }
+            if (step % 50 == 0) {
+                sheet.SetThreadCount(step % 100 == 0 ? 3 : 1);
+                sheet.Recalculate();
+            }
+
+            for (int row = 0; row < size; ++row) {
+                for (int col = 0; col < size; ++col) {
+                    const CellInterface* cell = sheet.GetCell(Position{ row, col });
+                    if (cell == nullptr || cell->GetText().empty() || cell->GetText()[0] != FORMULA_SIGN) continue;
+                    const FormulaInterface::Value expected = ParseFormula(cell->GetText().substr(1))->Evaluate(sheet);
+                    const CellInterface::Value value = cell->GetValue();
+                    if (std::holds_alternative<double>(expected)) {
+                        // the columns are summed in another order
+                        const double number = std::get<double>(expected);
+                        ASSERT(std::abs(std::get<double>(value) - number) <= 1e-12 * std::max(1.0, std::abs(number)));
+                    }
+                    else {
+                        ASSERT_EQUAL(std::get<FormulaError>(value), std::get<FormulaError>(expected));
+                    }
+                }
+            }
+        }
+    }
+
+    void TestRangeDependencies() {
+        Sheet sheet;
+        // an edit reaches only the rolling windows holding it
+        const int rows = 1000;
+        const int width = 10;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+        }
+        for (int row = 0; row + width <= rows; ++row) {
+            sheet.SetCell(Position{ row, 1 }, "=SUM(" + Position{ row, 0 }.ToString() + ":"
+                                              + Position{ row + width - 1, 0 }.ToString() + ")");
+        }
+        sheet.Recalculate();
+        const size_t evaluations = sheet.GetEvaluationCount();
+        sheet.SetCell(Position{ 500, 0 }, "0");
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetEvaluationCount() - evaluations, static_cast<size_t>(width));
+        ASSERT_EQUAL(sheet.GetCell(Position{ 495, 1 })->GetValue(), CellInterface::Value(4995.0 - 500.0));
+        ASSERT_EQUAL(sheet.GetCell(Position{ 501, 1 })->GetValue(), CellInterface::Value(5055.0));
+
+        // a range does not create the cells it holds
+        const size_t cells = sheet.GetStorageStats().cells;
+        sheet.SetCell("D1"_pos, "=COUNT(E1:E16384)");
+        ASSERT_EQUAL(sheet.GetStorageStats().cells, cells + 1);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet.SetCell("E16384"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0));
+        // a formula created in the range after the one reading it
+        sheet.SetCell("E5"_pos, "=A2/A1");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        sheet.SetCell("E5"_pos, "=A2+A1");
+        sheet.ClearCell("E16384"_pos);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT(!sheet.IsValid("E16384"_pos));
+
+        // cycles closed through ranges
+        Sheet cycles;
+        cycles.SetCell("A1"_pos, "=SUM(B1:B3)");
+        cycles.SetCell("C1"_pos, "=A1+1");
+        cycles.SetCell("D1"_pos, "=SUM(A1:A2)");
+        auto is_rejected = [&](const std::string& pos, const std::string& text) {
+            try {
+                cycles.SetCell(Position::FromString(pos), text);
+            }
+            catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(is_rejected("B2", "=C1"));
+        ASSERT(is_rejected("B3", "=D1*2"));
+        ASSERT(is_rejected("A2", "=MIN(A1:A3)"));
+        ASSERT(is_rejected("A1", "=SUM(B1:B3, A1:A1)"));
+        ASSERT(!is_rejected("B3", "=E1"));
+        ASSERT(is_rejected("E1", "=A1*2"));
+        ASSERT(!is_rejected("E1", "5"));
+        ASSERT_EQUAL(cycles.GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(cycles.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        bool caught = false;
+        try {
+            cycles.SetCells({ { "F1"_pos, "=SUM(B1:B3)" }, { "B1"_pos, "=F1" } });
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(cycles.GetCell("F1"_pos) == nullptr);
+        ASSERT(cycles.GetCell("B1"_pos) == nullptr);
+        cycles.SetCells({ { "B1"_pos, "=F1" }, { "F1"_pos, "=SUM(E1:E2)" } });
+        ASSERT_EQUAL(cycles.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+    }
+
+    // the same as TestCycleDetectionRandomized with ranges, whose cells are
+    // not linked to the formulas reading them
+    void TestRangeCyclesRandomized() {
+        const int size = 5;
+        std::mt19937 generator(17);
+        auto random_pos = [&] {
+            return Position{ int(generator() % size), int(generator() % size) };
+        };
+        auto random_range = [&] {
+            const Position a = random_pos();
+            const Position b = random_pos();
+            return Range{ { std::min(a.row, b.row), std::min(a.col, b.col) },
+                          { std::max(a.row, b.row), std::max(a.col, b.col) } };
+        };
+
+        // what the formulas of the sheet read, a single cell as a range of one
+        std::map<Position, std::vector<Range>> model;
+        auto has_cycle = [&model] {
+            // 0 unvisited, 1 on the path, 2 done
+            std::map<Position, int> state;
+            std::function<bool(Position)> visit = [&](Position pos) {
+                auto it = model.find(pos);
+                if (it == model.end()) return false;
+                int& current = state[pos];
+                if (current != 0) return current == 1;
+                current = 1;
+                for (const Range& range : it->second) {
+                    for (int row = range.first.row; row <= range.last.row; ++row) {
+                        for (int col = range.first.col; col <= range.last.col; ++col) {
+                            if (visit({ row, col })) return true;
+                        }
+                    }
+                }
+                state[pos] = 2;
+                return false;
+            };
+            for (const auto& [pos, ranges] : model) {
+                if (visit(pos)) return true;
+            }
+            return false;
+        };
+
+        Sheet sheet;
+        for (int step = 0; step < 2000; ++step) {
+            std::vector<std::pair<Position, std::string>> batch;
+            std::map<Position, std::vector<Range>> updated = model;
+            const int count = generator() % 4 == 0 ? 3 : 1;
+            for (int i = 0; i < count; ++i) {
+                const Position pos = random_pos();
+                if (generator() % 5 == 0) {
+                    batch.emplace_back(pos, std::to_string(step));
+                    updated.erase(pos);
+                    continue;
+                }
+                std::vector<Range> ranges;
+                std::string text = "=1";
+                for (int j = generator() % 3; j >= 0; --j) {
+                    if (generator() % 2 == 0) {
+                        const Position ref = random_pos();
+                        ranges.push_back({ ref, ref });
+                        text += "+" + ref.ToString();
+                    }
+                    else {
+                        ranges.push_back(random_range());
+                        text += "+SUM(" + ranges.back().first.ToString() + ":" + ranges.back().last.ToString() + ")";
+                    }
+                }
+                batch.emplace_back(pos, text);
+                updated[pos] = ranges;
+            }
+            // a later text for a position wins in both
+            std::swap(model, updated);
+            const bool expected = has_cycle();
+            if (expected) {
+                std::swap(model, updated);
+            }
+
+            bool caught = false;
+            try {
+                if (batch.size() == 1) {
+                    sheet.SetCell(batch[0].first, batch[0].second);
+                }
+                else {
+                    sheet.SetCells(batch);
+                }
+            }
+            catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT_EQUAL(caught, expected);
+            if (step % 100 == 0) {
+                sheet.Recalculate();
+            }
+        }
+
+        for (const auto& [pos, ranges] : model) {
+            const CellInterface* cell = sheet.GetCell(pos);
+            const FormulaInterface::Value expected = ParseFormula(cell->GetText().substr(1))->Evaluate(sheet);
+            if (std::holds_alternative<double>(expected)) {
+                ASSERT_EQUAL(std::get<double>(cell->GetValue()), std::get<double>(expected));
+            }
+            else {
+                ASSERT_EQUAL(std::get<FormulaError>(cell->GetValue()), std::get<FormulaError>(expected));
+            }
+        }
+    }
+
+    // the Function and Range alternatives of Formula.g4 and the listener
+    // building them are exercised only through the generated parser
+    void TestRangesWithEitherParser() {
+        const FormulaParserKind previous = GetFormulaParser();
+        for (FormulaParserKind kind : { FormulaParserKind::Antlr, FormulaParserKind::Handwritten }) {
+            SetFormulaParser(kind);
+            TestAggregateFunctions();
+            TestRangeDependencies();
+        }
+        SetFormulaParser(previous);
+    }
+
+    // parses with the given parser and describes the outcome:
+    // the printed AST and references, or the kind of exception
+    std::string DescribeParse(const std::string& text, FormulaParserKind kind) {
+        try {
+            const FormulaAST ast = ParseFormulaAST(text, kind);
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintFormula(out);
+            out << " | ";
+            ast.PrintCells(out);
+            return out.str();
+        }
+        catch (const FormulaException&) {
+            return "FormulaException";
+        }
+        catch (...) {
+            return "syntax error";
+        }
+    }
+
+    void CheckParsersAgree(const std::string& text) {
+        const std::string antlr = DescribeParse(text, FormulaParserKind::Antlr);
+        const std::string handwritten = DescribeParse(text, FormulaParserKind::Handwritten);
+        if (antlr != handwritten) {
+            ASSERT_EQUAL("\"" + text + "\": " + handwritten, "\"" + text + "\": " + antlr);
+        }
+    }
+
+    void TestHandwrittenParser() {
+        const std::vector<std::string> texts = {
+            "1", "  1  ", "1+2*3", "(1+2)*3", "1-2-3", "1/2/3", "1-(2-3)", "1/(2/3)", "-1", "+1", "--1",
+            "-+-1", "-(1+2)", "2*-3", "-2*3", "1*(2)", "((1))", "A1", "A1+B2*ZZ13", "-A1/(B1-C1)",
+            ".5", "1.5", "1e5", "1E+5", "2.5e-3", ".5e1", "1e-400", "1e400", "1.", "1.e5", "1e", "1E",
+            "1EA1", "A", "1A", "A0", "XFE1", "A16385", "A99999999999", "", " ", "()", "(1", "1)", "1 2",
+            "1+", "*1", "1**2", "1+*2", "A1 A2", "a1", "1\t+\r\n2", "1_2", "1,2", "A1:B2", "SUM(A1)",
+            "00012", "1..2", "1.2.3", "1ee2", "1e+", "1e+-2", "(((((1)))))", "-(-(-(1)))",
+            "SUM()", "SUM(A1:B2)", "MAX(B2:A1,1,A0)", "SUM(A0:B2)", "SUM(A1:B0)", "FOO(A0)", "FOO(1e400)",
+            "A1:B2", "-A1:B2", "A1:B2*2", "SUM(A1:B2)*COUNT(1,2)", "SUM(A1:B2:C3)", "SUM(A1,)", "SUM",
+            "SUM(-(A1:B2))", "SUM((A1:B2))", "A1:A0+1",
+        };
+        for (const std::string& text : texts) {
+            CheckParsersAgree(text);
+        }
+
+        // random token sequences, mostly invalid, and random valid expressions
+        const std::vector<std::string> tokens = {
+            "1", "0.25", ".5", "3e2", "4E-1", "A1", "B7", "AA10", "XFD16384", "A0", "+", "-", "*", "/",
+            "(", ")", " ", "1.", "e", "E", "AB", ".", "1e400", ":", ",", "SUM(", "MIN", "FOO(",
+        };
+        std::mt19937 rng(13);
+        for (int i = 0; i < 5000; ++i) {
+            std::string text;
+            const int length = 1 + rng() % 8;
+            for (int j = 0; j < length; ++j) {
+                text += tokens[rng() % tokens.size()];
+            }
+            CheckParsersAgree(text);
+        }
+
+        std::function<std::string(int)> expression = [&](int depth) -> std::string {
+            auto cell = [&] {
+                return Position{ static_cast<int>(rng() % 50), static_cast<int>(rng() % 50) }.ToString();
+            };
+            const unsigned choice = depth == 0 ? rng() % 2 : rng() % 8;
+            switch (choice) {
+            case 0: return std::to_string(rng() % 100) + (rng() % 2 ? ".5" : "");
+            case 1: return cell();
+            case 2: return "(" + expression(depth - 1) + ")";
+            case 3: return std::string(rng() % 2 ? "-" : "+") + expression(depth - 1);
+            case 4: return std::string(rng() % 2 ? "SUM(" : "MAX(") + cell() + ":" + cell() + ","
+                           + expression(depth - 1) + ")";
+            default: return expression(depth - 1) + std::string(1, "+-*/"[rng() % 4]) + expression(depth - 1);
+            }
+        };
+        for (int i = 0; i < 2000; ++i) {
+            CheckParsersAgree(expression(5));
+        }
+
+        // formulas built through the default parser behave the same with either
+        const FormulaParserKind previous = GetFormulaParser();
+        for (FormulaParserKind kind : { FormulaParserKind::Antlr, FormulaParserKind::Handwritten }) {
+            SetFormulaParser(kind);
+            TestFormulaArithmetic();
+            TestFormulaExpressionFormatting();
+            TestFormulaReferencedCells();
+            TestFormulaInvalidPosition();
+            TestFormulaIncorrect();
+        }
+        SetFormulaParser(previous);
+    }
+
+    void TestFormulaTemplates() {
+        Sheet sheet;
+        const int rows = 1000;
+        for (int i = 0; i < rows; ++i) {
+            const std::string row = std::to_string(i + 1);
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+            sheet.SetCell(Position{ i, 1 }, "2");
+            sheet.SetCell(Position{ i, 2 }, "=A" + row + "*B" + row + "+A1");
+        }
+        // A1 is absolute text, so every row has a template of its own;
+        // A1..A1000 relative to the row share one
+        ASSERT_EQUAL(sheet.GetFormulaTemplates().GetSize(), size_t(rows));
+        for (int i = 0; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 2 }, "=A" + std::to_string(i + 1) + " * B" + std::to_string(i + 1));
+        }
+        ASSERT_EQUAL(sheet.GetFormulaTemplates().GetSize(), 1u);
+
+        ASSERT_EQUAL(sheet.GetCell("C10"_pos)->GetText(), "=A10*B10");
+        ASSERT_EQUAL(sheet.GetCell("C10"_pos)->GetReferencedCells(), (std::vector{ "A10"_pos, "B10"_pos }));
+        ASSERT_EQUAL(sheet.GetCell("C10"_pos)->GetValue(), CellInterface::Value(18.0));
+        ASSERT_EQUAL(sheet.GetCell("C1000"_pos)->GetValue(), CellInterface::Value(1998.0));
+
+        // references above and to the left of the cell, numbers with exponents
+        sheet.SetCell("E5"_pos, "=D4+1E1");
+        sheet.SetCell("F9"_pos, "=E8+1E1");
+        ASSERT_EQUAL(sheet.GetCell("F9"_pos)->GetText(), "=E8+10");
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetReferencedCells(), std::vector{ "D4"_pos });
+        ASSERT_EQUAL(sheet.GetFormulaTemplates().GetSize(), 2u);
+
+        // a template is released with its last formula
+        for (int i = 0; i < rows; ++i) {
+            sheet.ClearCell(Position{ i, 2 });
+        }
+        ASSERT_EQUAL(sheet.GetFormulaTemplates().GetSize(), 1u);
+
+        bool caught = false;
+        try {
+            sheet.SetCell("B2"_pos, "=A1+ZZZZ1");
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    // the printing of cells one by one through their values and texts
+    std::string PrintCellByCell(const SheetInterface& sheet, bool values) {
+        std::ostringstream output;
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) output << '\t';
+                const CellInterface* cell = sheet.GetCell({ row, col });
+                if (cell == nullptr || cell->GetText().empty()) continue;
+                if (values) {
+                    output << cell->GetValue();
+                }
+                else {
+                    output << cell->GetText();
+                }
+            }
+            output << '\n';
+        }
+        return output.str();
+    }
+
+    void TestPrintFormatting() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1/0");
+        sheet.SetCell("B1"_pos, "=C1");
+        sheet.SetCell("C1"_pos, "text");
+        sheet.SetCell("D1"_pos, "'=escaped");
+        sheet.SetCell("A2"_pos, "=1/3");
+        sheet.SetCell("B2"_pos, "=1e20*3");
+        sheet.SetCell("C2"_pos, "=0-0.000012345678");
+        sheet.SetCell("D2"_pos, "=123456789");
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        // every error prints as operator<< for FormulaError prints it
+        ASSERT_EQUAL(values.str(), "#DIV/0!\t#DIV/0!\ttext\t=escaped\n"
+                                   "0.333333\t3e+20\t-1.23457e-05\t1.23457e+08\n");
+
+        // the precision of the stream is kept
+        std::ostringstream precise;
+        precise.precision(10);
+        sheet.PrintValues(precise);
+        ASSERT(precise.str().find("0.3333333333\t") != std::string::npos);
+
+        // and so are its other number flags
+        const std::vector<std::function<void(std::ostream&)>> formats = {
+            [](std::ostream& output) { output << std::fixed << std::setprecision(2); },
+            [](std::ostream& output) { output << std::scientific; },
+            [](std::ostream& output) { output << std::fixed << std::setprecision(300); },
+            [](std::ostream& output) { output << std::hexfloat; },
+            [](std::ostream& output) { output << std::showpos << std::uppercase; },
+        };
+        for (const auto& format : formats) {
+            std::ostringstream printed;
+            std::ostringstream expected;
+            format(printed);
+            format(expected);
+            sheet.PrintValues(printed);
+            for (int row = 0; row < 2; ++row) {
+                for (int col = 0; col < 4; ++col) {
+                    expected << (col > 0 ? "\t" : "") << sheet.GetCell({ row, col })->GetValue();
+                }
+                expected << '\n';
+            }
+            ASSERT_EQUAL(printed.str(), expected.str());
+        }
+    }
+
+    void TestPrintSparse() {
+        std::mt19937 random(18);
+        Sheet sheet;
+        // cells far apart, long texts crossing the buffer boundary and
+        // formulas printed through a stream on top of the buffer
+        const auto set_random_cell = [&](Position pos) {
+            switch (random() % 5) {
+            case 0:
+                sheet.SetCell(pos, std::to_string(random() % 1000) + "." + std::to_string(random() % 100));
+                break;
+            case 1:
+                sheet.SetCell(pos, "=" + Position{ static_cast<int>(random() % 400), 0 }.ToString() + "/7+"
+                                   + Position{ static_cast<int>(random() % 400), 1 }.ToString());
+                break;
+            case 2:
+                sheet.SetCell(pos, std::string(random() % 2 == 0 ? 30 : 100000, 'a' + random() % 26));
+                break;
+            case 3:
+                sheet.ClearCell(pos);
+                break;
+            default:
+                sheet.SetCell(pos, "=SUM(A1:C" + std::to_string(random() % 400 + 1) + ")");
+            }
+        };
+        for (int i = 0; i < 3000; ++i) {
+            try {
+                set_random_cell({ static_cast<int>(random() % 400), static_cast<int>(random() % 300) });
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+        ASSERT(sheet.GetPrintableSize().rows > 0);
+        for (bool values : { false, true }) {
+            std::ostringstream output;
+            if (values) {
+                sheet.PrintValues(output);
+            }
+            else {
+                sheet.PrintTexts(output);
+            }
+            ASSERT(output.str() == PrintCellByCell(sheet, values));
+
+            std::FILE* file = std::tmpfile();
+            ASSERT(file != nullptr);
+            if (values) {
+                sheet.PrintValues(fileno(file));
+            }
+            else {
+                sheet.PrintTexts(fileno(file));
+            }
+            std::rewind(file);
+            std::string written;
+            char chunk[4096];
+            for (size_t size; (size = std::fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+                written.append(chunk, size);
+            }
+            std::fclose(file);
+            ASSERT(written == output.str());
+        }
+
+        Sheet empty;
+        std::ostringstream output;
+        empty.PrintValues(output);
+        ASSERT_EQUAL(output.str(), "");
+    }
+
+    std::string PrintSheet(const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        sheet.PrintValues(output);
+        return output.str();
+    }
+
+    // where the order, the offset of a formula and its first reference are
+    // in every cell of a snapshot, see the layout in snapshot.cpp
+    struct SnapshotFields {
+        size_t order = 0;
+        size_t offset = 0;
+        size_t references = 0;
+    };
+
+    std::vector<SnapshotFields> FindSnapshotFields(const std::string& snapshot) {
+        size_t at = 8 + 2 * sizeof(std::uint32_t);
+        auto read = [&](auto& value) {
+            std::memcpy(&value, snapshot.data() + at, sizeof(value));
+            at += sizeof(value);
+        };
+        std::uint32_t template_count = 0;
+        std::uint32_t cell_count = 0;
+        read(template_count);
+        read(cell_count);
+        at += 2 * sizeof(std::uint32_t);
+        for (std::uint32_t i = 0; i < template_count; ++i) {
+            std::uint32_t size = 0;
+            read(size);
+            at += size;
+        }
+        std::vector<SnapshotFields> result(cell_count);
+        for (SnapshotFields& fields : result) {
+            at += 2 * sizeof(std::int32_t);
+            fields.order = at;
+            at += sizeof(std::uint32_t);
+            std::uint8_t kind = 0;
+            read(kind);
+            std::uint32_t size = 0;
+            switch (kind) {
+            case 1:
+            case 2:
+                read(size);
+                at += size + (kind == 2 ? sizeof(double) : 0);
+                break;
+            case 3: {
+                at += sizeof(std::uint32_t);
+                fields.offset = at;
+                at += 2 * sizeof(std::int32_t);
+                std::uint8_t value_kind = 0;
+                read(value_kind);
+                at += value_kind == 1 ? sizeof(double) : value_kind == 2 ? 1 : 0;
+                read(size);
+                fields.references = at;
+                at += size * sizeof(std::uint32_t);
+                break;
+            }
+            }
+        }
+        ASSERT_EQUAL(at, snapshot.size());
+        return result;
+    }
+
+    void TestSnapshot() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1.5");
+        sheet.SetCell("A2"_pos, "'=escaped");
+        sheet.SetCell("A3"_pos, std::string(100, 'x'));
+        sheet.SetCell("A4"_pos, "123456789012345678");
+        sheet.SetCell("B1"_pos, "=A1+Z9");
+        sheet.SetCell("B2"_pos, "=A2+Z10");
+        sheet.SetCell("B3"_pos, "=SUM(A1:A4)/-(+A1)");
+        sheet.SetCell("B4"_pos, "=1/0");
+        for (int row = 0; row < 40; ++row) {
+            sheet.SetCell(Position{ row, 3 }, "=" + Position{ row, 0 }.ToString() + "*2");
+        }
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.GetCell("B2"_pos)->GetValue();
+
+        std::ostringstream output;
+        SheetSnapshot::Save(sheet, output);
+        const std::string snapshot = output.str();
+        std::unique_ptr<Sheet> loaded = SheetSnapshot::Load(snapshot);
+        ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.5));
+        ASSERT_EQUAL(loaded->GetEvaluationCount(), 0u);
+        ASSERT(loaded->GetCell("Z9"_pos) != nullptr);
+        ASSERT_EQUAL(PrintSheet(*loaded), PrintSheet(sheet));
+        ASSERT_EQUAL(loaded->GetCell("B3"_pos)->GetText(), sheet.GetCell("B3"_pos)->GetText());
+
+        // the graph is linked: edits reach the dependents, cycles are found
+        for (Sheet* target : { &sheet, loaded.get() }) {
+            target->SetCell("A1"_pos, "4");
+            target->SetCell("Z10"_pos, "2");
+            target->SetCell("D41"_pos, "=D1+B1");
+            bool caught = false;
+            try {
+                target->SetCell("A1"_pos, "=D41");
+            }
+            catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+        ASSERT_EQUAL(loaded->GetCell("D41"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(PrintSheet(*loaded), PrintSheet(sheet));
+
+        // through a file
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin").string();
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        ASSERT(file != nullptr);
+        SheetSnapshot::Save(*loaded, fileno(file));
+        std::fclose(file);
+        ASSERT_EQUAL(PrintSheet(*SheetSnapshot::LoadFile(path)), PrintSheet(sheet));
+        std::filesystem::remove(path);
+
+        // a damaged snapshot is rejected, never loaded in part
+        for (size_t size = 0; size < snapshot.size(); ++size) {
+            bool caught = false;
+            try {
+                SheetSnapshot::Load(std::string_view(snapshot).substr(0, size));
+            }
+            catch (const SnapshotError&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+        std::mt19937 random(19);
+        for (int i = 0; i < 2000; ++i) {
+            std::string damaged = snapshot;
+            damaged[random() % damaged.size()] ^= static_cast<char>(1 + random() % 255);
+            try {
+                SheetSnapshot::Load(damaged);
+            }
+            catch (const SnapshotError&) {
+            }
+        }
+        std::string other_version = snapshot;
+        other_version[8] = 2;
+        bool caught = false;
+        try {
+            SheetSnapshot::Load(other_version);
+        }
+        catch (const SnapshotError&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // orders that would let a range close a cycle are rejected
+        Sheet ranges;
+        ranges.SetCell("A1"_pos, "=SUM(B1:B1)");
+        ranges.SetCell("B1"_pos, "=C1");
+        ranges.SetCell("C1"_pos, "1");
+        std::ostringstream ranges_output;
+        SheetSnapshot::Save(ranges, ranges_output);
+        const std::string valid = ranges_output.str();
+        ASSERT_EQUAL(PrintSheet(*SheetSnapshot::Load(valid)), PrintSheet(ranges));
+        const std::vector<SnapshotFields> fields = FindSnapshotFields(valid);
+        ASSERT_EQUAL(fields.size(), 3u);
+        auto read = [](const std::string& data, size_t at) {
+            std::int32_t value;
+            std::memcpy(&value, data.data() + at, sizeof(value));
+            return value;
+        };
+        auto write = [](std::string& data, size_t at, std::int32_t value) {
+            std::memcpy(data.data() + at, &value, sizeof(value));
+        };
+        // A1 = SUM(B1:B1) and B1 = A1, with A1 ordered before B1 as the
+        // reference of B1 requires
+        std::string cycle = valid;
+        write(cycle, fields[0].order, read(valid, fields[1].order));
+        write(cycle, fields[1].order, read(valid, fields[0].order));
+        write(cycle, fields[1].offset + sizeof(std::int32_t), read(valid, fields[1].offset + sizeof(std::int32_t)) - 2);
+        write(cycle, fields[1].references, 0);
+        // the same orders twice
+        std::string repeated = valid;
+        write(repeated, fields[2].order, read(valid, fields[1].order));
+        for (const std::string& invalid : { cycle, repeated }) {
+            caught = false;
+            try {
+                SheetSnapshot::Load(invalid);
+            }
+            catch (const SnapshotError&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+    }
+
+    // a sheet whose orders reached both ends of their range, as a long-lived
+    // one may, renumbers them instead of wrapping around
+    void TestOrderRenumbering() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < 20; ++row) {
+            sheet.SetCell(Position{ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A20)");
+        std::ostringstream output;
+        SheetSnapshot::Save(sheet, output);
+        std::string snapshot = output.str();
+
+        // the same relative order, the lower half of the cells right above 0
+        // and the upper half right below the largest order
+        const std::uint32_t max = std::numeric_limits<std::uint32_t>::max();
+        std::vector<std::pair<std::uint32_t, size_t>> orders;
+        for (const SnapshotFields& fields : FindSnapshotFields(snapshot)) {
+            std::uint32_t order = 0;
+            std::memcpy(&order, snapshot.data() + fields.order, sizeof(order));
+            orders.emplace_back(order, fields.order);
+        }
+        std::sort(orders.begin(), orders.end());
+        for (size_t i = 0; i < orders.size(); ++i) {
+            const size_t above = orders.size() - 1 - i;
+            const std::uint32_t order = i < orders.size() / 2 ? static_cast<std::uint32_t>(1 + i)
+                                                              : static_cast<std::uint32_t>(max - 1 - above);
+            std::memcpy(snapshot.data() + orders[i].second, &order, sizeof(order));
+        }
+        // the next and the lowest order follow the header and the counts
+        const std::uint32_t counters[] = { max, 1 };
+        std::memcpy(snapshot.data() + 8 + 4 * sizeof(std::uint32_t), counters, sizeof(counters));
+        std::unique_ptr<Sheet> loaded = SheetSnapshot::Load(snapshot);
+        ASSERT_EQUAL(PrintSheet(*loaded), PrintSheet(sheet));
+
+        // new cells, references lowered below everything, a batch against
+        // the order and cycles through all of them
+        for (Sheet* target : { &sheet, loaded.get() }) {
+            for (int row = 0; row < 50; ++row) {
+                target->SetCell(Position{ row, 2 }, "=" + Position{ row, 3 }.ToString() + "+A20");
+            }
+            target->SetCells({ { "A1"_pos, "=E1*2" }, { "E1"_pos, "=F1+1" }, { "F1"_pos, "=D50" }, { "D50"_pos, "3" } });
+            for (const auto& [pos, text] : { std::pair{ "D50"_pos, "=C1" }, std::pair{ "F1"_pos, "=B1" } }) {
+                bool caught = false;
+                try {
+                    target->SetCell(pos, text);
+                }
+                catch (const CircularDependencyException&) {
+                    caught = true;
+                }
+                ASSERT(caught);
+            }
+        }
+        ASSERT_EQUAL(PrintSheet(*loaded), PrintSheet(sheet));
+        ASSERT_EQUAL(loaded->GetCell("C50"_pos)->GetValue(), CellInterface::Value(3.0 + 27));
+
+        // the orders are back around the middle of the range
+        std::ostringstream renumbered;
+        SheetSnapshot::Save(*loaded, renumbered);
+        std::uint32_t next_and_lowest[2] = {};
+        std::memcpy(next_and_lowest, renumbered.str().data() + 8 + 4 * sizeof(std::uint32_t), sizeof(next_and_lowest));
+        ASSERT(next_and_lowest[0] < 3u << 30 && next_and_lowest[1] > 1u << 30);
+    }
+
+    std::unique_ptr<Sheet> ImportTable(const std::string& table, TableImporter::Format format) {
+        auto sheet = std::make_unique<Sheet>();
+        std::istringstream input(table);
+        TableImporter::Import(*sheet, input, format);
+        return sheet;
+    }
+
+    void TestTableImport() {
+        // what PrintTexts writes reads back as the same sheet
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1.5");
+        sheet.SetCell("A2"_pos, "'=escaped");
+        sheet.SetCell("A3"_pos, "text, with \"quotes\"");
+        sheet.SetCell("A4"_pos, "=");
+        sheet.SetCell("B1"_pos, "=A1+Z9");
+        sheet.SetCell("B2"_pos, "=SUM(A1:A4)/2");
+        sheet.SetCell("B4"_pos, "=1/0");
+        sheet.SetCell("C5"_pos, "=D7*2");
+        sheet.SetCell("D7"_pos, "7");
+        for (int row = 0; row < 40; ++row) {
+            sheet.SetCell(Position{ row, 5 }, "=" + Position{ row, 4 }.ToString() + "+" + Position{ row + 1, 5 }.ToString());
+        }
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        for (size_t thread_count : { 1, 4 }) {
+            Sheet imported;
+            imported.SetThreadCount(thread_count);
+            std::istringstream input(texts.str());
+            TableImporter::Import(imported, input);
+            ASSERT_EQUAL(PrintSheet(imported), PrintSheet(sheet));
+            // the filled column is parsed once
+            ASSERT(imported.GetFormulaTemplates().GetSize() < 10);
+            imported.SetCell("E40"_pos, "2.5");
+            ASSERT_EQUAL(imported.GetCell("F1"_pos)->GetValue(), CellInterface::Value(2.5));
+        }
+
+        // PrintTextsCsv quotes the texts PrintTexts cannot hold
+        sheet.SetCell("A6"_pos, "tab\there");
+        sheet.SetCell("B6"_pos, "two\nlines");
+        sheet.SetCell("C6"_pos, "\"quoted\"\r");
+        sheet.SetCell("D6"_pos, "a,b");
+        std::ostringstream csv_texts;
+        sheet.PrintTextsCsv(csv_texts);
+        auto from_csv = ImportTable(csv_texts.str(), TableImporter::Format::Csv);
+        ASSERT_EQUAL(PrintSheet(*from_csv), PrintSheet(sheet));
+        ASSERT_EQUAL(from_csv->GetCell("A6"_pos)->GetText(), "tab\there");
+        ASSERT_EQUAL(from_csv->GetCell("B6"_pos)->GetText(), "two\nlines");
+        ASSERT_EQUAL(from_csv->GetCell("C6"_pos)->GetText(), "\"quoted\"\r");
+        // while PrintTexts writes them as they are
+        Sheet raw;
+        raw.SetCell("A1"_pos, "tab\there");
+        raw.SetCell("A2"_pos, "two\nlines");
+        std::ostringstream raw_texts;
+        raw.PrintTexts(raw_texts);
+        ASSERT_EQUAL(ImportTable(raw_texts.str(), TableImporter::Format::Tsv)->GetPrintableSize(), (Size{ 3, 2 }));
+
+        // quoted fields, doubled quotes and \r\n line ends
+        auto csv = ImportTable("1,\"a,b\",\"say \"\"hi\"\"\"\r\n"
+                               ",\"two\nlines\",=A1*2\r\n"
+                               "\"\"\n"
+                               ",,x,a\"b",
+                               TableImporter::Format::Csv);
+        ASSERT_EQUAL(csv->GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(csv->GetCell("B1"_pos)->GetText(), "a,b");
+        ASSERT_EQUAL(csv->GetCell("C1"_pos)->GetText(), "say \"hi\"");
+        ASSERT(csv->GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(csv->GetCell("B2"_pos)->GetText(), "two\nlines");
+        ASSERT_EQUAL(csv->GetCell("C2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(csv->GetCell("A3"_pos) == nullptr);
+        ASSERT_EQUAL(csv->GetCell("C4"_pos)->GetText(), "x");
+        ASSERT_EQUAL(csv->GetCell("D4"_pos)->GetText(), "a\"b");
+        ASSERT_EQUAL(csv->GetPrintableSize(), (Size{ 4, 4 }));
+
+        // fields broken across chunks
+        std::mt19937 random(20);
+        const std::string alphabet = "ab1 ,\"\n\r\t";
+        std::vector<std::vector<std::string>> fields(3000, std::vector<std::string>(8));
+        std::string table;
+        for (auto& row : fields) {
+            for (size_t col = 0; col < row.size(); ++col) {
+                const size_t size = random() % 40;
+                for (size_t i = 0; i < size; ++i) {
+                    row[col] += alphabet[random() % alphabet.size()];
+                }
+                table += col > 0 ? ",\"" : "\"";
+                for (char c : row[col]) {
+                    table += c == '"' ? "\"\"" : std::string(1, c);
+                }
+                table += '"';
+            }
+            table += random() % 2 == 0 ? "\n" : "\r\n";
+        }
+        ASSERT(table.size() > 4 * TableImporter::CHUNK_SIZE);
+        auto chunked = ImportTable(table, TableImporter::Format::Csv);
+        for (int row = 0; row < static_cast<int>(fields.size()); ++row) {
+            for (int col = 0; col < 8; ++col) {
+                const CellInterface* cell = chunked->GetCell(Position{ row, col });
+                ASSERT_EQUAL(cell != nullptr ? cell->GetText() : "", fields[row][col]);
+            }
+        }
+
+        // a rejected table leaves the sheet as it was
+        auto expect_rejected = [](const std::string& table, TableImporter::Format format, auto exception) {
+            Sheet target;
+            target.SetCell("A1"_pos, "5");
+            std::istringstream input(table);
+            bool caught = false;
+            try {
+                TableImporter::Import(target, input, format);
+            }
+            catch (const decltype(exception)&) {
+                caught = true;
+            }
+            ASSERT(caught);
+            ASSERT_EQUAL(target.GetCell("A1"_pos)->GetText(), "5");
+            ASSERT(target.GetCell("B1"_pos) == nullptr);
+        };
+        expect_rejected("1\t2\n=A1+\n", TableImporter::Format::Tsv, FormulaException(""));
+        expect_rejected("=B1\t=A1\n", TableImporter::Format::Tsv, CircularDependencyException(""));
+        expect_rejected("1,\"2\n", TableImporter::Format::Csv, ImportError(""));
+        expect_rejected("1,\"2\"3\n", TableImporter::Format::Csv, ImportError(""));
+        expect_rejected("1\t2" + std::string(Position::MAX_COLS, '\t') + "3", TableImporter::Format::Tsv, ImportError(""));
+    }
+
+    void TestSheetStats() {
+        using Counter = SheetStats::Counter;
+        using Operation = SheetStats::Operation;
+        Sheet sheet;
+        SheetStats& stats = sheet.GetStats();
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+C1");
+        // the same shape, not parsed again
+        sheet.SetCell("B2"_pos, "=A2+C2");
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("D1"_pos, "=B1");
+        try {
+            sheet.SetCell("A1"_pos, "=D1");
+        }
+        catch (const CircularDependencyException&) {
+        }
+        sheet.ClearCell("B2"_pos);
+
+        if constexpr (SheetStats::ENABLED) {
+            ASSERT_EQUAL(stats.Get(Counter::FormulasParsed), 3u);
+            ASSERT_EQUAL(stats.Get(Counter::CellsMaterialized), 3u);
+            ASSERT_EQUAL(stats.Get(Counter::Evaluations), 1u);
+            ASSERT_EQUAL(stats.Get(Counter::CacheMisses), 1u);
+            ASSERT_EQUAL(stats.Get(Counter::CacheHits), 1u);
+            ASSERT_EQUAL(stats.Get(Counter::Invalidations), 1u);
+            ASSERT(stats.Get(Counter::CycleCheckVisits) > 0);
+            ASSERT_EQUAL(stats.GetLatencies(Operation::SetCell).GetCount(), 6u);
+            ASSERT_EQUAL(stats.GetLatencies(Operation::GetValue).GetCount(), 2u);
+            ASSERT_EQUAL(stats.GetLatencies(Operation::ClearCell).GetCount(), 1u);
+            const LatencyHistogram& set_cell = stats.GetLatencies(Operation::SetCell);
+            ASSERT(set_cell.GetPercentile(0.5) <= set_cell.GetPercentile(1.0));
+            ASSERT(set_cell.GetPercentile(1.0) == set_cell.GetMax());
+            std::ostringstream report;
+            stats.Print(report);
+            ASSERT(report.str().find("formulas_parsed 3\n") != std::string::npos);
+            stats.Reset();
+        }
+        for (size_t i = 0; i < static_cast<size_t>(Counter::COUNT); ++i) {
+            ASSERT_EQUAL(stats.Get(static_cast<Counter>(i)), 0u);
+        }
+        ASSERT_EQUAL(stats.GetLatencies(Operation::SetCell).GetCount(), 0u);
+
+        // a bucket holds the latencies from its lower bound up to the next one
+        LatencyHistogram histogram;
+        for (int nanoseconds : { 1, 5, 100, 1000, 1000, 123456 }) {
+            histogram.Record(std::chrono::nanoseconds(nanoseconds));
+        }
+        ASSERT_EQUAL(histogram.GetCount(), 6u);
+        ASSERT_EQUAL(histogram.GetTotal().count(), 125562);
+        ASSERT_EQUAL(histogram.GetPercentile(0.5).count(), 112);
+        ASSERT_EQUAL(histogram.GetPercentile(0.8).count(), 1024);
+        ASSERT_EQUAL(histogram.GetPercentile(1.0).count(), 123456);
+        for (size_t i = 0; i + 1 < LatencyHistogram::BUCKETS; ++i) {
+            ASSERT(LatencyHistogram::GetBucketLower(i) < LatencyHistogram::GetBucketLower(i + 1));
+        }
+    }
+
+    void TestEvaluationProfiler() {
+        const int rows = 40;
+        Sheet sheet;
+        EvaluationProfiler profiler(1000);
+        sheet.SetProfiler(&profiler);
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A40)");
+
+        // reading the end of the chain evaluates it all, each inclusive span
+        // holding those of the references computed for it
+        ASSERT_EQUAL(sheet.GetCell(Position{ rows - 1, 0 })->GetValue(), CellInterface::Value(double(rows)));
+        std::vector<EvaluationProfiler::CellProfile> ranking = profiler.GetRanking();
+        ASSERT_EQUAL(ranking.size(), size_t(rows - 1));
+        std::map<Position, EvaluationProfiler::CellProfile> by_position;
+        for (size_t i = 0; i < ranking.size(); ++i) {
+            const EvaluationProfiler::CellProfile& profile = ranking[i];
+            ASSERT_EQUAL(profile.evaluations, 1u);
+            ASSERT(profile.self <= profile.inclusive);
+            ASSERT(i == 0 || ranking[i - 1].self >= profile.self);
+            by_position[profile.pos] = profile;
+        }
+        for (int row = 2; row < rows; ++row) {
+            const auto& profile = by_position[Position{ row, 0 }];
+            const auto& reference = by_position[Position{ row - 1, 0 }];
+            ASSERT(profile.inclusive >= reference.inclusive + profile.self);
+        }
+
+        std::ostringstream report;
+        profiler.PrintReport(report, sheet, 3);
+        const std::string text = report.str();
+        ASSERT(text.find(std::to_string(rows - 1) + " evaluations of " + std::to_string(rows - 1) + " cells") == 0);
+        ASSERT_EQUAL(std::count(text.begin(), text.end(), '\n'), 5);
+        ASSERT(text.find(ranking[0].pos.ToString() + "\t1\t") != std::string::npos);
+        ASSERT(text.find("\t" + sheet.GetCell(ranking[0].pos)->GetText() + "\n") != std::string::npos);
+
+        // a recalculation on several threads, then one on the calling thread
+        profiler.Clear();
+        sheet.SetThreadCount(4);
+        sheet.SetCell("A1"_pos, "2");
+        sheet.Recalculate();
+        sheet.SetThreadCount(1);
+        sheet.SetCell("A1"_pos, "3");
+        sheet.Recalculate();
+        ranking = profiler.GetRanking();
+        ASSERT_EQUAL(ranking.size(), size_t(rows));
+        for (const EvaluationProfiler::CellProfile& profile : ranking) {
+            ASSERT_EQUAL(profile.evaluations, 2u);
+        }
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(double(rows * (rows + 5) / 2)));
+
+        std::ostringstream trace;
+        profiler.WriteChromeTrace(trace);
+        const std::string json = trace.str();
+        ASSERT(json.rfind("{\"traceEvents\": [", 0) == 0);
+        size_t events = 0;
+        for (size_t at = json.find("\"ph\": \"X\""); at != std::string::npos; at = json.find("\"ph\": \"X\"", at + 1)) {
+            ++events;
+        }
+        ASSERT_EQUAL(events, size_t(2 * rows + 2));
+        size_t recalculations = 0;
+        for (size_t at = json.find("\"name\": \"Recalculate\""); at != std::string::npos;
+             at = json.find("\"name\": \"Recalculate\"", at + 1)) {
+            ++recalculations;
+        }
+        ASSERT_EQUAL(recalculations, 2u);
+        ASSERT(json.find("\"name\": \"B1\", \"cat\": \"formula\"") != std::string::npos);
+        ASSERT(json.find("\"args\": {\"self_us\": ") != std::string::npos);
+
+        ASSERT_EQUAL(profiler.GetDroppedSpanCount(), 0u);
+
+        // nothing is recorded once the profiler is unset
+        sheet.SetProfiler(nullptr);
+        sheet.SetCell("A1"_pos, "4");
+        sheet.Recalculate();
+        ASSERT_EQUAL(profiler.GetRanking().size(), size_t(rows));
+        profiler.Clear();
+        ASSERT(profiler.GetRanking().empty());
+
+        // spans beyond the trace capacity are counted, not kept, while the
+        // time of every cell is
+        auto count_events = [](const EvaluationProfiler& profiler) {
+            std::ostringstream trace;
+            profiler.WriteChromeTrace(trace);
+            const std::string json = trace.str();
+            return std::count(json.begin(), json.end(), '\n') - 2;
+        };
+        EvaluationProfiler capped(10);
+        EvaluationProfiler totals_only;
+        int value = 5;
+        for (EvaluationProfiler* recording : { &capped, &totals_only }) {
+            sheet.SetProfiler(recording);
+            sheet.SetCell("A1"_pos, std::to_string(value++));
+            sheet.Recalculate();
+            ASSERT_EQUAL(recording->GetRanking().size(), size_t(rows));
+        }
+        sheet.SetProfiler(nullptr);
+        ASSERT_EQUAL(count_events(capped), 10);
+        ASSERT_EQUAL(capped.GetDroppedSpanCount(), size_t(rows + 1 - 10));
+        ASSERT_EQUAL(count_events(totals_only), 0);
+        ASSERT_EQUAL(totals_only.GetDroppedSpanCount(), 0u);
+    }
+
+    void TestVersionedSheet() {
+        VersionedSheet sheet;
+        ASSERT(!sheet.CanUndo() && !sheet.CanRedo());
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCells({ { "A2"_pos, "=A1+1" }, { "A3"_pos, "=A2*10" } });
+        const SheetVersion filled = sheet.GetVersion();
+        sheet.SetCell("A1"_pos, "5");
+        sheet.ClearCell("A2"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        sheet.Undo();
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(60.0));
+        sheet.Undo();
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(20.0));
+        // the batch is one step
+        sheet.Undo();
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+        sheet.Undo();
+        ASSERT(!sheet.CanUndo());
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+        sheet.Undo();
+        for (int i = 0; i < 3; ++i) {
+            sheet.Redo();
+        }
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(60.0));
+        ASSERT(sheet.CanRedo());
+
+        // a new step drops the undone ones
+        sheet.SetCell("B1"_pos, "text");
+        ASSERT(!sheet.CanRedo());
+        sheet.Undo();
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        sheet.Redo();
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "text");
+
+        // nor is a change that leaves every text as it was, and the undone
+        // steps are kept
+        sheet.Undo();
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCells({ { "A2"_pos, "=A1 + 1" }, { "C5"_pos, "" } });
+        sheet.ClearCell("D4"_pos);
+        ASSERT(sheet.CanRedo());
+        sheet.Redo();
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "text");
+
+        // a rejected change is no step
+        const SheetVersion before = sheet.GetVersion();
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=A3");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(sheet.GetVersion().Diff(before).empty());
+        sheet.Undo();
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+
+        // versions keep their texts, formulas as the sheet prints them
+        ASSERT_EQUAL(filled.GetCellCount(), 3u);
+        ASSERT_EQUAL(filled.GetText("A2"_pos), "=A1+1");
+        ASSERT_EQUAL(filled.GetText("A1"_pos), "1");
+        ASSERT(filled.GetText("Z100"_pos).empty());
+        ASSERT_EQUAL(before.GetText("A1"_pos), "5");
+        ASSERT_EQUAL(before.GetText("B1"_pos), "text");
+        sheet.Restore(filled);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT(sheet.GetVersion().Diff(filled).empty());
+        sheet.Undo();
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        // the differing cells, with their texts in the other version
+        const SheetVersion edited = filled.With({ { "C7"_pos, "x" }, { "A1"_pos, "" }, { "A2"_pos, "=A1+1" } });
+        ASSERT_EQUAL(edited.GetCellCount(), 3u);
+        const SheetVersion::Cells diff = filled.Diff(edited);
+        ASSERT_EQUAL(diff.size(), 2u);
+        ASSERT(diff[0] == std::make_pair("A1"_pos, std::string()));
+        ASSERT(diff[1] == std::make_pair("C7"_pos, std::string("x")));
+        ASSERT(filled.With({ { "A1"_pos, "" }, { "A2"_pos, "" }, { "A3"_pos, "" } }).Diff(SheetVersion()).empty());
+
+        // another sheet takes the version
+        VersionedSheet other;
+        other.Restore(filled);
+        std::ostringstream expected;
+        std::ostringstream restored;
+        sheet.Restore(filled);
+        sheet.PrintValues(expected);
+        other.PrintValues(restored);
+        ASSERT_EQUAL(restored.str(), expected.str());
+        ASSERT_EQUAL(restored.str(), "1\n2\n20\n");
+
+        // the parsed formulas a version keeps are taken, not parsed again
+        VersionedSheet source;
+        source.SetCell("B2"_pos, "=A1+A2*3");
+        auto ast_of = [](const VersionedSheet& sheet, Position pos) {
+            return static_cast<const Cell*>(sheet.GetSheet().GetCell(pos))->GetFormula()->GetAST().get();
+        };
+        const FormulaAST* source_ast = ast_of(source, "B2"_pos);
+        ASSERT(source.GetVersion().GetFormula("B2"_pos) != nullptr);
+        ASSERT(source.GetVersion().GetFormula("A1"_pos) == nullptr);
+        other.Restore(source.GetVersion());
+        ASSERT_EQUAL(ast_of(other, "B2"_pos), source_ast);
+        other.SetCell("B2"_pos, "=A1");
+        other.Undo();
+        ASSERT_EQUAL(ast_of(other, "B2"_pos), source_ast);
+        // the removed cells B2 references stay, empty, the others go
+        ASSERT(other.GetCell("A2"_pos) != nullptr && other.GetCell("A2"_pos)->GetText().empty());
+        ASSERT(other.GetCell("A3"_pos) == nullptr);
+        other.Undo();
+        ASSERT_EQUAL(other.GetCell("A3"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT(other.GetCell("B2"_pos) == nullptr);
+    }
+
+    // random changes, undos and redos against the texts kept for every step
+    void TestVersionedSheetRandomized() {
+        std::mt19937 random(25);
+        const int size = 6;
+        auto random_position = [&] {
+            return Position{ static_cast<int>(random() % size), static_cast<int>(random() % size) };
+        };
+        auto random_text = [&]() -> std::string {
+            switch (random() % 4) {
+            case 0: return std::to_string(random() % 100);
+            case 1: return "word" + std::to_string(random() % 3);
+            case 2: return "=" + random_position().ToString() + "+" + random_position().ToString();
+            default: return "=SUM(A1:" + random_position().ToString() + ")";
+            }
+        };
+        auto print = [](const SheetInterface& sheet) {
+            std::ostringstream output;
+            sheet.PrintTexts(output);
+            sheet.PrintValues(output);
+            return output.str();
+        };
+
+        VersionedSheet sheet;
+        // the texts of every step, states[current] those of the sheet
+        std::vector<std::map<Position, std::string>> states(1);
+        size_t current = 0;
+        for (int step = 0; step < 600; ++step) {
+            const unsigned action = random() % 10;
+            if (action < 2) {
+                sheet.Undo();
+                if (current > 0) --current;
+            }
+            else if (action < 3) {
+                sheet.Redo();
+                if (current + 1 < states.size()) ++current;
+            }
+            else {
+                std::map<Position, std::string> state = states[current];
+                try {
+                    if (action < 5) {
+                        const Position pos = random_position();
+                        sheet.ClearCell(pos);
+                        state.erase(pos);
+                    }
+                    else if (action < 8) {
+                        const Position pos = random_position();
+                        const std::string text = random_text();
+                        sheet.SetCell(pos, text);
+                        state[pos] = text;
+                    }
+                    else {
+                        SheetVersion::Cells cells;
+                        for (unsigned i = random() % 5; i > 0; --i) {
+                            cells.emplace_back(random_position(), random_text());
+                        }
+                        sheet.SetCells(cells);
+                        for (const auto& [pos, text] : cells) {
+                            state[pos] = text;
+                        }
+                    }
+                }
+                catch (const CircularDependencyException&) {
+                    continue;
+                }
+                // a change leaving the texts as they were is no step
+                if (state != states[current]) {
+                    states.resize(current + 1);
+                    states.push_back(std::move(state));
+                    ++current;
+                }
+            }
+
+            ASSERT_EQUAL(sheet.CanUndo(), current > 0);
+            ASSERT_EQUAL(sheet.CanRedo(), current + 1 < states.size());
+            Sheet expected;
+            for (const auto& [pos, text] : states[current]) {
+                expected.SetCell(pos, text);
+            }
+            ASSERT_EQUAL(print(sheet), print(expected));
+            size_t cell_count = 0;
+            for (const auto& [pos, text] : states[current]) {
+                cell_count += !text.empty();
+            }
+            ASSERT_EQUAL(sheet.GetVersion().GetCellCount(), cell_count);
+        }
+    }
+
     }  // namespace
 
 int main() {
@@ -369,11 +2351,43 @@ int main() {
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestNumericText);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCellValueCache);
+    RUN_TEST(tr, TestFormulaEvaluationOrder);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestCellPool);
+    RUN_TEST(tr, TestCellFootprint);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestLongChainCycleCheck);
+    RUN_TEST(tr, TestCycleDetectionRandomized);
+    RUN_TEST(tr, TestHighFanIn);
+    RUN_TEST(tr, TestRecalculateEvaluatesOnce);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestConcurrentReads);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestSetCellsRollback);
+    RUN_TEST(tr, TestSetCellsRandomized);
+    RUN_TEST(tr, TestFormulaTemplates);
+    RUN_TEST(tr, TestHandwrittenParser);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestAggregatesRandomized);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestRangeCyclesRandomized);
+    RUN_TEST(tr, TestRangesWithEitherParser);
+    RUN_TEST(tr, TestPrintFormatting);
+    RUN_TEST(tr, TestPrintSparse);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestOrderRenumbering);
+    RUN_TEST(tr, TestTableImport);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestEvaluationProfiler);
+    RUN_TEST(tr, TestVersionedSheet);
+    RUN_TEST(tr, TestVersionedSheetRandomized);
     return 0;
 }
@@ -0,0 +1,201 @@
+#include "number_columns.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+void NumberColumns::AddReader(int first_col, int last_col, std::vector<int>& opened) {
+    auto it = columns_.lower_bound(first_col);
+    for (int col = first_col; col <= last_col; ++col) {
+        if (it == columns_.end() || it->first != col) {
+            it = columns_.emplace_hint(it, col, Column{});
+            opened.push_back(col);
+        }
+        ++it->second.reader_count;
+        ++it;
+    }
+}
+
+void NumberColumns::RemoveReader(int first_col, int last_col) {
+    auto it = columns_.find(first_col);
+    for (int col = first_col; col <= last_col; ++col) {
+        assert(it != columns_.end() && it->first == col);
+        if (--it->second.reader_count == 0) {
+            it = columns_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void NumberColumns::Reserve(Position pos) {
+    auto it = columns_.find(pos.col);
+    if (it == columns_.end()) return;
+    std::vector<std::unique_ptr<Block>>& blocks = it->second.blocks;
+    const size_t index = pos.row / BLOCK_SIZE;
+    if (index >= blocks.size()) {
+        blocks.resize(index + 1);
+    }
+    if (blocks[index] == nullptr) {
+        blocks[index] = std::make_unique<Block>();
+    }
+    ++blocks[index]->cell_count;
+}
+
+void NumberColumns::Release(Position pos) {
+    auto it = columns_.find(pos.col);
+    if (it == columns_.end()) return;
+    std::vector<std::unique_ptr<Block>>& blocks = it->second.blocks;
+    const size_t index = pos.row / BLOCK_SIZE;
+    if (index >= blocks.size() || blocks[index] == nullptr) return;
+    assert(blocks[index]->kinds[pos.row % BLOCK_SIZE] == BLANK);
+    if (--blocks[index]->cell_count == 0) {
+        blocks[index].reset();
+        while (!blocks.empty() && blocks.back() == nullptr) {
+            blocks.pop_back();
+        }
+    }
+}
+
+NumberColumns::Block* NumberColumns::FindBlock(Position pos) const {
+    auto it = columns_.find(pos.col);
+    if (it == columns_.end()) return nullptr;
+    const std::vector<std::unique_ptr<Block>>& blocks = it->second.blocks;
+    const size_t index = pos.row / BLOCK_SIZE;
+    return index < blocks.size() ? blocks[index].get() : nullptr;
+}
+
+void NumberColumns::Store(Position pos, Kind kind, double value) {
+    Block* block = FindBlock(pos);
+    if (block == nullptr) return;
+    block->numbers[pos.row % BLOCK_SIZE] = value;
+    block->kinds[pos.row % BLOCK_SIZE] = kind;
+}
+
+void NumberColumns::StoreNumber(Position pos, double value) {
+    Store(pos, NUMBER, value);
+}
+
+void NumberColumns::StoreError(Position pos, FormulaError error) {
+    Store(pos, static_cast<Kind>(ERROR + static_cast<int>(error.GetCategory())), 0.0);
+}
+
+void NumberColumns::StoreBlank(Position pos) {
+    Store(pos, BLANK, 0.0);
+}
+
+void NumberColumns::StorePending(Position pos) {
+    Store(pos, PENDING, 0.0);
+}
+
+// The rows are split between independent accumulators, so the additions
+// are not reordered behind the compiler's back and the loop is still
+// vectorized; the result does not depend on the target.
+int NumberColumns::SummarizeBlock(const Block& block, int begin, int end, RangeSummary& summary) {
+    constexpr int LANES = 4;
+    constexpr double inf = std::numeric_limits<double>::infinity();
+    double sums[LANES] = {};
+    double mins[LANES] = { inf, inf, inf, inf };
+    double maxs[LANES] = { -inf, -inf, -inf, -inf };
+    size_t counts[LANES] = {};
+    std::uint8_t max_kind = BLANK;
+
+    const double* numbers = block.numbers.data();
+    const std::uint8_t* kinds = block.kinds.data();
+    int row = begin;
+    for (; row + LANES <= end; row += LANES) {
+        for (int lane = 0; lane < LANES; ++lane) {
+            const double number = numbers[row + lane];
+            const bool is_number = kinds[row + lane] == NUMBER;
+            sums[lane] += number;
+            mins[lane] = std::min(mins[lane], is_number ? number : inf);
+            maxs[lane] = std::max(maxs[lane], is_number ? number : -inf);
+            counts[lane] += is_number;
+            max_kind = std::max(max_kind, kinds[row + lane]);
+        }
+    }
+    for (; row < end; ++row) {
+        const bool is_number = kinds[row] == NUMBER;
+        sums[0] += numbers[row];
+        mins[0] = std::min(mins[0], is_number ? numbers[row] : inf);
+        maxs[0] = std::max(maxs[0], is_number ? numbers[row] : -inf);
+        counts[0] += is_number;
+        max_kind = std::max(max_kind, kinds[row]);
+    }
+
+    for (int lane = 0; lane < LANES; ++lane) {
+        summary.sum += sums[lane];
+        summary.min = std::min(summary.min, mins[lane]);
+        summary.max = std::max(summary.max, maxs[lane]);
+        summary.count += counts[lane];
+    }
+    if (max_kind < ERROR) return -1;
+    // errors are rare, finding the first one may take another pass
+    row = begin;
+    while (kinds[row] < ERROR) ++row;
+    return row;
+}
+
+RangeSummary NumberColumns::Summarize(Position first, Position last) const {
+    RangeSummary result;
+    // the first error row by row, the columns are walked one by one
+    Position error_pos = Position::NONE;
+    for (auto it = columns_.lower_bound(first.col); it != columns_.end() && it->first <= last.col; ++it) {
+        const int col = it->first;
+        const std::vector<std::unique_ptr<Block>>& blocks = it->second.blocks;
+        const int last_block = std::min(last.row / BLOCK_SIZE, static_cast<int>(blocks.size()) - 1);
+        for (int index = first.row / BLOCK_SIZE; index <= last_block; ++index) {
+            const Block* block = blocks[index].get();
+            if (block == nullptr) continue;
+            const int begin = std::max(first.row - index * BLOCK_SIZE, 0);
+            const int end = std::min(last.row - index * BLOCK_SIZE + 1, BLOCK_SIZE);
+            const int error_row = SummarizeBlock(*block, begin, end, result);
+            if (error_row < 0) continue;
+            const Position pos{ index * BLOCK_SIZE + error_row, col };
+            if (!result.error || pos < error_pos) {
+                result.error = FormulaError(static_cast<FormulaError::Category>(block->kinds[error_row] - ERROR));
+                error_pos = pos;
+            }
+        }
+    }
+    return result;
+}
+
+void NumberColumns::FindPending(Position first, Position last, std::vector<Position>& out) const {
+    for (auto it = columns_.lower_bound(first.col); it != columns_.end() && it->first <= last.col; ++it) {
+        const int col = it->first;
+        const std::vector<std::unique_ptr<Block>>& blocks = it->second.blocks;
+        const int last_block = std::min(last.row / BLOCK_SIZE, static_cast<int>(blocks.size()) - 1);
+        for (int index = first.row / BLOCK_SIZE; index <= last_block; ++index) {
+            const Block* block = blocks[index].get();
+            if (block == nullptr) continue;
+            const int begin = std::max(first.row - index * BLOCK_SIZE, 0);
+            const int end = std::min(last.row - index * BLOCK_SIZE + 1, BLOCK_SIZE);
+            // pending cells are rare, the first pass only tells if there are any
+            bool found = false;
+            for (int row = begin; row < end; ++row) {
+                found |= block->kinds[row] == PENDING;
+            }
+            if (!found) continue;
+            for (int row = begin; row < end; ++row) {
+                if (block->kinds[row] == PENDING) {
+                    out.push_back({ index * BLOCK_SIZE + row, col });
+                }
+            }
+        }
+    }
+}
+
+size_t NumberColumns::GetMemoryUsage() const {
+    size_t result = 0;
+    for (const auto& [col, column] : columns_) {
+        // a tree node holds the column and three pointers and a color
+        result += sizeof(Column) + 4 * sizeof(void*);
+        result += column.blocks.capacity() * sizeof(std::unique_ptr<Block>);
+        for (const std::unique_ptr<Block>& block : column.blocks) {
+            if (block != nullptr) result += sizeof(Block);
+        }
+    }
+    return result;
+}
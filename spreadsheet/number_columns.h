@@ -0,0 +1,87 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+// A numeric copy of the cell values kept column by column, so that an
+// aggregate function reads a range as a few contiguous arrays instead of
+// visiting its cells one by one. Only the columns some range reads are
+// kept, each split into blocks of BLOCK_SIZE rows allocated while the block
+// holds at least one cell; values stored elsewhere are dropped.
+//
+// Storing a value never allocates: the block of a cell is reserved when the
+// cell is created or its column starts being read, so formulas evaluated on
+// different threads may store their values at the same time.
+//
+// Formulas whose value is not computed yet are marked pending, which lets a
+// range find the formulas it has to wait for without a dependency per cell.
+class NumberColumns {
+public:
+    static constexpr int BLOCK_SIZE = 64;
+
+    // a range reads the columns from first to last; appends those no range
+    // read before, their cells have to be reserved and stored again
+    void AddReader(int first_col, int last_col, std::vector<int>& opened);
+    // a range added with AddReader is gone, the columns no range reads are
+    // freed
+    void RemoveReader(int first_col, int last_col);
+
+    // a cell was created at pos
+    void Reserve(Position pos);
+    // the cell at pos was destroyed, it must have been stored as blank
+    void Release(Position pos);
+
+    void StoreNumber(Position pos, double value);
+    void StoreError(Position pos, FormulaError error);
+    // a cell ranges skip: empty or text that is not a number
+    void StoreBlank(Position pos);
+    // a formula whose value is not computed yet
+    void StorePending(Position pos);
+
+    // the cells from first to last, both valid and first not after last;
+    // pending cells are skipped
+    RangeSummary Summarize(Position first, Position last) const;
+
+    // appends the pending cells from first to last
+    void FindPending(Position first, Position last, std::vector<Position>& out) const;
+
+    // bytes allocated for the columns and their blocks
+    size_t GetMemoryUsage() const;
+
+private:
+    enum Kind : std::uint8_t {
+        BLANK,
+        NUMBER,
+        PENDING,
+        // ERROR + category
+        ERROR,
+    };
+
+    struct Block {
+        // 0 unless the kind is NUMBER, so that they can be summed blindly
+        std::array<double, BLOCK_SIZE> numbers{};
+        std::array<std::uint8_t, BLOCK_SIZE> kinds{};
+        int cell_count = 0;
+    };
+
+    struct Column {
+        // ranges reading the column
+        int reader_count = 0;
+        std::vector<std::unique_ptr<Block>> blocks;
+    };
+
+    Block* FindBlock(Position pos) const;
+    void Store(Position pos, Kind kind, double value);
+
+    // adds the numbers of rows [begin, end) of the block to the summary,
+    // returns the first of the rows holding an error or -1
+    static int SummarizeBlock(const Block& block, int begin, int end, RangeSummary& summary);
+
+    // the columns read by a range, by index
+    std::map<int, Column> columns_;
+};
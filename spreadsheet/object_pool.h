@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Slab allocator: objects are placed into large chunks whose capacity grows
+// geometrically, so n objects cost O(log n) allocations. Freed slots are
+// reused through per-chunk free lists, and a chunk goes back to the system
+// once all of its objects are destroyed (one empty chunk is kept as a spare).
+// Objects never move: a pointer stays valid until the object is destroyed.
+template <typename T>
+class ObjectPool {
+public:
+    static constexpr size_t FIRST_CHUNK_CAPACITY = 64;
+    static constexpr size_t MAX_CHUNK_CAPACITY = 65536;
+
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    // the owner must destroy the live objects first
+    ~ObjectPool() = default;
+
+    template <typename... Args>
+    T* Create(Args&&... args) {
+        Chunk& chunk = available_ != nullptr ? *available_ : AddChunk();
+        Slot* slot;
+        if (chunk.free_list != nullptr) {
+            slot = chunk.free_list;
+            chunk.free_list = slot->next_free;
+        }
+        else {
+            slot = &chunk.slots[chunk.used++];
+        }
+        T* object = new (&slot->value) T(std::forward<Args>(args)...);
+        ++chunk.live;
+        ++size_;
+        if (&chunk == spare_) spare_ = nullptr;
+        if (chunk.IsFull()) Unlink(chunk);
+        return object;
+    }
+
+    void Destroy(T* object) {
+        auto it = std::prev(chunks_.upper_bound(reinterpret_cast<const Slot*>(object)));
+        Chunk& chunk = it->second;
+        const bool was_full = chunk.IsFull();
+
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next_free = chunk.free_list;
+        chunk.free_list = slot;
+        --chunk.live;
+        --size_;
+
+        if (was_full) Link(chunk);
+        if (chunk.live == 0) {
+            if (spare_ != nullptr) Release(*spare_);
+            spare_ = &chunk;
+        }
+    }
+
+    // number of live objects
+    size_t GetSize() const {
+        return size_;
+    }
+
+    size_t GetChunkCount() const {
+        return chunks_.size();
+    }
+
+    size_t GetCapacity() const {
+        size_t result = 0;
+        for (const auto& [begin, chunk] : chunks_) {
+            result += chunk.capacity;
+        }
+        return result;
+    }
+
+private:
+    union Slot {
+        Slot() {
+        }
+        ~Slot() {
+        }
+
+        T value;
+        Slot* next_free;
+    };
+
+    struct Chunk {
+        std::unique_ptr<Slot[]> slots;
+        size_t capacity = 0;
+        // slots handed out at least once, the rest were never touched
+        size_t used = 0;
+        size_t live = 0;
+        Slot* free_list = nullptr;
+        // chunks with free slots form a doubly linked list
+        Chunk* prev_available = nullptr;
+        Chunk* next_available = nullptr;
+
+        bool IsFull() const {
+            return free_list == nullptr && used == capacity;
+        }
+    };
+
+    Chunk& AddChunk() {
+        auto slots = std::make_unique<Slot[]>(next_capacity_);
+        const Slot* begin = slots.get();
+        Chunk& chunk = chunks_[begin];
+        chunk.slots = std::move(slots);
+        chunk.capacity = next_capacity_;
+        next_capacity_ = std::min(next_capacity_ * 2, MAX_CHUNK_CAPACITY);
+        Link(chunk);
+        return chunk;
+    }
+
+    void Release(Chunk& chunk) {
+        Unlink(chunk);
+        chunks_.erase(chunk.slots.get());
+    }
+
+    void Link(Chunk& chunk) {
+        chunk.prev_available = nullptr;
+        chunk.next_available = available_;
+        if (available_ != nullptr) available_->prev_available = &chunk;
+        available_ = &chunk;
+    }
+
+    void Unlink(Chunk& chunk) {
+        if (chunk.prev_available != nullptr) {
+            chunk.prev_available->next_available = chunk.next_available;
+        }
+        else {
+            available_ = chunk.next_available;
+        }
+        if (chunk.next_available != nullptr) {
+            chunk.next_available->prev_available = chunk.prev_available;
+        }
+        chunk.prev_available = chunk.next_available = nullptr;
+    }
+
+    // keyed by the first slot, so the owner of a slot is found by upper_bound
+    std::map<const Slot*, Chunk> chunks_;
+    Chunk* available_ = nullptr;
+    Chunk* spare_ = nullptr;
+    size_t next_capacity_ = FIRST_CHUNK_CAPACITY;
+    size_t size_ = 0;
+};
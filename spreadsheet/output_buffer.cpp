@@ -0,0 +1,127 @@
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <system_error>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+OutputBuffer::OutputBuffer(std::ostream& output)
+    : buffer_(new char[CAPACITY]), output_(&output), precision_(static_cast<int>(output.precision())), stream_(this) {
+    setp(buffer_.get(), buffer_.get() + CAPACITY);
+    stream_.exceptions(std::ios::badbit);
+
+    const std::ios_base::fmtflags flags = output.flags();
+    const std::ios_base::fmtflags float_field = flags & std::ios_base::floatfield;
+    if (float_field == std::ios_base::fixed) {
+        number_format_ = std::chars_format::fixed;
+    }
+    else if (float_field == std::ios_base::scientific) {
+        number_format_ = std::chars_format::scientific;
+    }
+    if (float_field == std::ios_base::floatfield
+        || (flags & (std::ios_base::showpos | std::ios_base::showpoint | std::ios_base::uppercase)) != 0
+        || output.getloc() != std::locale::classic()) {
+        number_stream_ = std::make_unique<std::ostream>(this);
+        number_stream_->exceptions(std::ios::badbit);
+        number_stream_->flags(flags);
+        number_stream_->precision(output.precision());
+        number_stream_->imbue(output.getloc());
+    }
+}
+
+OutputBuffer::OutputBuffer(int fd)
+    : buffer_(new char[CAPACITY]), fd_(fd), stream_(this) {
+    setp(buffer_.get(), buffer_.get() + CAPACITY);
+    stream_.exceptions(std::ios::badbit);
+}
+
+void OutputBuffer::WriteLong(std::string_view text) {
+    Flush();
+    if (text.size() > CAPACITY) {
+        WriteOut(text.data(), text.size());
+        return;
+    }
+    std::memcpy(pptr(), text.data(), text.size());
+    pbump(static_cast<int>(text.size()));
+}
+
+void OutputBuffer::WriteRepeated(char c, size_t count) {
+    while (count > 0) {
+        if (pptr() == epptr()) Flush();
+        const size_t size = std::min(count, static_cast<size_t>(epptr() - pptr()));
+        std::memset(pptr(), c, size);
+        pbump(static_cast<int>(size));
+        count -= size;
+    }
+}
+
+void OutputBuffer::WriteNumber(double value) {
+    if (number_stream_ != nullptr) {
+        *number_stream_ << value;
+        return;
+    }
+    char text[128];
+    const auto [end, error] = std::to_chars(text, text + sizeof(text), value, number_format_, precision_);
+    if (error != std::errc()) {
+        // a precision longer than any double needs, or a large fixed number
+        const std::ios_base::fmtflags flags = stream_.flags();
+        if (number_format_ == std::chars_format::fixed) stream_.setf(std::ios_base::fixed, std::ios_base::floatfield);
+        if (number_format_ == std::chars_format::scientific) stream_.setf(std::ios_base::scientific, std::ios_base::floatfield);
+        stream_.precision(precision_);
+        stream_ << value;
+        stream_.flags(flags);
+        return;
+    }
+    Write(std::string_view(text, end - text));
+}
+
+void OutputBuffer::Flush() {
+    WriteOut(pbase(), pptr() - pbase());
+    setp(buffer_.get(), buffer_.get() + CAPACITY);
+}
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type c) {
+    Flush();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        Write(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize OutputBuffer::xsputn(const char* data, std::streamsize size) {
+    Write(std::string_view(data, size));
+    return size;
+}
+
+int OutputBuffer::sync() {
+    Flush();
+    return 0;
+}
+
+void OutputBuffer::WriteOut(const char* data, size_t size) {
+    if (output_ != nullptr) {
+        // as before, a failed stream only records the failure in its state
+        output_->write(data, size);
+        return;
+    }
+    while (size > 0) {
+#ifdef _WIN32
+        const int written = _write(fd_, data, static_cast<unsigned>(std::min<size_t>(size, 1 << 30)));
+#else
+        const ssize_t written = write(fd_, data, size);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category());
+        }
+        data += written;
+        size -= written;
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+
+// Collects output in a large buffer and hands it over in big chunks, either
+// to a stream or straight to a file descriptor. Numbers are formatted with
+// std::to_chars. The buffer is also a stream buffer, so code printing to a
+// std::ostream (e.g. formula expressions) writes into it through Stream().
+//
+// Flush must be called once the output is complete; the destructor does not
+// flush, so that a failed write to a file descriptor is always reported.
+class OutputBuffer : public std::streambuf {
+public:
+    static constexpr size_t CAPACITY = 1 << 18;
+
+    // numbers are written as the stream writes them, but its width is not
+    // applied
+    explicit OutputBuffer(std::ostream& output);
+    // throws std::system_error if writing to fd fails
+    explicit OutputBuffer(int fd);
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    void Write(char c) {
+        if (pptr() == epptr()) Flush();
+        *pptr() = c;
+        pbump(1);
+    }
+
+    void Write(std::string_view text) {
+        if (text.size() <= static_cast<size_t>(epptr() - pptr())) {
+            std::memcpy(pptr(), text.data(), text.size());
+            pbump(static_cast<int>(text.size()));
+        }
+        else {
+            WriteLong(text);
+        }
+    }
+
+    void WriteRepeated(char c, size_t count);
+
+    // as std::ostream writes it, with default flags for a file descriptor
+    void WriteNumber(double value);
+
+    void Flush();
+
+    std::ostream& Stream() {
+        return stream_;
+    }
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* data, std::streamsize size) override;
+    int sync() override;
+
+private:
+    // Write for a text that does not fit in the rest of the buffer
+    void WriteLong(std::string_view text);
+    void WriteOut(const char* data, size_t size);
+
+    // not zeroed, only the part up to pptr() is ever read
+    std::unique_ptr<char[]> buffer_;
+    std::ostream* output_ = nullptr;
+    int fd_ = -1;
+    int precision_ = 6;
+    std::chars_format number_format_ = std::chars_format::general;
+    // writes numbers to the buffer with the flags and locale of output_
+    // when std::to_chars cannot (showpos, hexfloat, another locale...)
+    std::unique_ptr<std::ostream> number_stream_;
+    std::ostream stream_;
+};
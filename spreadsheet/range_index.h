@@ -0,0 +1,149 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Values attached to ranges of cells, found by any position the ranges hold.
+// A two-level segment tree over the fixed bounds of the sheet: the columns
+// of a range are split into at most 2 * LEVELS aligned power-of-two spans,
+// the rows of each of those likewise, and the value is stored once per pair
+// of spans. The spans holding a position are the ancestors of its leaf, so a
+// lookup costs O(LEVELS^2 + k) however large or overlapping the ranges are,
+// and a range takes O(LEVELS^2) entries instead of one per cell; a window of
+// h rows in one column takes at most 2 * log2(h) of them.
+//
+// Every entry knows its slot in the ranges it was stored for and they know
+// theirs, so that a range is erased in O(LEVELS^2) too.
+template <typename T>
+class RangeIndex {
+public:
+    // returns the handle Erase takes
+    std::uint32_t Insert(const Range& range, T value) {
+        if (columns_.empty()) {
+            columns_.resize(2 * LEAVES);
+        }
+        std::uint32_t handle;
+        if (free_handles_.empty()) {
+            handle = static_cast<std::uint32_t>(records_.size());
+            records_.emplace_back();
+        }
+        else {
+            handle = free_handles_.back();
+            free_handles_.pop_back();
+        }
+        Record& record = records_[handle];
+        record.range = range;
+        ForEachSpan(range.first.col, range.last.col, [&](std::uint32_t col_node) {
+            std::unique_ptr<Rows>& rows = columns_[col_node];
+            if (rows == nullptr) {
+                rows = std::make_unique<Rows>();
+            }
+            ForEachSpan(range.first.row, range.last.row, [&](std::uint32_t row_node) {
+                std::vector<Entry>& entries = (*rows)[row_node];
+                const auto span = static_cast<std::uint32_t>(record.slots.size());
+                record.slots.push_back(static_cast<std::uint32_t>(entries.size()));
+                entries.push_back({ value, handle, span });
+            });
+        });
+        ++size_;
+        return handle;
+    }
+
+    // handle was returned by Insert and not erased yet
+    void Erase(std::uint32_t handle) {
+        Record& record = records_[handle];
+        std::uint32_t span = 0;
+        ForEachSpan(record.range.first.col, record.range.last.col, [&](std::uint32_t col_node) {
+            std::unique_ptr<Rows>& rows = columns_[col_node];
+            ForEachSpan(record.range.first.row, record.range.last.row, [&](std::uint32_t row_node) {
+                auto it = rows->find(row_node);
+                std::vector<Entry>& entries = it->second;
+                const std::uint32_t slot = record.slots[span++];
+                const Entry last = entries.back();
+                entries[slot] = last;
+                records_[last.handle].slots[last.span] = slot;
+                entries.pop_back();
+                if (entries.empty()) {
+                    rows->erase(it);
+                }
+            });
+            if (rows->empty()) {
+                rows.reset();
+            }
+        });
+        record.slots.clear();
+        free_handles_.push_back(handle);
+        --size_;
+    }
+
+    // number of ranges
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // appends the value of every range holding pos, once per range
+    void Find(Position pos, std::vector<T>& out) const {
+        if (columns_.empty()) return;
+        for (std::uint32_t col_node = pos.col + LEAVES; col_node > 0; col_node /= 2) {
+            const Rows* rows = columns_[col_node].get();
+            if (rows == nullptr) continue;
+            for (std::uint32_t row_node = pos.row + LEAVES; row_node > 0; row_node /= 2) {
+                auto it = rows->find(row_node);
+                if (it == rows->end()) continue;
+                for (const Entry& entry : it->second) {
+                    out.push_back(entry.value);
+                }
+            }
+        }
+    }
+
+private:
+    // the nodes of a tree over [0, LEAVES) are numbered as in a binary
+    // heap: the root is 1, the children of n are 2n and 2n + 1 and the
+    // leaf of x is LEAVES + x
+    static constexpr int LEVELS = 14;
+    static constexpr std::uint32_t LEAVES = 1u << LEVELS;
+    static_assert(Position::MAX_ROWS <= static_cast<int>(LEAVES) && Position::MAX_COLS <= static_cast<int>(LEAVES));
+
+    struct Entry {
+        T value;
+        std::uint32_t handle;
+        // the entry is records_[handle].slots[span]
+        std::uint32_t span;
+    };
+
+    struct Record {
+        Range range;
+        // the slots of the entries of the range in the order of ForEachSpan
+        std::vector<std::uint32_t> slots;
+    };
+
+    // row node -> values
+    using Rows = std::unordered_map<std::uint32_t, std::vector<Entry>>;
+
+    // calls f with the nodes whose spans make up [first, last], bottom up
+    template <typename F>
+    static void ForEachSpan(int first, int last, F f) {
+        std::uint32_t lower = first + LEAVES;
+        std::uint32_t upper = last + LEAVES + 1;
+        while (lower < upper) {
+            if (lower % 2 == 1) f(lower++);
+            if (upper % 2 == 1) f(--upper);
+            lower /= 2;
+            upper /= 2;
+        }
+    }
+
+    // column node -> rows, allocated while the node holds a value; the
+    // vector itself is allocated with the first range
+    std::vector<std::unique_ptr<Rows>> columns_;
+    // by handle, those of erased ranges are reused
+    std::vector<Record> records_;
+    std::vector<std::uint32_t> free_handles_;
+    size_t size_ = 0;
+};
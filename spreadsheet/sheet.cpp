@@ -6,130 +6,520 @@
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <set>
 
 using namespace std::literals;
 
+Sheet::~Sheet() {
+    for (auto& [key, tile] : tiles_) {
+        for (Cell* cell : tile->cells) {
+            if (cell != nullptr) cell_pool_.Destroy(cell);
+        }
+    }
+}
+
+std::uint32_t Sheet::TileKey(int tile_row, int tile_col) {
+    return static_cast<std::uint32_t>(tile_row) * (Position::MAX_COLS / TILE_SIZE) + tile_col;
+}
+
+int Sheet::TileIndex(Position pos) {
+    return (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+}
+
+Cell* Sheet::FindCell(Position pos) const {
+    auto it = tiles_.find(TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE));
+    if (it == tiles_.end()) return nullptr;
+    return it->second->cells[TileIndex(pos)];
+}
+
+Cell& Sheet::MakeCell(Position pos) {
+    auto& tile = tiles_[TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE)];
+    if (tile == nullptr) {
+        tile = std::make_unique<Tile>();
+    }
+    return MakeCell(*tile, pos);
+}
+
+Cell& Sheet::MakeCell(Tile& tile, Position pos) {
+    Cell*& cell = tile.cells[TileIndex(pos)];
+    if (cell == nullptr) {
+        cell = cell_pool_.Create(TakeHighestOrder());
+        ++tile.cell_count;
+        number_columns_.Reserve(pos);
+        if (created_cells_ != nullptr) created_cells_->push_back(pos);
+    }
+    return *cell;
+}
+
+void Sheet::RemoveCell(Position pos) {
+    auto it = tiles_.find(TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE));
+    Tile& tile = *it->second;
+    Cell*& cell = tile.cells[TileIndex(pos)];
+    dirty_cells_.erase(cell);
+    cell_pool_.Destroy(cell);
+    cell = nullptr;
+    number_columns_.StoreBlank(pos);
+    number_columns_.Release(pos);
+    if (--tile.cell_count == 0) {
+        tiles_.erase(it);
+    }
+}
+
+void Sheet::UpdatePrintable(Position pos) {
+    auto it = tiles_.find(TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE));
+    if (it == tiles_.end()) return;
+    Tile& tile = *it->second;
+    const int index = TileIndex(pos);
+    const bool printable = tile.cells[index] != nullptr && !tile.cells[index]->IsEmpty();
+    std::uint16_t& row_bits = tile.printable[pos.row % TILE_SIZE];
+    const std::uint16_t bit = 1u << (pos.col % TILE_SIZE);
+    if (((row_bits & bit) != 0) == printable) return;
+
+    row_bits ^= bit;
+    if (printable) {
+        ++printable_rows_[pos.row];
+        ++printable_cols_[pos.col];
+    }
+    else {
+        if (--printable_rows_[pos.row] == 0) printable_rows_.erase(pos.row);
+        if (--printable_cols_[pos.col] == 0) printable_cols_.erase(pos.col);
+    }
+}
+
+void Sheet::UpdateNumber(Position pos) {
+    const Cell* cell = FindCell(pos);
+    const std::optional<FormulaInterface::Value> value = cell != nullptr ? cell->GetCachedNumber() : std::nullopt;
+    if (value) {
+        StoreFormulaValue(pos, *value);
+    }
+    else if (cell != nullptr && cell->NeedsEvaluation()) {
+        number_columns_.StorePending(pos);
+    }
+    else {
+        number_columns_.StoreBlank(pos);
+    }
+}
+
+void Sheet::StoreFormulaValue(Position pos, const FormulaInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        number_columns_.StoreNumber(pos, *number);
+    }
+    else {
+        number_columns_.StoreError(pos, std::get<FormulaError>(value));
+    }
+}
+
+RangeSummary Sheet::SummarizeRange(Position first, Position last) const {
+    return number_columns_.Summarize(first, last);
+}
+
+std::uint32_t Sheet::AddRangeDependent(const Range& range, Cell* cell) {
+    const std::uint32_t handle = range_dependents_.Insert(range, cell);
+    std::vector<int> opened;
+    number_columns_.AddReader(range.first.col, range.last.col, opened);
+    if (opened.empty()) return handle;
+
+    // the columns no range read before get the values of their cells, found
+    // tile column by tile column
+    std::vector<Position> positions;
+    for (size_t i = 0; i < opened.size();) {
+        const int tile_col = opened[i] / TILE_SIZE;
+        size_t end = i;
+        while (end < opened.size() && opened[end] / TILE_SIZE == tile_col) ++end;
+        for (int tile_row = 0; tile_row < Position::MAX_ROWS / TILE_SIZE; ++tile_row) {
+            auto it = tiles_.find(TileKey(tile_row, tile_col));
+            if (it == tiles_.end()) continue;
+            for (size_t m = i; m < end; ++m) {
+                for (int row = tile_row * TILE_SIZE; row < (tile_row + 1) * TILE_SIZE; ++row) {
+                    const Position pos{ row, opened[m] };
+                    if (it->second->cells[TileIndex(pos)] != nullptr) positions.push_back(pos);
+                }
+            }
+        }
+        i = end;
+    }
+    for (Position pos : positions) {
+        number_columns_.Reserve(pos);
+        UpdateNumber(pos);
+    }
+    return handle;
+}
+
+void Sheet::RemoveRangeDependent(const Range& range, std::uint32_t handle) {
+    range_dependents_.Erase(handle);
+    number_columns_.RemoveReader(range.first.col, range.last.col);
+}
+
+bool Sheet::HasRangeDependents() const {
+    return range_dependents_.GetSize() > 0;
+}
+
+void Sheet::FindRangeDependents(Position pos, std::vector<Cell*>& out) const {
+    range_dependents_.Find(pos, out);
+}
+
+void Sheet::FindCells(const Range& range, std::vector<Cell*>& out) const {
+    for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+        for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col) {
+            auto it = tiles_.find(TileKey(tile_row, tile_col));
+            if (it == tiles_.end()) continue;
+            const int first_row = std::max(range.first.row, tile_row * TILE_SIZE);
+            const int last_row = std::min(range.last.row, tile_row * TILE_SIZE + TILE_SIZE - 1);
+            const int first_col = std::max(range.first.col, tile_col * TILE_SIZE);
+            const int last_col = std::min(range.last.col, tile_col * TILE_SIZE + TILE_SIZE - 1);
+            for (int row = first_row; row <= last_row; ++row) {
+                for (int col = first_col; col <= last_col; ++col) {
+                    if (Cell* cell = it->second->cells[TileIndex({ row, col })]) out.push_back(cell);
+                }
+            }
+        }
+    }
+}
+
+void Sheet::FindPendingCells(const Range& range, std::vector<const Cell*>& out) const {
+    std::vector<Position> pending;
+    number_columns_.FindPending(range.first, range.last, pending);
+    for (Position pos : pending) {
+        out.push_back(FindCell(pos));
+    }
+}
+
 bool Sheet::IsValid(Position pos) const {
-    return sheet_.size() > size_t(pos.row) && sheet_[pos.row].size() > size_t(pos.col);
+    return FindCell(pos) != nullptr;
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("");
     }
-   
-    if (pos.row + 1 > sheet_size_.rows) {
-        if (sheet_.size() < size_t(pos.row + 1)) sheet_.resize(pos.row + 1);
-        if (sheet_[pos.row].size() < size_t(pos.col + 1)) sheet_[pos.row].resize(pos.col + 1);
+    SheetStats::Timer timer(stats_, SheetStats::Operation::SetCell);
+
+    const bool is_new = !IsValid(pos);
+    Cell& cell = MakeCell(pos);
+    try {
+        cell.Set(*this, pos, text);
     }
-    if (sheet_[pos.row].size() < size_t(pos.col + 1)) {
-        sheet_[pos.row].resize(std::max(pos.col + 1, sheet_size_.cols));
+    catch (...) {
+        if (is_new && !cell.IsReferenced()) RemoveCell(pos);
+        throw;
     }
+    UpdatePrintable(pos);
+    UpdateNumber(pos);
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    SetCells(std::move(cells), {});
+}
 
-    if (sheet_[pos.row][pos.col] == nullptr) {
-        sheet_[pos.row][pos.col] = std::make_unique<Cell>(this);
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells,
+                     std::vector<std::unique_ptr<FormulaInterface>> formulas) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("");
+        }
+    }
+    formulas.resize(cells.size());
+    std::vector<Cell::Update> updates;
+    updates.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        updates.push_back({ nullptr, cells[i].first, std::move(cells[i].second), std::move(formulas[i]) });
+    }
+    // keeps the last text of every position, in the order given; cells
+    // given in increasing order, e.g. read row by row, repeat none
+    const bool is_increasing = std::adjacent_find(updates.begin(), updates.end(), [](const auto& lhs, const auto& rhs) {
+                                   return !(lhs.pos < rhs.pos);
+                               }) == updates.end();
+    if (!is_increasing) {
+        std::reverse(updates.begin(), updates.end());
+        std::set<Position> seen;
+        updates.erase(std::remove_if(updates.begin(), updates.end(), [&seen](const auto& update) {
+                          return !seen.insert(update.pos).second;
+                      }),
+                      updates.end());
+        std::reverse(updates.begin(), updates.end());
+    }
+
+    std::vector<Position> created;
+    created_cells_ = &created;
+    try {
+        for (Cell::Update& update : updates) {
+            update.cell = &MakeCell(update.pos);
+        }
+        Cell::SetAll(*this, updates);
+    }
+    catch (...) {
+        created_cells_ = nullptr;
+        for (Position pos : created) {
+            Cell* cell = FindCell(pos);
+            if (cell != nullptr && cell->IsEmpty() && !cell->IsReferenced()) RemoveCell(pos);
+        }
+        throw;
+    }
+    created_cells_ = nullptr;
+    for (const Cell::Update& update : updates) {
+        UpdatePrintable(update.pos);
+        UpdateNumber(update.pos);
+    }
+}
+
+void Sheet::RemoveEmptyCells(const std::vector<Position>& positions) {
+    for (Position pos : positions) {
+        Cell* cell = FindCell(pos);
+        if (cell != nullptr && cell->IsEmpty() && !cell->IsReferenced()) {
+            RemoveCell(pos);
+        }
     }
-    sheet_[pos.row][pos.col]->Set(text);
-    sheet_size_.rows = std::max(sheet_size_.rows, pos.row + 1);
-    sheet_size_.cols = std::max(sheet_size_.cols, pos.col + 1);
 }
 
 void Sheet::SetEmptyCell(Position pos) {
     if (!pos.IsValid()) throw InvalidPositionException("");
-    if (size_t(pos.row) + 1 > sheet_.size()) sheet_.resize(pos.row + 1);
-    if (sheet_[pos.row].size() < size_t(pos.col + 1)) {
-        sheet_[pos.row].resize(pos.col + 1);
-        sheet_[pos.row][pos.col] = std::make_unique<Cell>(this);
-        sheet_[pos.row][pos.col]->Set("");      
+    if constexpr (SheetStats::ENABLED) {
+        if (FindCell(pos) == nullptr) stats_.Add(SheetStats::Counter::CellsMaterialized);
     }
+    MakeCell(pos);
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("");
     }
-    if (!IsValid(pos)) return nullptr;
-        Cell* value = sheet_[pos.row][pos.col].get();
-        return value;
+    return FindCell(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("");
     }
-    if (!IsValid(pos)) return nullptr;
-    Cell* value = sheet_[pos.row][pos.col].get();
-    return value;
+    return FindCell(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("");
     }
-    if (IsValid(pos) && sheet_[pos.row][pos.col] != nullptr) {
-        sheet_[pos.row][pos.col]->Clear();
-        if (sheet_[pos.row][pos.col]->IsReferenced()) return;
-        sheet_[pos.row][pos.col].release();
-        if (sheet_size_.rows == pos.row + 1) {
-            if (sheet_size_.rows == 1) {
-                sheet_size_.rows = 0;
-            }
-            for (int i = sheet_size_.rows - 2; i >= 0; --i) {
-                if (find_if(sheet_[i].begin(), sheet_[i].end(), [](const auto& el) { return el.get() != nullptr; }) != sheet_[i].end()) {
-                    sheet_size_.rows = i+1;
-                    break;
-                }
+    SheetStats::Timer timer(stats_, SheetStats::Operation::ClearCell);
+    Cell* cell = FindCell(pos);
+    if (cell == nullptr) return;
+    cell->Clear(*this, pos);
+    UpdatePrintable(pos);
+    UpdateNumber(pos);
+    if (!cell->IsReferenced()) {
+        RemoveCell(pos);
+    }
+}
+
+size_t Sheet::GetEvaluationCount() const {
+    return evaluation_count_;
+}
+
+void Sheet::CountEvaluation() {
+    evaluation_count_.fetch_add(1, std::memory_order_relaxed);
+    if constexpr (SheetStats::ENABLED) {
+        stats_.Add(SheetStats::Counter::Evaluations);
+    }
+}
+
+std::mutex& Sheet::GetEvaluationMutex() const {
+    return evaluation_mutex_;
+}
+
+SheetStats& Sheet::GetStats() const {
+    return stats_;
+}
+
+void Sheet::Recalculate() {
+    const auto started = EvaluationProfiler::Clock::now();
+    if (evaluation_pool_ != nullptr) {
+        std::vector<Cell*> cells;
+        for (Cell* cell : dirty_cells_) {
+            if (cell->NeedsEvaluation()) {
+                cells.push_back(cell);
             }
         }
-        if (sheet_size_.cols == pos.col + 1) {
-            size_t max_col = 0;
-            for (int i = 0; i < sheet_size_.rows; ++i) {
-                for (size_t m = sheet_[i].size() - 1; int(m) >= 0; --m) {
-                    if (sheet_[i][m] != nullptr && m + 1 > max_col) {
-                        max_col = m + 1;
-                        continue;
-                    }
-                }
+        Cell::EvaluateParallel(cells, *evaluation_pool_);
+    }
+    else {
+        for (Cell* cell : dirty_cells_) {
+            if (cell->NeedsEvaluation()) {
+                cell->GetNumber();
             }
-            sheet_size_.cols = max_col;
-        }               
-    }    
+        }
+    }
+    dirty_cells_.clear();
+    if (profiler_ != nullptr) {
+        profiler_->RecordRecalculation(started, EvaluationProfiler::Clock::now());
+    }
+}
+
+void Sheet::SetThreadCount(size_t thread_count) {
+    if (thread_count == GetThreadCount()) return;
+    evaluation_pool_.reset();
+    if (thread_count > 1) {
+        evaluation_pool_ = std::make_unique<WorkStealingPool<std::uint32_t>>(thread_count);
+    }
+}
+
+size_t Sheet::GetThreadCount() const {
+    return evaluation_pool_ != nullptr ? evaluation_pool_->GetThreadCount() : 1;
+}
+
+void Sheet::SetProfiler(EvaluationProfiler* profiler) {
+    profiler_ = profiler;
+}
+
+EvaluationProfiler* Sheet::GetProfiler() const {
+    return profiler_;
+}
+
+void Sheet::MarkDirty(Cell* cell, Position pos) {
+    dirty_cells_.insert(cell);
+    number_columns_.StorePending(pos);
+}
+
+std::uint32_t Sheet::TakeLowestOrder() {
+    if (lowest_cell_order_ == 0) {
+        RenumberOrders();
+    }
+    return --lowest_cell_order_;
+}
+
+std::uint32_t Sheet::TakeHighestOrder() {
+    if (next_cell_order_ == std::numeric_limits<std::uint32_t>::max()) {
+        RenumberOrders();
+    }
+    return next_cell_order_++;
+}
+
+void Sheet::RenumberOrders() {
+    std::vector<Cell*> cells;
+    for (const auto& [key, tile] : tiles_) {
+        for (Cell* cell : tile->cells) {
+            if (cell != nullptr) cells.push_back(cell);
+        }
+    }
+    lowest_cell_order_ = (1u << 31) - static_cast<std::uint32_t>(cells.size() / 2);
+    next_cell_order_ = lowest_cell_order_ + static_cast<std::uint32_t>(cells.size());
+    Cell::RenumberOrders(cells, lowest_cell_order_);
+}
+
+FormulaTemplateCache& Sheet::GetFormulaTemplates() {
+    return formula_templates_;
+}
+
+std::vector<std::unique_ptr<FormulaInterface>> Sheet::ParseFormulas(
+    const std::vector<std::pair<std::string_view, Position>>& expressions) {
+    return formula_templates_.ParseAll(expressions, evaluation_pool_.get());
+}
+
+Sheet::StorageStats Sheet::GetStorageStats() const {
+    StorageStats result;
+    result.tiles = tiles_.size();
+    result.cells = cell_pool_.GetSize();
+    result.cell_chunks = cell_pool_.GetChunkCount();
+    result.cell_capacity = cell_pool_.GetCapacity();
+    result.number_bytes = number_columns_.GetMemoryUsage();
+    return result;
 }
 
 Size Sheet::GetPrintableSize() const {
-    return sheet_size_;
+    if (printable_rows_.empty()) return {};
+    return { printable_rows_.rbegin()->first + 1, printable_cols_.rbegin()->first + 1 };
 }
 
+std::vector<const Sheet::Tile*> Sheet::GetTileRow(int tile_row, int tile_cols) const {
+    std::vector<const Tile*> result(tile_cols, nullptr);
+    for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+        auto it = tiles_.find(TileKey(tile_row, tile_col));
+        if (it != tiles_.end()) result[tile_col] = it->second.get();
+    }
+    return result;
+}
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for (int i = 0; i < sheet_size_.rows; ++i) {
-        for (int m = 0; m < sheet_size_.cols; ++m) {
-           if (size_t(m) < sheet_[i].size() && sheet_[i][m] != nullptr) {
-               std::visit(
-                   [&](const auto& x) {
-                       output << x;
-                   },
-                   sheet_[i][m]->GetValue());
+template <typename CellPrinter>
+void Sheet::PrintCells(OutputBuffer& output, char delimiter, CellPrinter print) const {
+    const Size size = GetPrintableSize();
+    const int tile_cols = (size.cols + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<const Tile*> tiles;
+    std::vector<int> tile_indexes;
+    for (int tile_row = 0; tile_row * TILE_SIZE < size.rows; ++tile_row) {
+        const std::vector<const Tile*> tile_row_tiles = GetTileRow(tile_row, tile_cols);
+        tiles.clear();
+        tile_indexes.clear();
+        for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+            if (tile_row_tiles[tile_col] == nullptr) continue;
+            tiles.push_back(tile_row_tiles[tile_col]);
+            tile_indexes.push_back(tile_col);
+        }
+        const int last_row = std::min(size.rows, (tile_row + 1) * TILE_SIZE);
+        for (int row = tile_row * TILE_SIZE; row < last_row; ++row) {
+            // the tabs written so far in this row
+            int col = 0;
+            for (size_t i = 0; i < tiles.size(); ++i) {
+                unsigned row_bits = tiles[i]->printable[row % TILE_SIZE];
+                while (row_bits != 0) {
+                    int tile_col = 0;
+                    while ((row_bits & (1u << tile_col)) == 0) ++tile_col;
+                    row_bits &= row_bits - 1;
+                    const int cell_col = tile_indexes[i] * TILE_SIZE + tile_col;
+                    output.WriteRepeated(delimiter, cell_col - col);
+                    col = cell_col;
+                    print(*tiles[i]->cells[TileIndex({ row, cell_col })]);
+                }
             }
-            if (m != sheet_size_.cols - 1) output << "\t";
+            output.WriteRepeated(delimiter, size.cols - 1 - col);
+            output.Write('\n');
         }
-        output << "\n";
     }
+    output.Flush();
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    OutputBuffer buffer(output);
+    PrintCells(buffer, '\t', [&buffer](const Cell& cell) {
+        cell.PrintValue(buffer);
+    });
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    for (int i = 0; i < sheet_size_.rows; ++i) {
-        for (int m = 0; m < sheet_size_.cols; ++m) {
-            if (size_t(m) < sheet_[i].size() && sheet_[i][m] != nullptr) {
-                output << sheet_[i][m]->GetText();
-            }
-            if(m != sheet_size_.cols - 1) output << "\t";
+    OutputBuffer buffer(output);
+    PrintCells(buffer, '\t', [&buffer](const Cell& cell) {
+        cell.PrintText(buffer);
+    });
+}
+
+void Sheet::PrintValues(int fd) const {
+    OutputBuffer buffer(fd);
+    PrintCells(buffer, '\t', [&buffer](const Cell& cell) {
+        cell.PrintValue(buffer);
+    });
+}
+
+void Sheet::PrintTexts(int fd) const {
+    OutputBuffer buffer(fd);
+    PrintCells(buffer, '\t', [&buffer](const Cell& cell) {
+        cell.PrintText(buffer);
+    });
+}
+
+void Sheet::PrintTextsCsv(std::ostream& output) const {
+    OutputBuffer buffer(output);
+    PrintCells(buffer, ',', [&buffer](const Cell& cell) {
+        const std::string text = cell.GetText();
+        if (text.find_first_of(",\"\r\n") == std::string::npos) {
+            buffer.Write(text);
+            return;
         }
-       output << "\n";
-    }
+        buffer.Write('"');
+        for (char c : text) {
+            if (c == '"') buffer.Write('"');
+            buffer.Write(c);
+        }
+        buffer.Write('"');
+    });
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
-}
\ No newline at end of file
+}
@@ -2,20 +2,58 @@
 
 
 #include "common.h"
+#include "evaluation_profiler.h"
+#include "formula.h"
+#include "number_columns.h"
+#include "object_pool.h"
+#include "output_buffer.h"
+#include "range_index.h"
+#include "sheet_stats.h"
+#include "work_stealing_pool.h"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <functional>
-#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 class Cell;
 
+// Reads may run on any number of threads at once: the const methods, those
+// of the cells GetCell returns and saving a snapshot. The first reader of a
+// formula without a value computes it under a lock, later readers find the
+// value published and do not lock; after Recalculate no reader locks at
+// all. Changing the sheet (SetCell, ClearCell, Recalculate, ...) needs
+// exclusive access, without readers.
 class Sheet : public SheetInterface {
 public:
     Sheet() = default;
 
-    ~Sheet() = default;
+    ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
 
+    // sets all the cells as one change, a later text for the same position
+    // replaces an earlier one; cycles are checked and dependents invalidated
+    // once for the whole batch, and if any text is rejected the sheet is left
+    // as it was
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // the same, formulas[i] being the parsed formula of the text of cells[i]
+    // if it is not nullptr, e.g. one kept from when the sheet last had
+    // that text; the formulas are taken instead of parsing the texts
+    void SetCells(std::vector<std::pair<Position, std::string>> cells,
+                  std::vector<std::unique_ptr<FormulaInterface>> formulas);
+
+    // removes the cells at positions that are empty and referenced by no
+    // formula, as ClearCell does; e.g. after SetCells gave them empty texts
+    void RemoveEmptyCells(const std::vector<Position>& positions);
+
     void SetEmptyCell(Position pos);
 
     const CellInterface* GetCell(Position pos) const override;
@@ -30,10 +68,171 @@ public:
     
     void PrintTexts(std::ostream& output) const override;
 
+    // the same written straight to a file descriptor, e.g. of a file or a
+    // pipe; throws std::system_error if writing fails
+    void PrintValues(int fd) const;
+
+    void PrintTexts(int fd) const;
+
+    // the texts as a CSV table that TableImporter reads back as this sheet;
+    // unlike PrintTexts, a text holding a comma, a quote or a line break is
+    // quoted
+    void PrintTextsCsv(std::ostream& output) const;
+
+    // true if a cell object exists at pos (it may be empty)
     bool IsValid(Position pos) const;
 
+    // number of cell values actually computed (cache misses)
+    size_t GetEvaluationCount() const;
+
+    // counters and latencies of the engine, recorded on const reads too;
+    // see SheetStats for how they are turned on
+    SheetStats& GetStats() const;
+
+    void CountEvaluation();
+
+    // held by the reader computing formula values, see Cell::Evaluate
+    std::mutex& GetEvaluationMutex() const;
+
+    // evaluates every formula invalidated since the last recalculation,
+    // each at most once and dependencies first; values are otherwise
+    // computed lazily on read
+    void Recalculate();
+
+    // number of threads used by Recalculate, 1 (the default) evaluates on
+    // the calling thread only; the results do not depend on it
+    void SetThreadCount(size_t thread_count);
+
+    size_t GetThreadCount() const;
+
+    // records the evaluations of formulas and the recalculations into
+    // profiler while it is set, nullptr (the default) stops it; the sheet
+    // does not own it and must not evaluate while it changes
+    void SetProfiler(EvaluationProfiler* profiler);
+
+    EvaluationProfiler* GetProfiler() const;
+
+    // called by the formula cell at pos whose value has to be recomputed
+    void MarkDirty(Cell* cell, Position pos);
+
+    // called by a formula cell at pos once its value is computed, may be
+    // called from several threads at once for different cells
+    void StoreFormulaValue(Position pos, const FormulaInterface::Value& value);
+
+    // the numbers of the cells from first to last as aggregate functions
+    // see them; the formulas among the cells must be evaluated
+    RangeSummary SummarizeRange(Position first, Position last) const;
+
+    // a formula cell reading the range, it depends on every cell of it
+    // without being their parent; returns the handle the range is removed by
+    std::uint32_t AddRangeDependent(const Range& range, Cell* cell);
+    void RemoveRangeDependent(const Range& range, std::uint32_t handle);
+
+    // true if any formula reads a range
+    bool HasRangeDependents() const;
+
+    // appends the formulas reading a range that holds pos, once per range
+    void FindRangeDependents(Position pos, std::vector<Cell*>& out) const;
+
+    // appends the existing cells of the range
+    void FindCells(const Range& range, std::vector<Cell*>& out) const;
+
+    // appends the formula cells of the range whose value is not computed yet
+    void FindPendingCells(const Range& range, std::vector<const Cell*>& out) const;
+
+    // an order below every order handed out so far; may renumber the
+    // orders of all cells, see RenumberOrders
+    std::uint32_t TakeLowestOrder();
+    // an order above every order handed out so far; may renumber as well
+    std::uint32_t TakeHighestOrder();
+
+    struct StorageStats {
+        size_t tiles = 0;
+        size_t cells = 0;
+        size_t cell_chunks = 0;
+        size_t cell_capacity = 0;
+        // the numeric copy of the columns ranges read
+        size_t number_bytes = 0;
+    };
+
+    FormulaTemplateCache& GetFormulaTemplates();
+
+    // FormulaTemplateCache::ParseAll on the threads used by Recalculate
+    std::vector<std::unique_ptr<FormulaInterface>> ParseFormulas(
+        const std::vector<std::pair<std::string_view, Position>>& expressions);
+
+    // memory accounting of the cell storage
+    StorageStats GetStorageStats() const;
+
+    static const int TILE_SIZE = 16;
+    static_assert(TILE_SIZE <= 16);
+
 private:
-    mutable std::vector<std::vector<std::unique_ptr<Cell>>> sheet_;
-    Size sheet_size_;
+    // cells live in fixed-size square tiles; only tiles holding
+    // at least one cell are allocated
+    struct Tile {
+        // owned by cell_pool_
+        std::array<Cell*, TILE_SIZE * TILE_SIZE> cells{};
+        // cells with non-empty text, they make up the printable area:
+        // bit c of printable[r] stands for row r and column c of the tile
+        std::array<std::uint16_t, TILE_SIZE> printable{};
+        int cell_count = 0;
+    };
+
+    static std::uint32_t TileKey(int tile_row, int tile_col);
+
+    static int TileIndex(Position pos);
+
+    Cell* FindCell(Position pos) const;
+
+    Cell& MakeCell(Position pos);
+    // the tile must be the one of pos
+    Cell& MakeCell(Tile& tile, Position pos);
+
+    void RemoveCell(Position pos);
+
+    // gives the cells consecutive orders around the middle of the range,
+    // in the same relative order, once one end of the range is used up:
+    // orders are only ever taken beyond the ends, never given back
+    void RenumberOrders();
+
+    void UpdatePrintable(Position pos);
+
+    // stores the value of the cell at pos in number_columns_
+    void UpdateNumber(Position pos);
+
+    // calls print(cell) for every printable cell in row order, separating
+    // the cells of the printable area with delimiter and rows with new
+    // lines; empty cells are skipped a tile row at a time
+    template <typename CellPrinter>
+    void PrintCells(OutputBuffer& output, char delimiter, CellPrinter print) const;
+
+    // pointers to the tiles of one band of TILE_SIZE rows, nullptr for absent ones
+    std::vector<const Tile*> GetTileRow(int tile_row, int tile_cols) const;
+
+    mutable SheetStats stats_;
+    FormulaTemplateCache formula_templates_{ &stats_ };
+    ObjectPool<Cell> cell_pool_;
+    std::unordered_map<std::uint32_t, std::unique_ptr<Tile>> tiles_;
+    // printable cell count per row and per column
+    std::map<int, int> printable_rows_;
+    std::map<int, int> printable_cols_;
+    NumberColumns number_columns_;
+    RangeIndex<Cell*> range_dependents_;
+    std::unordered_set<Cell*> dirty_cells_;
+    // while set, MakeCell records the cells it creates here
+    std::vector<Position>* created_cells_ = nullptr;
+    // orders grow up from the middle of the range for new cells and down
+    // from it for cells moved below everything else, and go back to the
+    // middle with RenumberOrders when either end is reached
+    std::uint32_t next_cell_order_ = 1u << 31;
+    std::uint32_t lowest_cell_order_ = 1u << 31;
+    std::atomic<size_t> evaluation_count_ = 0;
+    mutable std::mutex evaluation_mutex_;
+    // exists while more than one thread is used
+    std::unique_ptr<WorkStealingPool<std::uint32_t>> evaluation_pool_;
+    EvaluationProfiler* profiler_ = nullptr;
+
+    friend class SheetSnapshot;
 };
 
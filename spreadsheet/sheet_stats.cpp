@@ -0,0 +1,118 @@
+#include "sheet_stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+size_t LatencyHistogram::GetBucket(std::uint64_t nanoseconds) {
+    if (nanoseconds < 4) return nanoseconds;
+    // the power of two and the two bits below its leading one
+    int log = 2;
+    while (log < 63 && nanoseconds >> (log + 1) != 0) ++log;
+    const size_t bucket = (log - 1) * 4 + ((nanoseconds >> (log - 2)) & 3);
+    return std::min(bucket, BUCKETS - 1);
+}
+
+LatencyHistogram::Duration LatencyHistogram::GetBucketLower(size_t bucket) {
+    if (bucket < 4) return Duration(bucket);
+    const int log = static_cast<int>(bucket / 4) + 1;
+    return Duration((4 + bucket % 4) << (log - 2));
+}
+
+void LatencyHistogram::Record(Duration latency) {
+    const std::uint64_t nanoseconds = std::max<std::int64_t>(latency.count(), 0);
+    buckets_[GetBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(nanoseconds, std::memory_order_relaxed);
+    std::uint64_t max = max_.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !max_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+std::uint64_t LatencyHistogram::GetCount() const {
+    return count_.load(std::memory_order_relaxed);
+}
+
+LatencyHistogram::Duration LatencyHistogram::GetTotal() const {
+    return Duration(total_.load(std::memory_order_relaxed));
+}
+
+LatencyHistogram::Duration LatencyHistogram::GetMax() const {
+    return Duration(max_.load(std::memory_order_relaxed));
+}
+
+LatencyHistogram::Duration LatencyHistogram::GetPercentile(double q) const {
+    std::uint64_t total = 0;
+    for (const auto& bucket : buckets_) {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if (total == 0) return Duration(0);
+    const auto rank = static_cast<std::uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * total));
+    std::uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= std::max<std::uint64_t>(rank, 1)) {
+            // the last bucket has no upper bound of its own
+            return i + 1 < BUCKETS ? std::min(GetBucketLower(i + 1), GetMax()) : GetMax();
+        }
+    }
+    return GetMax();
+}
+
+std::uint64_t LatencyHistogram::GetBucketCount(size_t bucket) const {
+    return buckets_[bucket].load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    total_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+std::string_view SheetStats::GetName(Counter counter) {
+    switch (counter) {
+    case Counter::FormulasParsed: return "formulas_parsed";
+    case Counter::Evaluations: return "evaluations";
+    case Counter::CacheHits: return "cache_hits";
+    case Counter::CacheMisses: return "cache_misses";
+    case Counter::Invalidations: return "invalidations";
+    case Counter::CycleCheckVisits: return "cycle_check_visits";
+    case Counter::CellsMaterialized: return "cells_materialized";
+    default: return "";
+    }
+}
+
+std::string_view SheetStats::GetName(Operation operation) {
+    switch (operation) {
+    case Operation::SetCell: return "SetCell";
+    case Operation::GetValue: return "GetValue";
+    case Operation::ClearCell: return "ClearCell";
+    default: return "";
+    }
+}
+
+void SheetStats::Reset() {
+    for (auto& counter : counters_) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (LatencyHistogram& latencies : latencies_) {
+        latencies.Reset();
+    }
+}
+
+void SheetStats::Print(std::ostream& output) const {
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        const auto counter = static_cast<Counter>(i);
+        output << GetName(counter) << ' ' << Get(counter) << '\n';
+    }
+    for (size_t i = 0; i < latencies_.size(); ++i) {
+        const auto operation = static_cast<Operation>(i);
+        const LatencyHistogram& latencies = latencies_[i];
+        output << GetName(operation) << " count " << latencies.GetCount()
+               << " p50 " << latencies.GetPercentile(0.5).count() << " ns"
+               << " p99 " << latencies.GetPercentile(0.99).count() << " ns"
+               << " max " << latencies.GetMax().count() << " ns\n";
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+// Latencies of one kind of operation, counted in buckets four per power of
+// two of nanoseconds, so a percentile is known to within a quarter of its
+// value. Recording is lock-free and may happen on several threads at once.
+class LatencyHistogram {
+public:
+    using Duration = std::chrono::nanoseconds;
+
+    // latencies of 2^40 ns (about 18 minutes) and more share the last bucket
+    static constexpr size_t BUCKETS = 160;
+
+    void Record(Duration latency);
+
+    std::uint64_t GetCount() const;
+    Duration GetTotal() const;
+    Duration GetMax() const;
+
+    // an upper bound of the latency of the fraction q of the operations,
+    // e.g. GetPercentile(0.99); zero if nothing is recorded
+    Duration GetPercentile(double q) const;
+
+    // the number of latencies in [GetBucketLower(i), GetBucketLower(i + 1))
+    std::uint64_t GetBucketCount(size_t bucket) const;
+    static Duration GetBucketLower(size_t bucket);
+
+    void Reset();
+
+private:
+    static size_t GetBucket(std::uint64_t nanoseconds);
+
+    std::array<std::atomic<std::uint64_t>, BUCKETS> buckets_{};
+    std::atomic<std::uint64_t> count_ = 0;
+    std::atomic<std::uint64_t> total_ = 0;
+    std::atomic<std::uint64_t> max_ = 0;
+};
+
+// What the engine of a sheet does: event counters and latency histograms of
+// the sheet operations, read and reset through Sheet::GetStats.
+//
+// Nothing is recorded unless the engine is compiled with SPREADSHEET_STATS
+// defined (the CMake option of the same name). Otherwise ENABLED is false,
+// the recording code is discarded at compile time and everything reads zero.
+class SheetStats {
+public:
+#ifdef SPREADSHEET_STATS
+    static constexpr bool ENABLED = true;
+#else
+    static constexpr bool ENABLED = false;
+#endif
+
+    enum class Counter {
+        // expressions run through the formula parser; formulas sharing a
+        // cached template are not parsed again
+        FormulasParsed,
+        // formula values computed
+        Evaluations,
+        // reads of a formula value, by GetValue or by formulas referencing
+        // it, that found it computed
+        CacheHits,
+        // reads that had to compute it (and the uncomputed values it needs)
+        CacheMisses,
+        // computed values dropped because a cell they depend on changed
+        Invalidations,
+        // cells visited by cycle checks of new references
+        CycleCheckVisits,
+        // empty cells created for references to cells that did not exist
+        CellsMaterialized,
+        COUNT,
+    };
+
+    enum class Operation {
+        SetCell,
+        // reads of formula cells; other cells only return what they hold
+        GetValue,
+        ClearCell,
+        COUNT,
+    };
+
+    static std::string_view GetName(Counter counter);
+    static std::string_view GetName(Operation operation);
+
+    void Add(Counter counter, std::uint64_t count = 1) {
+        counters_[static_cast<size_t>(counter)].fetch_add(count, std::memory_order_relaxed);
+    }
+
+    std::uint64_t Get(Counter counter) const {
+        return counters_[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    }
+
+    const LatencyHistogram& GetLatencies(Operation operation) const {
+        return latencies_[static_cast<size_t>(operation)];
+    }
+
+    void Record(Operation operation, LatencyHistogram::Duration latency) {
+        latencies_[static_cast<size_t>(operation)].Record(latency);
+    }
+
+    // times the operation from construction to destruction, if ENABLED
+    class Timer {
+    public:
+        Timer(SheetStats& stats, Operation operation)
+            : stats_(stats), operation_(operation) {
+            if constexpr (ENABLED) {
+                start_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+            if constexpr (ENABLED) {
+                stats_.Record(operation_, std::chrono::steady_clock::now() - start_);
+            }
+        }
+
+    private:
+        SheetStats& stats_;
+        Operation operation_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // zeroes every counter and histogram; meant for quiet moments, a
+    // concurrent recording may be kept in part
+    void Reset();
+
+    // a line per counter, then the count and percentiles of each operation
+    void Print(std::ostream& output) const;
+
+private:
+    std::array<std::atomic<std::uint64_t>, static_cast<size_t>(Counter::COUNT)> counters_{};
+    std::array<LatencyHistogram, static_cast<size_t>(Operation::COUNT)> latencies_;
+};
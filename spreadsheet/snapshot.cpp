@@ -0,0 +1,542 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <system_error>
+#endif
+
+// The layout, every number in the byte order of the machine:
+//
+//   header     "SHEETSNP", u32 version, u32 0x01020304, u32 template count,
+//              u32 cell count, u32 next cell order, u32 lowest cell order
+//   templates  u32 size + FormulaAST::Serialize, once per shared expression
+//   cells      tile by tile as Sheet stores them, row by row in a tile:
+//              i32 row, i32 col, u32 order, u8 CellKind and its content:
+//     TEXT     u32 size + text
+//     NUMBER   u32 size + text, f64 value
+//     FORMULA  u32 template, i32 row, i32 col of the offset, u8 ValueKind
+//              (+ f64 number or u8 error category), u32 reference count,
+//              u32 cell index per reference in GetReferencedCells order
+namespace {
+    constexpr std::string_view MAGIC = "SHEETSNP";
+    constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    enum class CellKind : std::uint8_t {
+        EMPTY,
+        TEXT,
+        NUMBER,
+        FORMULA,
+    };
+
+    enum class ValueKind : std::uint8_t {
+        NONE,
+        NUMBER,
+        ERROR,
+    };
+
+    class Writer {
+    public:
+        explicit Writer(OutputBuffer& output)
+            : output_(output) {
+        }
+
+        template <typename T>
+        void Write(T value) {
+            output_.Write(std::string_view(reinterpret_cast<const char*>(&value), sizeof(value)));
+        }
+
+        void WritePosition(Position pos) {
+            Write<std::int32_t>(pos.row);
+            Write<std::int32_t>(pos.col);
+        }
+
+        void WriteBytes(std::string_view bytes) {
+            Write(static_cast<std::uint32_t>(bytes.size()));
+            output_.Write(bytes);
+        }
+
+    private:
+        OutputBuffer& output_;
+    };
+
+    class Reader {
+    public:
+        explicit Reader(std::string_view data)
+            : data_(data) {
+        }
+
+        template <typename T>
+        T Read() {
+            T value;
+            std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+            return value;
+        }
+
+        Position ReadPosition() {
+            const int row = Read<std::int32_t>();
+            const int col = Read<std::int32_t>();
+            return { row, col };
+        }
+
+        std::string_view ReadBytes() {
+            return Take(Read<std::uint32_t>());
+        }
+
+        std::string_view Take(size_t size) {
+            if (data_.size() < size) {
+                throw SnapshotError("Truncated snapshot");
+            }
+            const std::string_view result = data_.substr(0, size);
+            data_.remove_prefix(size);
+            return result;
+        }
+
+        size_t GetRemaining() const {
+            return data_.size();
+        }
+
+    private:
+        std::string_view data_;
+    };
+
+    Position Shifted(Position pos, Position offset) {
+        return { pos.row + offset.row, pos.col + offset.col };
+    }
+
+    // a formula cell read in the first pass, its references are linked once
+    // every cell exists
+    struct FormulaRecord {
+        std::uint32_t cell;
+        std::uint32_t formula_template;
+        Position offset;
+        std::optional<FormulaInterface::Value> value;
+        std::uint32_t reference_count;
+        std::string_view references;
+    };
+}  // namespace
+
+void SheetSnapshot::Save(const Sheet& sheet, std::ostream& output) {
+    OutputBuffer buffer(output);
+    Save(sheet, buffer);
+}
+
+void SheetSnapshot::Save(const Sheet& sheet, int fd) {
+    OutputBuffer buffer(fd);
+    Save(sheet, buffer);
+}
+
+void SheetSnapshot::Save(const Sheet& sheet, OutputBuffer& output) {
+    constexpr int TILE_SIZE = Sheet::TILE_SIZE;
+    struct Entry {
+        Position pos;
+        const Cell* cell;
+    };
+    // the index of a cell is the number of cells before its tile plus its
+    // rank among the cells of the tile
+    struct TileCells {
+        std::uint32_t first_index = 0;
+        std::array<std::uint8_t, TILE_SIZE * TILE_SIZE> ranks{};
+    };
+    std::vector<std::uint32_t> tile_keys;
+    tile_keys.reserve(sheet.tiles_.size());
+    for (const auto& [key, tile] : sheet.tiles_) {
+        tile_keys.push_back(key);
+    }
+    std::sort(tile_keys.begin(), tile_keys.end());
+    std::unordered_map<std::uint32_t, TileCells> tile_cells;
+    tile_cells.reserve(tile_keys.size());
+    std::vector<Entry> cells;
+    for (std::uint32_t key : tile_keys) {
+        const Sheet::Tile& tile = *sheet.tiles_.at(key);
+        TileCells& indexes = tile_cells[key];
+        indexes.first_index = static_cast<std::uint32_t>(cells.size());
+        const int tile_row = key / (Position::MAX_COLS / TILE_SIZE);
+        const int tile_col = key % (Position::MAX_COLS / TILE_SIZE);
+        for (int index = 0; index < TILE_SIZE * TILE_SIZE; ++index) {
+            if (tile.cells[index] == nullptr) continue;
+            indexes.ranks[index] = static_cast<std::uint8_t>(cells.size() - indexes.first_index);
+            cells.push_back({ { tile_row * TILE_SIZE + index / TILE_SIZE, tile_col * TILE_SIZE + index % TILE_SIZE },
+                              tile.cells[index] });
+        }
+    }
+    const auto find_index = [&tile_cells](Position pos) {
+        const TileCells& indexes = tile_cells.at(Sheet::TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE));
+        return indexes.first_index + indexes.ranks[Sheet::TileIndex(pos)];
+    };
+
+    // formulas filled down share a template and mostly follow each other
+    std::unordered_map<const FormulaAST*, std::uint32_t> template_indexes;
+    std::vector<const FormulaAST*> templates;
+    for (const Entry& entry : cells) {
+        if (entry.cell->kind_ != Cell::Kind::Formula) continue;
+        const FormulaAST* ast = entry.cell->payload_.formula->formula->GetAST().get();
+        if (!templates.empty() && templates.back() == ast) continue;
+        if (template_indexes.emplace(ast, static_cast<std::uint32_t>(templates.size())).second) {
+            templates.push_back(ast);
+        }
+    }
+
+    Writer writer(output);
+    output.Write(MAGIC);
+    writer.Write(VERSION);
+    writer.Write(BYTE_ORDER_MARK);
+    writer.Write(static_cast<std::uint32_t>(templates.size()));
+    writer.Write(static_cast<std::uint32_t>(cells.size()));
+    writer.Write(sheet.next_cell_order_);
+    writer.Write(sheet.lowest_cell_order_);
+    for (const FormulaAST* ast : templates) {
+        writer.WriteBytes(ast->Serialize());
+    }
+
+    const FormulaAST* last_ast = nullptr;
+    std::uint32_t last_template = 0;
+    for (const auto& [pos, cell] : cells) {
+        writer.WritePosition(pos);
+        writer.Write(cell->order_);
+        switch (cell->kind_) {
+        case Cell::Kind::Empty:
+            writer.Write(CellKind::EMPTY);
+            break;
+        case Cell::Kind::ShortText:
+        case Cell::Kind::LongText:
+            writer.Write(CellKind::TEXT);
+            writer.WriteBytes(cell->GetTextView());
+            break;
+        case Cell::Kind::ShortNumber:
+        case Cell::Kind::LongNumber:
+            writer.Write(CellKind::NUMBER);
+            writer.WriteBytes(cell->GetTextView());
+            writer.Write(std::get<double>(*cell->GetCachedNumber()));
+            break;
+        case Cell::Kind::Formula: {
+            const Cell::FormulaData& data = *cell->payload_.formula;
+            const FormulaAST* ast = data.formula->GetAST().get();
+            if (ast != last_ast) {
+                last_ast = ast;
+                last_template = template_indexes.at(ast);
+            }
+            const Position offset = data.formula->GetOffset();
+            writer.Write(CellKind::FORMULA);
+            writer.Write(last_template);
+            writer.WritePosition(offset);
+            const std::optional<FormulaInterface::Value> value = data.cashe.Load();
+            if (!value) {
+                writer.Write(ValueKind::NONE);
+            }
+            else if (const double* number = std::get_if<double>(&*value)) {
+                writer.Write(ValueKind::NUMBER);
+                writer.Write(*number);
+            }
+            else {
+                writer.Write(ValueKind::ERROR);
+                writer.Write(static_cast<std::uint8_t>(std::get<FormulaError>(*value).GetCategory()));
+            }
+            // data.ref_cells[i] is at ast->GetReferencedCells()[i] + offset
+            writer.Write(static_cast<std::uint32_t>(data.ref_cells.size()));
+            for (Position reference : ast->GetReferencedCells()) {
+                writer.Write(find_index(Shifted(reference, offset)));
+            }
+            break;
+        }
+        }
+    }
+    output.Flush();
+}
+
+std::unique_ptr<Sheet> SheetSnapshot::Load(std::string_view data) {
+    constexpr int TILE_SIZE = Sheet::TILE_SIZE;
+    Reader reader(data);
+    if (data.size() < MAGIC.size() || reader.Take(MAGIC.size()) != MAGIC) {
+        throw SnapshotError("Not a sheet snapshot");
+    }
+    if (reader.Read<std::uint32_t>() != VERSION) {
+        throw SnapshotError("Unsupported snapshot version");
+    }
+    if (reader.Read<std::uint32_t>() != BYTE_ORDER_MARK) {
+        throw SnapshotError("Snapshot of another byte order");
+    }
+    const auto template_count = reader.Read<std::uint32_t>();
+    const auto cell_count = reader.Read<std::uint32_t>();
+    const auto next_cell_order = reader.Read<std::uint32_t>();
+    const auto lowest_cell_order = reader.Read<std::uint32_t>();
+
+    std::vector<std::shared_ptr<const FormulaAST>> templates;
+    // the smallest template and cell take 5 and 13 bytes, the counts are
+    // checked before anything is reserved for them
+    if (template_count > reader.GetRemaining() / 5 || cell_count > reader.GetRemaining() / 13) {
+        throw SnapshotError("Truncated snapshot");
+    }
+    templates.reserve(template_count);
+    for (std::uint32_t i = 0; i < template_count; ++i) {
+        const std::string_view bytes = reader.ReadBytes();
+        try {
+            templates.push_back(std::make_shared<const FormulaAST>(FormulaAST::Deserialize(bytes)));
+        }
+        catch (const std::exception& e) {
+            throw SnapshotError(std::string("Invalid formula: ") + e.what());
+        }
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    std::vector<Cell*> cells;
+    std::vector<Position> positions;
+    std::vector<FormulaRecord> formulas;
+    cells.reserve(cell_count);
+    positions.reserve(cell_count);
+    // cells come tile by tile, row by row in a tile
+    Sheet::Tile* tile = nullptr;
+    std::uint64_t last_key = 0;
+    for (std::uint32_t i = 0; i < cell_count; ++i) {
+        const Position pos = reader.ReadPosition();
+        if (!pos.IsValid()) {
+            throw SnapshotError("Invalid cell position");
+        }
+        const std::uint32_t tile_key = Sheet::TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE);
+        const std::uint64_t key = std::uint64_t{ tile_key } * TILE_SIZE * TILE_SIZE + Sheet::TileIndex(pos);
+        if (i > 0 && key <= last_key) {
+            throw SnapshotError("Invalid cell position");
+        }
+        if (tile == nullptr || i == 0 || key / (TILE_SIZE * TILE_SIZE) != last_key / (TILE_SIZE * TILE_SIZE)) {
+            std::unique_ptr<Sheet::Tile>& new_tile = sheet->tiles_[tile_key];
+            new_tile = std::make_unique<Sheet::Tile>();
+            tile = new_tile.get();
+        }
+        last_key = key;
+        const auto order = reader.Read<std::uint32_t>();
+        if (order < lowest_cell_order || order >= next_cell_order) {
+            throw SnapshotError("Invalid cell order");
+        }
+        Cell& cell = sheet->MakeCell(*tile, pos);
+        cell.order_ = order;
+        cells.push_back(&cell);
+        positions.push_back(pos);
+
+        const auto kind = reader.Read<CellKind>();
+        switch (kind) {
+        case CellKind::EMPTY:
+            break;
+        case CellKind::TEXT:
+        case CellKind::NUMBER: {
+            const std::string_view text = reader.ReadBytes();
+            if (text.empty()) {
+                throw SnapshotError("Empty text cell");
+            }
+            std::optional<double> number;
+            if (kind == CellKind::NUMBER) {
+                number = reader.Read<double>();
+            }
+            cell.PutContent(Cell::MakeTextContent(text, number));
+            break;
+        }
+        case CellKind::FORMULA: {
+            FormulaRecord formula;
+            formula.cell = i;
+            formula.formula_template = reader.Read<std::uint32_t>();
+            if (formula.formula_template >= templates.size()) {
+                throw SnapshotError("Invalid formula template");
+            }
+            formula.offset = reader.ReadPosition();
+            switch (reader.Read<ValueKind>()) {
+            case ValueKind::NONE:
+                break;
+            case ValueKind::NUMBER:
+                formula.value = reader.Read<double>();
+                break;
+            case ValueKind::ERROR: {
+                const auto category = reader.Read<std::uint8_t>();
+                if (category > static_cast<std::uint8_t>(FormulaError::Category::Div0)) {
+                    throw SnapshotError("Invalid formula value");
+                }
+                formula.value = FormulaError(static_cast<FormulaError::Category>(category));
+                break;
+            }
+            default:
+                throw SnapshotError("Invalid formula value");
+            }
+            formula.reference_count = reader.Read<std::uint32_t>();
+            if (formula.reference_count > reader.GetRemaining() / sizeof(std::uint32_t)) {
+                throw SnapshotError("Truncated snapshot");
+            }
+            formula.references = reader.Take(formula.reference_count * sizeof(std::uint32_t));
+            formulas.push_back(formula);
+            break;
+        }
+        default:
+            throw SnapshotError("Invalid cell kind");
+        }
+    }
+    if (reader.GetRemaining() != 0) {
+        throw SnapshotError("Unexpected data after the cells");
+    }
+    std::vector<std::uint32_t> orders;
+    orders.reserve(cells.size());
+    for (const Cell* cell : cells) {
+        orders.push_back(cell->order_);
+    }
+    std::sort(orders.begin(), orders.end());
+    if (std::adjacent_find(orders.begin(), orders.end()) != orders.end()) {
+        throw SnapshotError("Invalid cell order");
+    }
+
+    // the graph is taken as stored, only checked to be consistent with the
+    // formulas: a reference must be ordered before the formula, so that
+    // no cycle is loaded
+    std::vector<std::unique_ptr<Cell::FormulaData>> formula_data;
+    std::vector<std::uint32_t> parent_counts(cells.size());
+    formula_data.reserve(formulas.size());
+    for (const FormulaRecord& record : formulas) {
+        const Cell& cell = *cells[record.cell];
+        const Position pos = positions[record.cell];
+        const std::shared_ptr<const FormulaAST>& ast = templates[record.formula_template];
+        const std::vector<Position>& references = ast->GetReferencedCells();
+        if (references.size() != record.reference_count) {
+            throw SnapshotError("Invalid formula references");
+        }
+        auto formula = std::make_unique<Cell::FormulaData>();
+        formula->formula = MakeFormula(ast, record.offset);
+        formula->ref_cells.reserve(references.size());
+        Reader indexes(record.references);
+        for (Position reference : references) {
+            const auto index = indexes.Read<std::uint32_t>();
+            if (index >= cells.size() || !(positions[index] == Shifted(reference, record.offset))
+                || cells[index]->order_ >= cell.order_) {
+                throw SnapshotError("Invalid formula references");
+            }
+            formula->ref_cells.push_back(cells[index]);
+            ++parent_counts[index];
+        }
+        formula->ranges = formula->formula->GetReferencedRanges();
+        for (const Range& range : formula->ranges) {
+            if (!range.first.IsValid() || !range.last.IsValid() || range.Contains(pos)) {
+                throw SnapshotError("Invalid formula range");
+            }
+        }
+        formula->sheet = sheet.get();
+        formula->pos = pos;
+        if (record.value) formula->cashe.Store(*record.value);
+        formula_data.push_back(std::move(formula));
+    }
+    // likewise a formula in a range must be ordered before the formulas
+    // reading the range
+    RangeIndex<std::uint32_t> range_readers;
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        for (const Range& range : formula_data[i]->ranges) {
+            range_readers.Insert(range, cells[formulas[i].cell]->order_);
+        }
+    }
+    if (range_readers.GetSize() > 0) {
+        std::vector<std::uint32_t> reader_orders;
+        for (const FormulaRecord& record : formulas) {
+            reader_orders.clear();
+            range_readers.Find(positions[record.cell], reader_orders);
+            for (std::uint32_t order : reader_orders) {
+                if (order <= cells[record.cell]->order_) {
+                    throw SnapshotError("Invalid formula range");
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < cells.size(); ++i) {
+        cells[i]->parent_cells.reserve(parent_counts[i]);
+    }
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        Cell& cell = *cells[formulas[i].cell];
+        const Position pos = positions[formulas[i].cell];
+        cell.payload_.formula = formula_data[i].release();
+        cell.kind_ = Cell::Kind::Formula;
+        cell.LinkReferences();
+        if (const auto value = cell.payload_.formula->cashe.Load()) {
+            sheet->StoreFormulaValue(pos, *value);
+        }
+        else {
+            sheet->MarkDirty(&cell, pos);
+        }
+    }
+
+    // what UpdatePrintable does cell by cell
+    std::vector<int> printable_rows(Position::MAX_ROWS);
+    std::vector<int> printable_cols(Position::MAX_COLS);
+    tile = nullptr;
+    std::uint32_t tile_key = 0;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (cells[i]->IsEmpty()) continue;
+        const Position pos = positions[i];
+        const std::uint32_t key = Sheet::TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE);
+        if (tile == nullptr || key != tile_key) {
+            tile = sheet->tiles_.at(key).get();
+            tile_key = key;
+        }
+        tile->printable[pos.row % TILE_SIZE] |= 1u << (pos.col % TILE_SIZE);
+        ++printable_rows[pos.row];
+        ++printable_cols[pos.col];
+    }
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        if (printable_rows[row] > 0) sheet->printable_rows_.emplace_hint(sheet->printable_rows_.end(), row, printable_rows[row]);
+    }
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        if (printable_cols[col] > 0) sheet->printable_cols_.emplace_hint(sheet->printable_cols_.end(), col, printable_cols[col]);
+    }
+    sheet->next_cell_order_ = next_cell_order;
+    sheet->lowest_cell_order_ = lowest_cell_order;
+    return sheet;
+}
+
+#ifdef _WIN32
+std::unique_ptr<Sheet> SheetSnapshot::LoadFile(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw SnapshotError("Cannot open " + path);
+    }
+    const std::string data(std::istreambuf_iterator<char>(input), {});
+    return Load(data);
+}
+#else
+std::unique_ptr<Sheet> SheetSnapshot::LoadFile(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        const int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    const size_t size = status.st_size;
+    if (size == 0) {
+        close(fd);
+        return Load({});
+    }
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int error = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::system_error(error, std::generic_category(), path);
+    }
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+    try {
+        std::unique_ptr<Sheet> sheet = Load(std::string_view(static_cast<const char*>(data), size));
+        munmap(data, size);
+        return sheet;
+    }
+    catch (...) {
+        munmap(data, size);
+        throw;
+    }
+}
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Saves a sheet in a binary form that loads without parsing anything: the
+// formulas are stored parsed, each shared template once, along with the
+// dependency graph (references as cell indexes and the topological order)
+// and the cached values, so loading only rebuilds the cells and links them.
+//
+// The data is read where it lies, a mapped file is loaded without copying
+// it first. A snapshot is read on machines of the byte order it was written
+// on; a snapshot of another version or byte order, truncated or inconsistent
+// is rejected with SnapshotError.
+class SheetSnapshot {
+public:
+    static constexpr std::uint32_t VERSION = 1;
+
+    static void Save(const Sheet& sheet, std::ostream& output);
+    // throws std::system_error if writing to fd fails
+    static void Save(const Sheet& sheet, int fd);
+
+    static std::unique_ptr<Sheet> Load(std::string_view data);
+    // maps the file into memory and loads it
+    static std::unique_ptr<Sheet> LoadFile(const std::string& path);
+
+private:
+    static void Save(const Sheet& sheet, OutputBuffer& output);
+};
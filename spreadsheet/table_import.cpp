@@ -0,0 +1,160 @@
+#include "table_import.h"
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+    // splits the input into fields as it comes, a field may span chunks
+    class FieldReader {
+    public:
+        FieldReader(TableImporter::Format format, std::vector<std::pair<Position, std::string>>& cells)
+            : is_csv_(format == TableImporter::Format::Csv)
+            , delimiter_(is_csv_ ? ',' : '\t')
+            , cells_(cells) {
+        }
+
+        void Read(std::string_view chunk) {
+            size_t i = 0;
+            while (i < chunk.size()) {
+                switch (state_) {
+                case State::Unquoted:
+                    i = ReadUnquoted(chunk, i);
+                    break;
+                case State::Quoted:
+                    i = ReadQuoted(chunk, i);
+                    break;
+                case State::QuoteInQuoted:
+                    i = ReadAfterQuote(chunk, i);
+                    break;
+                }
+            }
+        }
+
+        // the last line need not end with a line break
+        void Finish() {
+            if (state_ == State::Quoted) {
+                Fail("unterminated quoted field");
+            }
+            if (!field_.empty() || col_ > 0) {
+                EndLine();
+            }
+        }
+
+    private:
+        enum class State {
+            Unquoted,
+            Quoted,
+            // a quote read in a quoted field, it either ends the field or
+            // is the first of a doubled quote
+            QuoteInQuoted,
+        };
+
+        size_t ReadUnquoted(std::string_view chunk, size_t i) {
+            // a quote further into a field is taken as it is
+            if (is_csv_ && field_.empty() && chunk[i] == '"') {
+                state_ = State::Quoted;
+                return i + 1;
+            }
+            size_t end = i;
+            while (end < chunk.size() && chunk[end] != delimiter_ && chunk[end] != '\n') ++end;
+            field_.append(chunk.substr(i, end - i));
+            if (end == chunk.size()) return end;
+
+            if (chunk[end] == '\n') {
+                if (is_csv_ && !field_.empty() && field_.back() == '\r') {
+                    field_.pop_back();
+                }
+                EndLine();
+            }
+            else {
+                EndField();
+            }
+            return end + 1;
+        }
+
+        size_t ReadQuoted(std::string_view chunk, size_t i) {
+            const size_t end = chunk.find('"', i);
+            if (end == std::string_view::npos) {
+                field_.append(chunk.substr(i));
+                return chunk.size();
+            }
+            field_.append(chunk.substr(i, end - i));
+            state_ = State::QuoteInQuoted;
+            return end + 1;
+        }
+
+        size_t ReadAfterQuote(std::string_view chunk, size_t i) {
+            const char c = chunk[i];
+            if (c == '"' && !after_carriage_return_) {
+                field_.push_back('"');
+                state_ = State::Quoted;
+            }
+            else if (c == '\r' && !after_carriage_return_) {
+                after_carriage_return_ = true;
+            }
+            else if (c == '\n') {
+                state_ = State::Unquoted;
+                EndLine();
+            }
+            else if (c == delimiter_ && !after_carriage_return_) {
+                state_ = State::Unquoted;
+                EndField();
+            }
+            else {
+                Fail("text after a closing quote");
+            }
+            return i + 1;
+        }
+
+        void EndField() {
+            if (!field_.empty()) {
+                const Position pos{ row_, col_ };
+                if (!pos.IsValid()) {
+                    Fail("the field is outside of the sheet");
+                }
+                cells_.emplace_back(pos, std::move(field_));
+                field_.clear();
+            }
+            after_carriage_return_ = false;
+            ++col_;
+        }
+
+        void EndLine() {
+            EndField();
+            ++row_;
+            col_ = 0;
+        }
+
+        [[noreturn]] void Fail(const std::string& message) const {
+            throw ImportError("Row " + std::to_string(row_ + 1) + ": " + message);
+        }
+
+        const bool is_csv_;
+        const char delimiter_;
+        std::vector<std::pair<Position, std::string>>& cells_;
+        State state_ = State::Unquoted;
+        std::string field_;
+        bool after_carriage_return_ = false;
+        int row_ = 0;
+        int col_ = 0;
+    };
+}  // namespace
+
+void TableImporter::Import(Sheet& sheet, std::istream& input, Format format) {
+    std::vector<std::pair<Position, std::string>> cells;
+    FieldReader reader(format, cells);
+    std::string chunk(CHUNK_SIZE, '\0');
+    while (input) {
+        input.read(chunk.data(), chunk.size());
+        reader.Read(std::string_view(chunk.data(), input.gcount()));
+    }
+    if (input.bad()) {
+        throw ImportError("Failed to read the table");
+    }
+    reader.Finish();
+    // the cells are read in increasing order, so SetCells looks for no
+    // repeated positions
+    sheet.SetCells(std::move(cells));
+}
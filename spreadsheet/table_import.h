@@ -0,0 +1,41 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <istream>
+#include <stdexcept>
+
+class ImportError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Reads a table of cell texts into a sheet: every line is a row, the first
+// field of the first line goes to A1, and a field is set as with SetCell.
+// Empty fields set nothing, so what Sheet::PrintTextsCsv writes reads back
+// as the sheet it was printed from. So does what Sheet::PrintTexts writes,
+// as long as no text holds a tab or a line break: PrintTexts writes them as
+// they are, and they read back as more fields or rows.
+//
+// The input is read in chunks of CHUNK_SIZE bytes, and the cells are set
+// once it is read, with one Sheet::SetCells: the formulas are parsed on the
+// threads of Sheet::SetThreadCount, each shape once, and references are
+// linked and cycles checked in one pass over the whole table. If a text is
+// rejected the sheet is left as it was.
+class TableImporter {
+public:
+    enum class Format {
+        // fields separated by tabs and taken as they are, as PrintTexts
+        // writes them
+        Tsv,
+        // fields separated by commas; a field in double quotes may hold
+        // commas, line breaks and doubled quotes; lines may end in \r\n
+        Csv,
+    };
+
+    static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+    // throws ImportError if the input is malformed or a field lies outside
+    // of the sheet, and what SetCells throws for a rejected text
+    static void Import(Sheet& sheet, std::istream& input, Format format = Format::Tsv);
+};
@@ -0,0 +1,252 @@
+#include "versioned_sheet.h"
+
+#include "cell.h"
+
+#include <atomic>
+
+int SheetVersion::GetSlot(Position pos, int level) {
+    const int shift = 2 * (LEVELS - 1 - level);
+    return ((pos.row >> shift) & 3) * 4 + ((pos.col >> shift) & 3);
+}
+
+const SheetVersion::Leaf* SheetVersion::FindLeaf(Position pos) const {
+    const Node* node = root_.get();
+    for (int level = 0; level + 1 < LEVELS && node != nullptr; ++level) {
+        node = static_cast<const Inner*>(node)->children[GetSlot(pos, level)].get();
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+std::string_view SheetVersion::GetText(Position pos) const {
+    const Leaf* leaf = FindLeaf(pos);
+    if (leaf == nullptr) return {};
+    return leaf->texts[GetSlot(pos, LEVELS - 1)];
+}
+
+const SheetVersion::Formula* SheetVersion::GetFormula(Position pos) const {
+    const Leaf* leaf = FindLeaf(pos);
+    if (leaf == nullptr) return nullptr;
+    const Formula& formula = leaf->formulas[GetSlot(pos, LEVELS - 1)];
+    return formula.ast != nullptr ? &formula : nullptr;
+}
+
+size_t SheetVersion::GetCellCount() const {
+    return root_ != nullptr ? root_->cell_count : 0;
+}
+
+SheetVersion SheetVersion::With(const Cells& cells) const {
+    return With(cells, {});
+}
+
+SheetVersion SheetVersion::With(const Cells& cells, const std::vector<Formula>& formulas) const {
+    static std::atomic<std::uint64_t> next_batch = 1;
+    const std::uint64_t batch = next_batch.fetch_add(1, std::memory_order_relaxed);
+
+    SheetVersion result = *this;
+    // the nodes on the path to a cell and the pointers holding them
+    std::array<Node*, LEVELS> path;
+    std::array<std::shared_ptr<Node>*, LEVELS> links;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const auto& [pos, text] = cells[i];
+        if (result.GetText(pos) == text) continue;
+        // nodes of other batches may be shared with other versions, they
+        // are copied before changing
+        std::shared_ptr<Node>* link = &result.root_;
+        for (int level = 0; level < LEVELS; ++level) {
+            std::shared_ptr<Node>& node = *link;
+            const bool is_leaf = level + 1 == LEVELS;
+            if (node == nullptr) {
+                node = is_leaf ? std::shared_ptr<Node>(std::make_shared<Leaf>())
+                               : std::shared_ptr<Node>(std::make_shared<Inner>());
+                node->batch = batch;
+            }
+            else if (node->batch != batch) {
+                node = is_leaf ? std::shared_ptr<Node>(std::make_shared<Leaf>(static_cast<const Leaf&>(*node)))
+                               : std::shared_ptr<Node>(std::make_shared<Inner>(static_cast<const Inner&>(*node)));
+                node->batch = batch;
+            }
+            path[level] = node.get();
+            links[level] = link;
+            if (!is_leaf) {
+                link = &static_cast<Inner&>(*node).children[GetSlot(pos, level)];
+            }
+        }
+
+        Leaf& leaf = static_cast<Leaf&>(*path[LEVELS - 1]);
+        std::string& slot = leaf.texts[GetSlot(pos, LEVELS - 1)];
+        const bool was_empty = slot.empty();
+        slot = text;
+        leaf.formulas[GetSlot(pos, LEVELS - 1)] = i < formulas.size() ? formulas[i] : Formula{};
+        if (was_empty) {
+            for (Node* node : path) ++node->cell_count;
+        }
+        else if (text.empty()) {
+            for (Node* node : path) --node->cell_count;
+            // the topmost node left without cells goes with its subtree
+            for (int level = 0; level < LEVELS; ++level) {
+                if (path[level]->cell_count == 0) {
+                    links[level]->reset();
+                    break;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+SheetVersion::Cells SheetVersion::Diff(const SheetVersion& other) const {
+    Cells out;
+    Diff(root_.get(), other.root_.get(), 0, Position{ 0, 0 }, out);
+    return out;
+}
+
+bool SheetVersion::IsSameAs(const SheetVersion& other) const {
+    return root_ == other.root_;
+}
+
+void SheetVersion::Diff(const Node* lhs, const Node* rhs, int level, Position origin, Cells& out) {
+    if (lhs == rhs) return;
+    if (level + 1 == LEVELS) {
+        const auto* lhs_leaf = static_cast<const Leaf*>(lhs);
+        const auto* rhs_leaf = static_cast<const Leaf*>(rhs);
+        for (int slot = 0; slot < FANOUT; ++slot) {
+            const std::string_view lhs_text = lhs_leaf != nullptr ? lhs_leaf->texts[slot] : std::string_view();
+            const std::string_view rhs_text = rhs_leaf != nullptr ? rhs_leaf->texts[slot] : std::string_view();
+            if (lhs_text != rhs_text) {
+                out.emplace_back(Position{ origin.row + slot / 4, origin.col + slot % 4 }, std::string(rhs_text));
+            }
+        }
+        return;
+    }
+    // the side of the square of cells under each child
+    const int size = 1 << (2 * (LEVELS - 1 - level));
+    const auto* lhs_inner = static_cast<const Inner*>(lhs);
+    const auto* rhs_inner = static_cast<const Inner*>(rhs);
+    for (int slot = 0; slot < FANOUT; ++slot) {
+        Diff(lhs_inner != nullptr ? lhs_inner->children[slot].get() : nullptr,
+             rhs_inner != nullptr ? rhs_inner->children[slot].get() : nullptr, level + 1,
+             Position{ origin.row + slot / 4 * size, origin.col + slot % 4 * size }, out);
+    }
+}
+
+VersionedSheet::VersionedSheet()
+    : versions_(1) {
+}
+
+void VersionedSheet::SetCell(Position pos, std::string text) {
+    SetCells({ { pos, std::move(text) } });
+}
+
+void VersionedSheet::SetCells(SheetVersion::Cells cells) {
+    // the texts recorded are those the cells end up with, formulas as the
+    // sheet prints them
+    std::vector<Position> positions;
+    positions.reserve(cells.size());
+    for (const auto& [pos, text] : cells) {
+        positions.push_back(pos);
+    }
+    sheet_.SetCells(std::move(cells));
+    Record(positions);
+}
+
+const CellInterface* VersionedSheet::GetCell(Position pos) const {
+    return sheet_.GetCell(pos);
+}
+
+CellInterface* VersionedSheet::GetCell(Position pos) {
+    return sheet_.GetCell(pos);
+}
+
+void VersionedSheet::ClearCell(Position pos) {
+    sheet_.ClearCell(pos);
+    Record({ pos });
+}
+
+Size VersionedSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+}
+
+void VersionedSheet::PrintValues(std::ostream& output) const {
+    sheet_.PrintValues(output);
+}
+
+void VersionedSheet::PrintTexts(std::ostream& output) const {
+    sheet_.PrintTexts(output);
+}
+
+const Sheet& VersionedSheet::GetSheet() const {
+    return sheet_;
+}
+
+void VersionedSheet::Recalculate() {
+    sheet_.Recalculate();
+}
+
+const SheetVersion& VersionedSheet::GetVersion() const {
+    return versions_[current_];
+}
+
+void VersionedSheet::Restore(const SheetVersion& version) {
+    Apply(version);
+    versions_.erase(versions_.begin() + current_ + 1, versions_.end());
+    versions_.push_back(version);
+    ++current_;
+}
+
+bool VersionedSheet::CanUndo() const {
+    return current_ > 0;
+}
+
+bool VersionedSheet::CanRedo() const {
+    return current_ + 1 < versions_.size();
+}
+
+void VersionedSheet::Undo() {
+    if (!CanUndo()) return;
+    Apply(versions_[current_ - 1]);
+    --current_;
+}
+
+void VersionedSheet::Redo() {
+    if (!CanRedo()) return;
+    Apply(versions_[current_ + 1]);
+    ++current_;
+}
+
+void VersionedSheet::Apply(const SheetVersion& version) {
+    SheetVersion::Cells changes = versions_[current_].Diff(version);
+    // the formulas the version keeps are taken as they are; the removed
+    // cells are set empty along with the others, so that the formulas
+    // referencing them are checked and invalidated once, then removed
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(changes.size());
+    std::vector<Position> removed;
+    for (const auto& [pos, text] : changes) {
+        const SheetVersion::Formula* formula = version.GetFormula(pos);
+        formulas.push_back(formula != nullptr ? MakeFormula(formula->ast, formula->offset) : nullptr);
+        if (text.empty()) removed.push_back(pos);
+    }
+    sheet_.SetCells(std::move(changes), std::move(formulas));
+    sheet_.RemoveEmptyCells(removed);
+}
+
+void VersionedSheet::Record(const std::vector<Position>& positions) {
+    SheetVersion::Cells texts;
+    std::vector<SheetVersion::Formula> formulas;
+    texts.reserve(positions.size());
+    formulas.reserve(positions.size());
+    for (Position pos : positions) {
+        const Cell* cell = static_cast<const Cell*>(sheet_.GetCell(pos));
+        texts.emplace_back(pos, cell != nullptr ? cell->GetText() : std::string());
+        const FormulaInterface* formula = cell != nullptr ? cell->GetFormula() : nullptr;
+        formulas.push_back(formula != nullptr ? SheetVersion::Formula{ formula->GetAST(), formula->GetOffset() }
+                                              : SheetVersion::Formula{});
+    }
+    SheetVersion version = versions_[current_].With(texts, formulas);
+    // a change that leaves every text as it was is no step, and keeps the
+    // undone ones
+    if (version.IsSameAs(versions_[current_])) return;
+    versions_.erase(versions_.begin() + current_ + 1, versions_.end());
+    versions_.push_back(std::move(version));
+    ++current_;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The texts of the cells of a sheet at one moment, immutable once made, with
+// the parsed formulas of the formula texts where they are known.
+//
+// The texts live in a tree of 16-way nodes over 4x4 blocks of cells, two
+// bits of the row and two of the column per level. A version made from
+// another copies only the nodes on the paths to the cells it changes and
+// shares all the others, so copying a version costs a pointer and an edit
+// adds memory for the cells it changes alone.
+class SheetVersion {
+public:
+    using Cells = std::vector<std::pair<Position, std::string>>;
+
+    // a sheet without cells
+    SheetVersion() = default;
+
+    // a parsed formula, its expression possibly shared with other formulas,
+    // see FormulaInterface::GetAST
+    struct Formula {
+        std::shared_ptr<const FormulaAST> ast;
+        Position offset;
+    };
+
+    // "" for a cell without text
+    std::string_view GetText(Position pos) const;
+
+    // the parsed formula kept with the text of the cell, nullptr if there
+    // is none
+    const Formula* GetFormula(Position pos) const;
+
+    size_t GetCellCount() const;
+
+    // this version with the texts of cells, "" removing a cell; a later
+    // text for the same position replaces an earlier one
+    SheetVersion With(const Cells& cells) const;
+    // the same, keeping formulas[i] with the text of cells[i] where its ast
+    // is set; formulas may be shorter than cells
+    SheetVersion With(const Cells& cells, const std::vector<Formula>& formulas) const;
+
+    // the cells whose texts differ in other, with their texts there ("" for
+    // cells other does not have); the subtrees the two versions share are
+    // skipped, so the cost follows the number of differing cells
+    Cells Diff(const SheetVersion& other) const;
+
+    // true when other shares the whole tree of this version, as With gives
+    // when none of its texts change anything
+    bool IsSameAs(const SheetVersion& other) const;
+
+private:
+    static constexpr int LEVELS = 7;
+    static constexpr int FANOUT = 16;
+    static_assert(Position::MAX_ROWS <= 1 << (2 * LEVELS) && Position::MAX_COLS <= 1 << (2 * LEVELS));
+
+    struct Node {
+        // the With call that made the node, which alone may still change it
+        std::uint64_t batch = 0;
+        size_t cell_count = 0;
+    };
+
+    struct Inner : Node {
+        std::array<std::shared_ptr<Node>, FANOUT> children;
+    };
+
+    struct Leaf : Node {
+        std::array<std::string, FANOUT> texts;
+        std::array<Formula, FANOUT> formulas;
+    };
+
+    // the leaf holding pos, nullptr if there is none
+    const Leaf* FindLeaf(Position pos) const;
+
+    static int GetSlot(Position pos, int level);
+
+    // appends the cells of the subtree of lhs whose texts differ in rhs;
+    // either may be null, origin is the first cell the subtrees cover
+    static void Diff(const Node* lhs, const Node* rhs, int level, Position origin, Cells& out);
+
+    std::shared_ptr<Node> root_;
+};
+
+// A sheet keeping every version it went through: each change (SetCell,
+// SetCells, ClearCell, Restore) is one step that Undo takes back and Redo
+// repeats. A new change drops the undone steps.
+//
+// Going to another version changes only the cells that differ, in one
+// SetCells batch, instead of replaying the steps in between. A version keeps
+// the parsed formula of every formula the sheet had, so the formulas are not
+// parsed again; the references of the changed cells are still linked, their
+// cycles checked and their orders fixed as SetCells does. The sheet is read
+// through GetSheet and changed only through this class, so that every change
+// is recorded.
+class VersionedSheet : public SheetInterface {
+public:
+    VersionedSheet();
+
+    void SetCell(Position pos, std::string text) override;
+
+    // one step however many cells change, see Sheet::SetCells
+    void SetCells(SheetVersion::Cells cells);
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    const Sheet& GetSheet() const;
+
+    void Recalculate();
+
+    // the texts of the sheet now; the version is kept however the sheet
+    // changes later
+    const SheetVersion& GetVersion() const;
+
+    // gives the sheet the texts of a version taken from this sheet or any
+    // other, as a new step
+    void Restore(const SheetVersion& version);
+
+    bool CanUndo() const;
+    bool CanRedo() const;
+
+    // the sheet as it was before the last step not undone, nothing if
+    // there is none
+    void Undo();
+    // the sheet as it was after the last step undone, nothing if there is
+    // none
+    void Redo();
+
+private:
+    // changes the cells of the sheet whose texts differ in version
+    void Apply(const SheetVersion& version);
+    // records as a step the texts the sheet has now at positions
+    void Record(const std::vector<Position>& positions);
+
+    Sheet sheet_;
+    // versions_[current_] is the version of sheet_, those after it are undone
+    std::vector<SheetVersion> versions_;
+    size_t current_ = 0;
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A fixed set of threads working through a dynamic set of items. Every
+// thread has its own deque: it takes the newest item of its own deque, and
+// when that is empty steals the oldest item of another thread's deque.
+// Processing an item may push new items, so dependent work is started as
+// soon as it becomes ready and mostly stays on the thread that enabled it.
+// A thread finding nothing to take retries a few times, then sleeps until
+// an item is pushed or the run is over.
+template <typename T>
+class WorkStealingPool {
+public:
+    // the calling thread takes part in Run, so thread_count - 1 threads are started
+    explicit WorkStealingPool(size_t thread_count)
+        : queues_(thread_count) {
+        for (size_t i = 1; i < thread_count; ++i) {
+            threads_.emplace_back([this, i] {
+                WorkerLoop(i);
+            });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        job_started_.notify_all();
+        for (std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    size_t GetThreadCount() const {
+        return queues_.size();
+    }
+
+    // hands out work to the thread processing an item
+    class Worker {
+    public:
+        void Push(T item) {
+            pool_.Push(index_, std::move(item));
+        }
+
+    private:
+        friend class WorkStealingPool;
+
+        Worker(WorkStealingPool& pool, size_t index)
+            : pool_(pool), index_(index) {
+        }
+
+        WorkStealingPool& pool_;
+        size_t index_;
+    };
+
+    // calls process(item, worker) for every item and for everything pushed
+    // while processing, returns once all of them are processed;
+    // process must not throw
+    void Run(const std::vector<T>& items, std::function<void(T, Worker&)> process) {
+        if (items.empty()) return;
+        for (size_t i = 0; i < items.size(); ++i) {
+            Push(i % queues_.size(), items[i]);
+        }
+        {
+            std::lock_guard lock(mutex_);
+            process_ = std::move(process);
+            busy_threads_ = threads_.size();
+            ++job_;
+        }
+        job_started_.notify_all();
+
+        Work(0);
+
+        std::unique_lock lock(mutex_);
+        job_finished_.wait(lock, [this] {
+            return busy_threads_ == 0;
+        });
+        process_ = nullptr;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<T> items;
+    };
+
+    void Push(size_t index, T item) {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        {
+            Queue& queue = queues_[index];
+            std::lock_guard lock(queue.mutex);
+            queue.items.push_back(std::move(item));
+        }
+        // either a thread going to sleep sees the new epoch, or this sees
+        // it sleeping and wakes it
+        pushes_.fetch_add(1, std::memory_order_seq_cst);
+        if (sleeping_threads_.load(std::memory_order_seq_cst) != 0) {
+            std::lock_guard lock(idle_mutex_);
+            work_pushed_.notify_one();
+        }
+    }
+
+    std::optional<T> Take(size_t index) {
+        {
+            Queue& own = queues_[index];
+            std::lock_guard lock(own.mutex);
+            if (!own.items.empty()) {
+                T item = std::move(own.items.back());
+                own.items.pop_back();
+                return item;
+            }
+        }
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& other = queues_[(index + i) % queues_.size()];
+            std::lock_guard lock(other.mutex);
+            if (!other.items.empty()) {
+                T item = std::move(other.items.front());
+                other.items.pop_front();
+                return item;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // an item counts as pending until it is processed, including the
+    // items it pushes, so no work can appear once pending_ reaches zero
+    void Work(size_t index) {
+        Worker worker(*this, index);
+        size_t misses = 0;
+        while (pending_.load(std::memory_order_acquire) != 0) {
+            const size_t pushes = pushes_.load(std::memory_order_seq_cst);
+            std::optional<T> item = Take(index);
+            if (!item) {
+                if (++misses < SPINS_BEFORE_SLEEP) {
+                    std::this_thread::yield();
+                }
+                else {
+                    Sleep(pushes);
+                    misses = 0;
+                }
+                continue;
+            }
+            misses = 0;
+            process_(std::move(*item), worker);
+            // the last item wakes the sleeping threads to return
+            if (pending_.fetch_sub(1, std::memory_order_seq_cst) == 1
+                && sleeping_threads_.load(std::memory_order_seq_cst) != 0) {
+                std::lock_guard lock(idle_mutex_);
+                work_pushed_.notify_all();
+            }
+        }
+    }
+
+    // waits until an item is pushed after the pushes-th one or nothing is
+    // pending any more
+    void Sleep(size_t pushes) {
+        std::unique_lock lock(idle_mutex_);
+        sleeping_threads_.fetch_add(1, std::memory_order_seq_cst);
+        work_pushed_.wait(lock, [&] {
+            return pushes_.load(std::memory_order_seq_cst) != pushes
+                || pending_.load(std::memory_order_seq_cst) == 0;
+        });
+        sleeping_threads_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void WorkerLoop(size_t index) {
+        size_t last_job = 0;
+        while (true) {
+            {
+                std::unique_lock lock(mutex_);
+                job_started_.wait(lock, [&] {
+                    return stopping_ || job_ != last_job;
+                });
+                if (stopping_) return;
+                last_job = job_;
+            }
+            Work(index);
+            {
+                std::lock_guard lock(mutex_);
+                --busy_threads_;
+            }
+            job_finished_.notify_one();
+        }
+    }
+
+    // failed attempts to take an item before a thread sleeps
+    static constexpr size_t SPINS_BEFORE_SLEEP = 16;
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> pending_ = 0;
+    // counts every push, to tell a sleeping thread that there is new work
+    std::atomic<size_t> pushes_ = 0;
+    std::atomic<size_t> sleeping_threads_ = 0;
+    std::mutex idle_mutex_;
+    std::condition_variable work_pushed_;
+
+    // guards the fields below
+    std::mutex mutex_;
+    std::condition_variable job_started_;
+    std::condition_variable job_finished_;
+    std::function<void(T, Worker&)> process_;
+    size_t job_ = 0;
+    size_t busy_threads_ = 0;
+    bool stopping_ = false;
+};